@@ -84,6 +84,20 @@ int block_halt();
  **/
 int block_read(blockno_t block, void *buf);
 
+/**
+ * \brief Read a run of consecutive blocks into memory in one transfer.
+ * 
+ * Reads count contiguous blocks starting at the given block number into a pre-allocated area of
+ * count * #BLOCK_SIZE bytes.  Drivers for devices with a multi-block command (e.g. CMD18 on SD
+ * cards) should use it as this is where large sequential reads spend their time.
+ * 
+ * \param block is the number of the first block to read
+ * \param count is the number of blocks to read
+ * \param buf is a pointer to count * #BLOCK_SIZE bytes already allocated in memory
+ * \return 0 on success, anything else may indicate an error.
+ **/
+int block_read_multi(blockno_t block, blockno_t count, void *buf);
+
 /**
  * \brief Write a block from memory to the volume at the specified block address.
  * 
@@ -96,6 +110,34 @@ int block_read(blockno_t block, void *buf);
  **/
 int block_write(blockno_t block, void *buf);
 
+/**
+ * \brief Write a run of consecutive blocks from memory in one transfer.
+ * 
+ * Writes count * #BLOCK_SIZE bytes from memory to count contiguous blocks starting at the given
+ * block number.  Drivers for devices with a multi-block command (e.g. CMD25 on SD cards) should
+ * use it, sustained write speed depends on it.
+ * 
+ * \param block is the number of the first block to write to.
+ * \param count is the number of blocks to write
+ * \param buf is a pointer to count * #BLOCK_SIZE bytes to be written to the volume
+ * \return 0 on success, anything else to indicate an error.
+ **/
+int block_write_multi(blockno_t block, blockno_t count, void *buf);
+
+/**
+ * \brief Discard a run of blocks so that they read back as zeros.
+ * 
+ * Used to clear new directory clusters and space added to files without writing zeros from
+ * memory.  Only devices that guarantee discarded blocks read as all zeros afterwards (e.g. an
+ * erase that leaves the data as 0x00) should do anything here, any other driver just returns
+ * non-zero and the zeros are written instead.
+ * 
+ * \param block is the number of the first block to discard
+ * \param count is the number of blocks to discard
+ * \return 0 if the blocks now read as zeros, anything else if they weren't discarded.
+ **/
+int block_discard(blockno_t block, blockno_t count);
+
 /**
  * \brief Get the size of the volume which contains the filesystem in blocks.
  * 
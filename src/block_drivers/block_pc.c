@@ -96,6 +96,14 @@ int block_read(blockno_t block, void *buffer) {
   return 0;
 }
 
+int block_read_multi(blockno_t block, blockno_t count, void *buffer) {
+  if((block + count) * BLOCK_SIZE - 1 > block_fs_size) {
+    return -1;
+  }
+  memcpy(buffer, blocks + block * BLOCK_SIZE, count * BLOCK_SIZE);
+  return 0;
+}
+
 int block_write(blockno_t block, void *buffer) {
 //   printf("block write at %x\n", block * BLOCK_SIZE);
   if((block + 1) * BLOCK_SIZE - 1 > block_fs_size) {
@@ -111,6 +119,22 @@ int block_write(blockno_t block, void *buffer) {
   return 0;
 }
 
+int block_write_multi(blockno_t block, blockno_t count, void *buffer) {
+  if((block + count) * BLOCK_SIZE - 1 > block_fs_size) {
+    return -1;
+  }
+  memcpy(blocks + block * BLOCK_SIZE, buffer, count * BLOCK_SIZE);
+  return 0;
+}
+
+int block_discard(blockno_t block, blockno_t count) {
+  if((block + count) * BLOCK_SIZE - 1 > block_fs_size) {
+    return -1;
+  }
+  memset(blocks + block * BLOCK_SIZE, 0, count * BLOCK_SIZE);
+  return 0;
+}
+
 blockno_t block_get_volume_size() {
   return block_fs_size / BLOCK_SIZE;
 }
@@ -318,6 +318,40 @@ int block_read(blockno_t block, void *buf) {
   return 0;
 }
 
+int block_read_multi(blockno_t block, blockno_t count, void *buf) {
+  int i;
+  uint16_t c;
+  uint8_t *bp = buf;
+  
+  if(card.card_type == SD_CARD_SC) {
+    block <<= 9;
+  }
+
+  c = sd_command(CMD18, block, 1);
+
+  if(c != 0) {
+    return c;
+  }
+  
+  while(count--) {
+    do {
+      c = spi_xfer(SD_SPI, 0xFF);
+    } while(c != 0xFE);
+
+    for(i=0;i<512;i++) {
+      *bp++ = spi_xfer(SD_SPI, 0xFF);
+    }
+    spi_xfer(SD_SPI, 0xFF);
+    spi_xfer(SD_SPI, 0xFF);   /* read checksum bytes and dispose of */
+  }
+  
+  /* stop the transmission, then wait for the card to finish being busy */
+  sd_command(CMD12, 0, 1);
+  while(spi_xfer(SD_SPI, 0xFF) != 0xFF) {__asm__("nop");}
+
+  return 0;
+}
+
 int block_write(blockno_t block, void *buf) {
   int i;
   uint16_t c;
@@ -357,6 +391,63 @@ int block_write(blockno_t block, void *buf) {
   return 0;
 }
 
+int block_write_multi(blockno_t block, blockno_t count, void *buf) {
+  int i;
+  uint16_t c;
+  uint8_t *bp = buf;
+  
+  if(card.card_type == SD_CARD_SC) {
+    block <<= 9;
+  }
+
+  c = sd_command(CMD25, block, 1);
+
+  if(c != 0) {
+    return c;
+  }
+  
+  while(count--) {
+    // make sure there's long enough from the command response before the data
+    spi_xfer(SD_SPI, 0xFF);
+    
+    // multi-block writes use a different start of block indicator
+    spi_xfer(SD_SPI, 0xFC);
+    
+    for(i=0;i<512;i++) {
+      spi_xfer(SD_SPI, *bp++);
+    }
+    
+    spi_xfer(SD_SPI, 0xFF);
+    spi_xfer(SD_SPI, 0xFF);   /* dummy checksum bytes */
+    
+    // get the card response, the bottom five bits are 0bxxx00101 if the data was accepted
+    c = spi_xfer(SD_SPI, 0xFF);
+    
+    while(spi_xfer(SD_SPI, 0xFF) != 0xFF) {__asm__("nop");}     // make sure the card is no longer busy
+    
+    if((c & 0x1F) != 0x05) {
+      break;
+    }
+  }
+  
+  // stop transmission token, then wait for the card to finish programming
+  spi_xfer(SD_SPI, 0xFD);
+  spi_xfer(SD_SPI, 0xFF);
+  while(spi_xfer(SD_SPI, 0xFF) != 0xFF) {__asm__("nop");}
+  
+  if((c & 0x1F) != 0x05) {
+    return -1;
+  }
+  return 0;
+}
+
+int block_discard(blockno_t block __attribute__((__unused__)),
+                  blockno_t count __attribute__((__unused__))) {
+  // an erase leaves either all 0s or all 1s depending on the card (DATA_STAT_AFTER_ERASE in the
+  // SCR), which isn't read at init, so the filesystem writes the zeros itself
+  return -1;
+}
+
 blockno_t block_get_volume_size() {
   return card.size;
 }
@@ -51,6 +51,7 @@
 #define CMD17         17
 #define CMD18         18
 #define CMD24         24
+#define CMD25         25
 #define ACMD41        0x80 + 41
 
 /* Error status codes returned in the SD info struct */
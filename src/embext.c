@@ -737,15 +737,9 @@ int ext2_close(struct file_ent *fe, int *rerrno) {
     return 0;
 }
 
-int ext2_read(struct file_ent *fe, void *buffer, size_t count, int *rerrno) {
+/* copies bytes from the current position until count have been copied or the file ends */
+uint32_t ext2_read_span(struct file_ent *fe, uint8_t *bt, size_t count) {
     uint32_t i=0;
-    uint8_t *bt = (uint8_t *)buffer;
-    /* make sure this is an open file and it can be read */  
-    if(fe == NULL) {
-        (*rerrno) = EBADF;
-        return -1;
-    }
-    /* copy some bytes to the buffer requested */
     while(i < count) {
         if(((fe->cursor + fe->file_sector * block_get_block_size())) >= fe->inode.i_size) {
             break;   /* end of file */
@@ -757,29 +751,53 @@ int ext2_read(struct file_ent *fe, void *buffer, size_t count, int *rerrno) {
         }
         i++;
     }
+    return i;
+}
+
+int ext2_read(struct file_ent *fe, void *buffer, size_t count, int *rerrno) {
+    uint32_t i;
+    /* make sure this is an open file and it can be read */  
+    if(fe == NULL) {
+        (*rerrno) = EBADF;
+        return -1;
+    }
+    /* copy some bytes to the buffer requested */
+    i = ext2_read_span(fe, (uint8_t *)buffer, count);
     if(i > 0) {
         ext2_update_atime(fe);
     }
     return i;
 }
 
-int ext2_write(struct file_ent *fe, const void *buffer, size_t count, 
-               int *rerrno) {
+int ext2_readv(struct file_ent *fe, const struct iovec *iov, int iovcnt, int *rerrno) {
     uint32_t i=0;
-    uint8_t *bt = (uint8_t *)buffer;
+    uint32_t n;
+    int k;
     if(fe == NULL) {
         (*rerrno) = EBADF;
         return -1;
     }
-    if(!(fe->flags & EXT2_FLAG_WRITE)) {
-        (*rerrno) = EBADF;
+    if(iovcnt < 0) {
+        (*rerrno) = EINVAL;
         return -1;
     }
-    if(fe->flags & EXT2_FLAG_APPEND) {
-        if(ext2_lseek(fe, 0, SEEK_END, rerrno) == -1) {
-            return -1;
+    /* fill each buffer in turn, the access time is only updated once */
+    for(k=0;k<iovcnt;k++) {
+        n = ext2_read_span(fe, (uint8_t *)iov[k].iov_base, iov[k].iov_len);
+        i += n;
+        if(n < iov[k].iov_len) {
+            break;
         }
     }
+    if(i > 0) {
+        ext2_update_atime(fe);
+    }
+    return i;
+}
+
+/* copies count bytes into the file at the current position, -1 if a sector can't be loaded */
+int ext2_write_span(struct file_ent *fe, const uint8_t *bt, size_t count) {
+    uint32_t i=0;
     while(i < count) {
         if(((fe->cursor + fe->file_sector * 512)) == fe->inode.i_size) {
             fe->inode.i_size++;
@@ -789,12 +807,67 @@ int ext2_write(struct file_ent *fe, const void *buffer, size_t count,
         fe->cursor++;
         if(fe->cursor == 512) {
             if(ext2_next_sector(fe)) {
-                (*rerrno) = EIO;
                 return -1;
             }
         }
         i++;
     }
+    return 0;
+}
+
+int ext2_write(struct file_ent *fe, const void *buffer, size_t count, 
+               int *rerrno) {
+    if(fe == NULL) {
+        (*rerrno) = EBADF;
+        return -1;
+    }
+    if(!(fe->flags & EXT2_FLAG_WRITE)) {
+        (*rerrno) = EBADF;
+        return -1;
+    }
+    if(fe->flags & EXT2_FLAG_APPEND) {
+        if(ext2_lseek(fe, 0, SEEK_END, rerrno) == -1) {
+            return -1;
+        }
+    }
+    if(ext2_write_span(fe, (const uint8_t *)buffer, count)) {
+        (*rerrno) = EIO;
+        return -1;
+    }
+    if(count > 0) {
+        ext2_update_mtime(fe);
+    }
+    return count;
+}
+
+int ext2_writev(struct file_ent *fe, const struct iovec *iov, int iovcnt, int *rerrno) {
+    uint32_t i=0;
+    int k;
+    if(fe == NULL) {
+        (*rerrno) = EBADF;
+        return -1;
+    }
+    if(!(fe->flags & EXT2_FLAG_WRITE)) {
+        (*rerrno) = EBADF;
+        return -1;
+    }
+    if(iovcnt < 0) {
+        (*rerrno) = EINVAL;
+        return -1;
+    }
+    if(fe->flags & EXT2_FLAG_APPEND) {
+        if(ext2_lseek(fe, 0, SEEK_END, rerrno) == -1) {
+            return -1;
+        }
+    }
+    /* write each buffer in turn, the modified time is only updated once */
+    for(k=0;k<iovcnt;k++) {
+        if(ext2_write_span(fe, (const uint8_t *)iov[k].iov_base, iov[k].iov_len)) {
+            (*rerrno) = EIO;
+            return -1;
+        }
+        i += iov[k].iov_len;
+    }
     if(i > 0) {
         ext2_update_mtime(fe);
     }
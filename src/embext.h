@@ -1,6 +1,8 @@
 #ifndef EMBEXT2_H
 #define EMBEXT2_H 1
 
+#include "uio.h"
+
 #define MAX_PATH_LEN 1024
 #define MAX_PATH_LEVELS 100
 
@@ -151,6 +153,10 @@ int ext2_read(struct file_ent *fe, void *buffer, size_t count, int *rerrno);
 
 int ext2_write(struct file_ent *fe, const void *buffer, size_t count, int *rerrno);
 
+int ext2_readv(struct file_ent *fe, const struct iovec *iov, int iovcnt, int *rerrno);
+
+int ext2_writev(struct file_ent *fe, const struct iovec *iov, int iovcnt, int *rerrno);
+
 int ext2_isatty(struct file_ent *fe, int *rerrno);
 
 int ext2_fstat(struct file_ent *fe, struct stat *st, int *rerrno);
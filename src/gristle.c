@@ -36,13 +36,126 @@
 #include <errno.h>
 #include "block.h"
 #include "partition.h"
-#include "config.h"
 #include "gristle.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #ifndef GRISTLE_TIME
 #define GRISTLE_TIME time(NULL)
 #endif
 
+/*
+ * Locking
+ * 
+ * Three kinds of lock are used, always taken in this order and all of them recursive so the
+ * public calls can be nested (fat_mkdir opens and writes the parent directory for example):
+ * 
+ *   GRISTLE_FD_LOCK(fd)/GRISTLE_FD_UNLOCK(fd) - one per file descriptor, held for the whole of
+ *     every call that takes an fd so two threads sharing a file are serialised.  Threads working
+ *     on different files don't share anything else on the data path.
+ *   GRISTLE_META_RDLOCK/GRISTLE_META_WRLOCK/GRISTLE_META_UNLOCK - a reader/writer lock on the
+ *     directories and the lookup caches.  Opening, creating and deleting files and writing
+ *     directory entries take it exclusively, reading a directory takes it shared.  Reading and
+ *     writing the contents of regular files doesn't take it at all.
+ *   GRISTLE_SYSLOCK/GRISTLE_SYSUNLOCK - the allocator lock, covers fatfs.sysbuf, every change
+ *     to the FAT and the buffer pool.  GRISTLE_SYSLOCK evaluates true once the lock is held.
+ * 
+ * The file descriptor slots themselves are handed out under the META lock: fat_open() claims a
+ * slot by setting its in_use and fat_close() clears it again, so code looking at other files'
+ * slots (fat_entry_open(), fat_rename_fds()) test in_use and never read their flags, which
+ * belong to whoever holds the fd lock.
+ * 
+ * fat_data_writes, the count of file data writes that tells buffer windows when they may be stale,
+ * is shared by every fd and isn't under any of them.  It is only changed with GRISTLE_DATA_WRITTEN
+ * and read with GRISTLE_DATA_GEN, atomic operations with GRISTLE_PTHREADS.
+ * 
+ * A single threaded system needs none of them, which is the default.  Defining GRISTLE_PTHREADS
+ * provides all of them with POSIX threads, or an RTOS port can define its own in config.h.  The
+ * block driver must be safe to call from several threads at once (block_pc is, block_sd isn't).
+ */
+#ifdef GRISTLE_PTHREADS
+#include <pthread.h>
+
+pthread_once_t gristle_lock_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t gristle_alloc_lock;
+pthread_mutex_t gristle_fd_lock[MAX_OPEN_FILES];
+pthread_rwlock_t gristle_meta_rwlock;
+pthread_t gristle_meta_owner;
+int gristle_meta_depth;
+
+void gristle_lock_init() {
+  pthread_mutexattr_t attr;
+  int i;
+  
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&gristle_alloc_lock, &attr);
+  for(i=0;i<MAX_OPEN_FILES;i++) {
+    pthread_mutex_init(&gristle_fd_lock[i], &attr);
+  }
+  pthread_mutexattr_destroy(&attr);
+  pthread_rwlock_init(&gristle_meta_rwlock, NULL);
+}
+
+int gristle_mutex_lock(pthread_mutex_t *m) {
+  pthread_once(&gristle_lock_once, gristle_lock_init);
+  return pthread_mutex_lock(m) == 0;
+}
+
+/* gristle_meta_owned - whether the calling thread holds the write lock, other threads may be
+ * taking it at the same time so the owner is read atomically */
+int gristle_meta_owned() {
+  pthread_t owner;
+  
+  if(!__atomic_load_n(&gristle_meta_depth, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  __atomic_load(&gristle_meta_owner, &owner, __ATOMIC_RELAXED);
+  return pthread_equal(owner, pthread_self());
+}
+
+/* the owner of the write lock can take it again, for reading or writing */
+void gristle_meta_lock(int write) {
+  pthread_t self;
+  
+  pthread_once(&gristle_lock_once, gristle_lock_init);
+  if(gristle_meta_owned()) {
+    __atomic_add_fetch(&gristle_meta_depth, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  if(write) {
+    pthread_rwlock_wrlock(&gristle_meta_rwlock);
+    self = pthread_self();
+    __atomic_store(&gristle_meta_owner, &self, __ATOMIC_RELAXED);
+    __atomic_store_n(&gristle_meta_depth, 1, __ATOMIC_RELEASE);
+  } else {
+    pthread_rwlock_rdlock(&gristle_meta_rwlock);
+  }
+}
+
+void gristle_meta_unlock() {
+  if(gristle_meta_owned()) {
+    if(__atomic_sub_fetch(&gristle_meta_depth, 1, __ATOMIC_RELEASE) > 0) {
+      return;
+    }
+  }
+  pthread_rwlock_unlock(&gristle_meta_rwlock);
+}
+
+#define GRISTLE_SYSLOCK gristle_mutex_lock(&gristle_alloc_lock)
+#define GRISTLE_SYSUNLOCK pthread_mutex_unlock(&gristle_alloc_lock)
+#define GRISTLE_FD_LOCK(fd) gristle_mutex_lock(&gristle_fd_lock[fd])
+#define GRISTLE_FD_UNLOCK(fd) pthread_mutex_unlock(&gristle_fd_lock[fd])
+#define GRISTLE_META_RDLOCK gristle_meta_lock(0)
+#define GRISTLE_META_WRLOCK gristle_meta_lock(1)
+#define GRISTLE_META_UNLOCK gristle_meta_unlock()
+#define GRISTLE_DATA_WRITTEN __atomic_add_fetch(&fat_data_writes, 1, __ATOMIC_ACQ_REL)
+#define GRISTLE_DATA_GEN __atomic_load_n(&fat_data_writes, __ATOMIC_ACQUIRE)
+#endif
+
 #ifndef GRISTLE_SYSLOCK
 #define GRISTLE_SYSLOCK 1
 #endif
@@ -51,77 +164,259 @@
 #define GRISTLE_SYSUNLOCK
 #endif
 
+#ifndef GRISTLE_FD_LOCK
+#define GRISTLE_FD_LOCK(fd)
+#endif
+
+#ifndef GRISTLE_FD_UNLOCK
+#define GRISTLE_FD_UNLOCK(fd)
+#endif
+
+#ifndef GRISTLE_META_RDLOCK
+#define GRISTLE_META_RDLOCK
+#endif
+
+#ifndef GRISTLE_META_WRLOCK
+#define GRISTLE_META_WRLOCK
+#endif
+
+#ifndef GRISTLE_META_UNLOCK
+#define GRISTLE_META_UNLOCK
+#endif
+
+#ifndef GRISTLE_DATA_WRITTEN
+#define GRISTLE_DATA_WRITTEN (++fat_data_writes)
+#endif
+
+#ifndef GRISTLE_DATA_GEN
+#define GRISTLE_DATA_GEN fat_data_writes
+#endif
+
+#ifndef GRISTLE_WRITEBACK_CLUSTERS
+#define GRISTLE_WRITEBACK_CLUSTERS 1
+#endif
+
+#ifndef GRISTLE_WRITEBACK_SECONDS
+#define GRISTLE_WRITEBACK_SECONDS 0
+#endif
+
+#ifndef GRISTLE_RESERVE_CLUSTERS
+#define GRISTLE_RESERVE_CLUSTERS 0
+#endif
+
+#ifndef GRISTLE_DCACHE_SIZE
+#define GRISTLE_DCACHE_SIZE 8
+#endif
+
+#ifndef GRISTLE_BUFFER_SECTORS
+#define GRISTLE_BUFFER_SECTORS 1
+#endif
+
+/* sectors shared between the file buffers and buffer windows, see "Buffer pool".  The default
+ * is enough for every file to keep its buffer and a full window, fewer saves RAM at the cost of
+ * re-reading the sector a file was on when it comes back into use.  Calls fail with ENOMEM if
+ * there isn't one for each call in progress, so at least 2 (fat_copy_file_range() uses two
+ * files) or with threads one for each thread plus one */
+#ifndef GRISTLE_POOL_SECTORS
+#if GRISTLE_BUFFER_SECTORS > 1
+#define GRISTLE_POOL_SECTORS (MAX_OPEN_FILES * (GRISTLE_BUFFER_SECTORS + 1) + 1)
+#else
+#define GRISTLE_POOL_SECTORS (MAX_OPEN_FILES + 1)
+#endif
+#endif
+
+#ifndef GRISTLE_DIR_HINTS
+#define GRISTLE_DIR_HINTS 4
+#endif
+
+#ifndef GRISTLE_ZERO_SECTORS
+#define GRISTLE_ZERO_SECTORS 8
+#endif
+
+#ifndef GRISTLE_COPY_SECTORS
+#define GRISTLE_COPY_SECTORS 4
+#endif
+
+#ifndef FAT_MIRROR_BATCH
+#define FAT_MIRROR_BATCH 1
+#endif
+
+#define FAT_NO_DIRTY 0xFFFFFFFF
+
+/*
+ * Building with GRISTLE_FAT16_ONLY or GRISTLE_FAT32_ONLY defined supports just the one type of
+ * FAT, so the entry size, end of chain values and the root directory are constants and the code
+ * for the other type is left out.  Otherwise they come from the volume mounted.
+ */
+#if defined(GRISTLE_FAT16_ONLY)
+#define FAT_TYPE PART_TYPE_FAT16
+#define FAT_ENTRY_SHIFT 1
+#define FAT_END_CLUSTER 0xFFF0
+#define FAT_EOC 0xFFF8
+#define FAT_ROOT_CLUSTER 1
+#define FAT_FIXED_ROOT(cluster) ((cluster) == 1)
+#elif defined(GRISTLE_FAT32_ONLY)
+#define FAT_TYPE PART_TYPE_FAT32
+#define FAT_ENTRY_SHIFT 2
+#define FAT_END_CLUSTER 0xFFFFFF0
+#define FAT_EOC 0x0FFFFFF8
+#define FAT_ROOT_CLUSTER fatfs.root_cluster
+#define FAT_FIXED_ROOT(cluster) 0
+#else
+#define FAT_TYPE fatfs.type
+#define FAT_ENTRY_SHIFT (fatfs.fat_entry_len >> 1)   // entries are 2 or 4 bytes
+#define FAT_END_CLUSTER fatfs.end_cluster_marker
+#define FAT_EOC ((fatfs.type == PART_TYPE_FAT16) ? 0xFFF8 : 0x0FFFFFF8)
+#define FAT_ROOT_CLUSTER fatfs.root_cluster
+// only FAT16 has a fixed root directory outside the data area, it is given cluster number 1
+#define FAT_FIXED_ROOT(cluster) ((cluster) == 1)
+#endif
+// first sector of a cluster, clusters are a power of two sectors
+#define FAT_CLUSTER_SECTOR(cluster) (((blockno_t)(cluster) << fatfs.cluster_shift) + fatfs.cluster0)
+
+/* file slot used to resolve paths for fat_stat(), fat_unlink() and fat_rmdir() with the metadata
+ * lock held, so they don't take one of the MAX_OPEN_FILES descriptors */
+#define FAT_LOOKUP_FD MAX_OPEN_FILES
+
 /**
  * global variable structures.
  * These take the place of a real operating system.
  **/
 
 struct fat_info fatfs;
-FileS file_num[MAX_OPEN_FILES];
+FileS file_num[MAX_OPEN_FILES + 1];   // the extra slot is FAT_LOOKUP_FD, never handed out
+dcacheS dcache[GRISTLE_DCACHE_SIZE ? GRISTLE_DCACHE_SIZE : 1];
+uint32_t dcache_clock;
+dirhintS dir_hint[GRISTLE_DIR_HINTS ? GRISTLE_DIR_HINTS : 1];
+uint32_t dir_hint_clock;
+uint8_t fat_zero_buf[GRISTLE_ZERO_SECTORS * 512];   // always zero, the source for clearing clusters
+uint8_t fat_pool[GRISTLE_POOL_SECTORS][512];
+uint8_t fat_pool_owner[GRISTLE_POOL_SECTORS];   // fd + 1 of the file using each sector, 0 if free
+uint32_t fat_pool_clock;
+uint32_t fat_data_writes;       // bumped by every write of file data, invalidates buffer windows
 // uint32_t available_files;
 
 // there's a circular dependency between the two flush functions in certain cases,
 // so we need to prototype one here
-int fat_flush_fileinfo(int fd);
+int fat_flush_fileinfo(int fd, int *rerrno);
+// fat_flush() hands sectors to the buffer window code which needs fat_sector_run()
+int fat_window_store(int fd);
+// and the buffer window code borrows its sectors from the pool, which writes them back with
+// fat_flush() when it has to take them from another file
+int fat_window_borrow(int fd);
+// fat_pwrite() fills any gap before the offset it writes at with fat_fallocate_locked()
+int fat_fallocate_locked(int fd, int mode, uint32_t offset, uint32_t len, int *rerrno);
 
 /**
  * Name/Time formatting, doesn't read/write disc
  **/
 
-/* fat_to_unix_time - convert a time field from FAT format to unix epoch 
-   seconds. */
+/*
+ * FAT dates and times are converted with plain arithmetic rather than mktime()/gmtime() so there
+ * is no libc calendar or timezone code on the read and write paths.  Times are taken to be UTC,
+ * as GRISTLE_TIME is.
+ */
+#define FAT_SECONDS_PER_DAY 86400
+#define FAT_EPOCH_DAYS 3652             // days from 1970-01-01 to 1980-01-01, the FAT epoch
+#define FAT_LAST_DAYS 50402             // days from 1970-01-01 to 2107-12-31, the last FAT date
+
+const uint16_t fat_month_start[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+
+// date the last call to fat_from_unix_date() was for, days since 1970 << 16 | FAT date
+uint32_t fat_date_cache;
+
+int fat_leap_year(int year) {
+  return ((year % 4 == 0) && (year % 100 != 0)) || (year % 400 == 0);
+}
+
+/* fat_days_to_year - number of days from 1970-01-01 to the first of January of a year */
+int32_t fat_days_to_year(int year) {
+  year--;
+  return 365 * (year - 1969) + (year / 4 - 492) - (year / 100 - 19) + (year / 400 - 4);
+}
+
+/* fat_to_unix_time - convert a time field from FAT format to seconds since midnight */
 time_t fat_to_unix_time(uint16_t fat_time) {
-  struct tm time_str;
-  time_str.tm_year = 0;
-  time_str.tm_mon = 0;
-  time_str.tm_mday = 0;
-  time_str.tm_hour = ((fat_time & 0xF800) >> 11);
-  time_str.tm_min = ((fat_time & 0x03E0) >> 5);
-  time_str.tm_sec = (fat_time & 0x001F) << 1;
-  time_str.tm_isdst = -1;
-  return mktime(&time_str);
+  return ((fat_time & 0xF800) >> 11) * 3600 + ((fat_time & 0x07E0) >> 5) * 60 +
+         ((fat_time & 0x001F) << 1);
 }
 
 uint16_t fat_from_unix_time(time_t seconds) {
-  struct tm *time_str;
-  uint16_t fat_time;
-  time_str = gmtime(&seconds);
+  uint32_t t;
   
-  fat_time = 0;
-  
-  fat_time += time_str->tm_hour << 11;
-  fat_time += time_str->tm_min << 5;
-  fat_time += time_str->tm_sec >> 1;
-  return fat_time;
+  t = seconds % FAT_SECONDS_PER_DAY;
+  if(seconds < 0) {
+    t = (t + FAT_SECONDS_PER_DAY) % FAT_SECONDS_PER_DAY;
+  }
+  return ((t / 3600) << 11) + (((t / 60) % 60) << 5) + ((t % 60) >> 1);
 }
 
+/* fat_to_unix_date - convert a date field from FAT format to unix epoch seconds (at midnight) */
 time_t fat_to_unix_date(uint16_t fat_date) {
-  struct tm time_str;
-
-  time_str.tm_year = (((fat_date & 0xFE00) >> 9) + 80);
-  time_str.tm_mon = (((fat_date & 0x01E0) >> 5) - 1);
-  time_str.tm_mday = (fat_date & 0x001F) ;
-  time_str.tm_hour = 0;
-  time_str.tm_min = 0;
-  time_str.tm_sec = 0;
-  time_str.tm_isdst = -1;
-
-  return mktime(&time_str);
+  int year = ((fat_date & 0xFE00) >> 9) + 1980;
+  int month = (fat_date & 0x01E0) >> 5;
+  int day = fat_date & 0x001F;
+  int32_t days;
+  
+  // an unset date has a zero month and day
+  if((month < 1) || (month > 12)) {
+    month = 1;
+  }
+  if(day < 1) {
+    day = 1;
+  }
+  days = fat_days_to_year(year) + fat_month_start[month - 1] + day - 1;
+  if((month > 2) && (fat_leap_year(year))) {
+    days++;
+  }
+  return (time_t)days * FAT_SECONDS_PER_DAY;
 }
 
+/*
+ * fat_from_unix_date - convert unix epoch seconds to a FAT date, clamped to the range FAT can
+ *                      hold.  Nearly every call is for today so the last result is kept.
+ */
 uint16_t fat_from_unix_date(time_t seconds) {
-  struct tm *time_str;
-  uint16_t fat_date;
+  int32_t days;
+  int32_t key;
+  int32_t start;
+  uint32_t cached;
+  int year;
+  int month;
+  int leap;
   
-  time_str = gmtime(&seconds);
-  
-  fat_date = 0;
-  
-  fat_date += (time_str->tm_year - 80) << 9;
-  fat_date += (time_str->tm_mon + 1) << 5;
-  fat_date += time_str->tm_mday;
+  if(seconds < (time_t)FAT_EPOCH_DAYS * FAT_SECONDS_PER_DAY) {
+    days = FAT_EPOCH_DAYS;
+  } else if(seconds >= (time_t)FAT_LAST_DAYS * FAT_SECONDS_PER_DAY) {
+    days = FAT_LAST_DAYS;
+  } else {
+    days = seconds / FAT_SECONDS_PER_DAY;
+  }
+  key = days;
+  cached = fat_date_cache;
+  if((cached >> 16) == (uint32_t)key) {
+    return cached & 0xFFFF;
+  }
   
-  return fat_date;
+  // the estimate can only be too late, by a year at most
+  year = 1970 + days / 365;
+  while(fat_days_to_year(year) > days) {
+    year--;
+  }
+  days -= fat_days_to_year(year);
+  leap = fat_leap_year(year);
+  for(month=11;month>0;month--) {
+    start = fat_month_start[month] + ((month > 1) ? leap : 0);
+    if(days >= start) {
+      break;
+    }
+  }
+  if(month > 0) {
+    days -= fat_month_start[month] + ((month > 1) ? leap : 0);
+  }
+  cached = ((year - 1980) << 9) + ((month + 1) << 5) + days + 1;
+  fat_date_cache = ((uint32_t)key << 16) | cached;
+  return cached;
 }
 
 /*
@@ -135,12 +430,11 @@ int fat_update_atime(int fd) {
 #ifdef GRISTLE_RO
     (void)fd;
 #else
-  uint16_t new_date, old_date;
-  new_date = fat_from_unix_date(GRISTLE_TIME);
-  old_date = fat_from_unix_date(file_num[fd].accessed);
+  time_t now = GRISTLE_TIME;
   
-  if(old_date != new_date) {
-    file_num[fd].accessed = GRISTLE_TIME;
+  // FAT dates are whole UTC days so comparing day numbers is enough
+  if(now / FAT_SECONDS_PER_DAY != file_num[fd].accessed / FAT_SECONDS_PER_DAY) {
+    file_num[fd].accessed = now;
     file_num[fd].flags |= FAT_FLAG_FS_DIRTY;
   }
 #endif
@@ -163,12 +457,16 @@ int fat_update_mtime(int fd) {
   return 0;
 }
 
-/* fat_get_next_file - returns the next free file descriptor or -1 if none */
+/*
+ * fat_get_next_file - returns the next free file descriptor or -1 if none.  Called with the META
+ *                     lock held, which guards in_use, so flags are only touched by the owner.
+ */
 int8_t fat_get_next_file() {
   int j;
 
   for(j=0;j<MAX_OPEN_FILES;j++) {
-    if((file_num[j].flags & FAT_FLAG_OPEN) == 0) {
+    if(!file_num[j].in_use) {
+      file_num[j].in_use = 1;
       file_num[j].flags = FAT_FLAG_OPEN;
       return j;
     }
@@ -380,49 +678,217 @@ int str_to_fatname(char *url, char *dosname) {
 }
 
 /* low level file-system operations */
+
+/*
+ * fat_write_fat_sector - writes a sector of the active FAT and notes that the backup copies
+ *                        of it need updating.
+ * 
+ * Rather than doubling every FAT write the range of changed sectors is tracked and copied to
+ * the other FATs in one pass by fat_mirror_fats().
+ */
+int fat_write_fat_sector(blockno_t block, void *buf) {
+  uint32_t offset = block - fatfs.active_fat_start;
+  
+  if(offset < fatfs.fat_dirty_first) {
+    fatfs.fat_dirty_first = offset;
+  }
+  if((offset > fatfs.fat_dirty_last) || (fatfs.fat_dirty_last == FAT_NO_DIRTY)) {
+    fatfs.fat_dirty_last = offset;
+  }
+  return block_write(block, buf);
+}
+
+/*
+ * fat_mirror_fats - copies the changed part of the active FAT to the backup FATs.
+ * 
+ * Called when the filesystem is synced, a file is closed or the volume unmounted.  With
+ * FAT_MIRROR_BATCH set above 1 the sectors are copied in batches with multi-block transfers,
+ * otherwise sysbuf is used a sector at a time.
+ */
+int fat_mirror_fats() {
+#ifndef GRISTLE_RO
+#if FAT_MIRROR_BATCH > 1
+  static uint8_t batch[FAT_MIRROR_BATCH * 512];
+#else
+  uint8_t *batch = fatfs.sysbuf;
+#endif
+  uint32_t i;
+  uint32_t n;
+  int f;
+  
+  if(fatfs.fat_dirty_last == FAT_NO_DIRTY) {
+    return 0;
+  }
+  if(GRISTLE_SYSLOCK) {
+    // another thread may have mirrored the range while this one waited for the lock
+    if((fatfs.num_fats > 1) && (fatfs.fat_dirty_last != FAT_NO_DIRTY)) {
+      for(i=fatfs.fat_dirty_first;i<=fatfs.fat_dirty_last;i+=n) {
+        n = fatfs.fat_dirty_last - i + 1;
+        if(n > FAT_MIRROR_BATCH) {
+          n = FAT_MIRROR_BATCH;
+        }
+        if(block_read_multi(fatfs.active_fat_start + i, n, batch)) {
+          GRISTLE_SYSUNLOCK;
+          return -1;
+        }
+        for(f=1;f<fatfs.num_fats;f++) {
+          if(block_write_multi(fatfs.active_fat_start + f * fatfs.sectors_per_fat + i, n, batch)) {
+            GRISTLE_SYSUNLOCK;
+            return -1;
+          }
+        }
+      }
+    }
+    fatfs.fat_dirty_first = FAT_NO_DIRTY;
+    fatfs.fat_dirty_last = FAT_NO_DIRTY;
+    GRISTLE_SYSUNLOCK;
+  } else {
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+/*
+ * FAT free entry kernels
+ * 
+ * fat_sector_first_free finds the first free (zero) entry in a FAT sector at or after entry
+ * start, returning its number or -1, and fat_sector_count_free counts the free entries in the
+ * range start to end - 1.  FAT16 entries are 16 bits and FAT32 entries 32 bits of which only
+ * the low 28 are the cluster number.  SSE2 tests 8 or 4 entries at a time, otherwise a 64 bit
+ * word of 4 or 2 entries is tested at once with the usual zero lane bit tricks.
+ */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define FAT32_ENTRY_MASK64 0xFFFFFF0FFFFFFF0FULL
+#else
+#define FAT32_ENTRY_MASK64 0x0FFFFFFF0FFFFFFFULL
+#endif
+#define FAT_LANE_LOW16 0x7FFF7FFF7FFF7FFFULL
+#define FAT_LANE_LOW32 0x7FFFFFFF7FFFFFFFULL
+
+/* fat_entry_is_free - scalar test of one entry in a FAT sector */
+int fat_entry_is_free(const uint8_t *buf, int i) {
+  if(FAT_TYPE == PART_TYPE_FAT16) {
+    return (buf[i * 2] | buf[i * 2 + 1]) == 0;
+  }
+  return (buf[i * 4] | buf[i * 4 + 1] | buf[i * 4 + 2] | (buf[i * 4 + 3] & 0x0F)) == 0;
+}
+
+/* fat_zero_lanes - sets the top bit of every 16 or 32 bit lane of v that is zero */
+uint64_t fat_zero_lanes(uint64_t v) {
+  if(FAT_TYPE == PART_TYPE_FAT16) {
+    return ~(((v & FAT_LANE_LOW16) + FAT_LANE_LOW16) | v) & ~FAT_LANE_LOW16;
+  }
+  v &= FAT32_ENTRY_MASK64;
+  return ~(((v & FAT_LANE_LOW32) + FAT_LANE_LOW32) | v) & ~FAT_LANE_LOW32;
+}
+
+int fat_sector_first_free(const uint8_t *buf, int start) {
+  int n = 512 >> FAT_ENTRY_SHIFT;
+  int per = 8 >> FAT_ENTRY_SHIFT;
+  int i = start;
+  uint64_t v;
+#if defined(__SSE2__)
+  int bits;
+#endif
+  
+  // single entries up to a word boundary
+  while((i < n) && (i % per)) {
+    if(fat_entry_is_free(buf, i)) {
+      return i;
+    }
+    i++;
+  }
+#if defined(__SSE2__)
+  for(;i + 2 * per <= n;i += 2 * per) {
+    if(FAT_TYPE == PART_TYPE_FAT16) {
+      bits = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(buf + i * 2)),
+                                               _mm_setzero_si128()));
+    } else {
+      bits = _mm_movemask_epi8(_mm_cmpeq_epi32(
+                 _mm_and_si128(_mm_loadu_si128((const __m128i *)(buf + i * 4)), _mm_set1_epi32(0x0FFFFFFF)),
+                 _mm_setzero_si128()));
+    }
+    if(bits) {
+      return i + (__builtin_ctz(bits) >> FAT_ENTRY_SHIFT);
+    }
+  }
+#endif
+  for(;i + per <= n;i += per) {
+    memcpy(&v, buf + (i << FAT_ENTRY_SHIFT), 8);
+    if(fat_zero_lanes(v)) {
+      break;
+    }
+  }
+  for(;i < n;i++) {
+    if(fat_entry_is_free(buf, i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+uint32_t fat_sector_count_free(const uint8_t *buf, int start, int end) {
+  int per = 8 >> FAT_ENTRY_SHIFT;
+  int i = start;
+  uint32_t count = 0;
+  uint64_t v;
+  
+  while((i < end) && (i % per)) {
+    count += fat_entry_is_free(buf, i++);
+  }
+  for(;i + per <= end;i += per) {
+    memcpy(&v, buf + (i << FAT_ENTRY_SHIFT), 8);
+    count += __builtin_popcountll(fat_zero_lanes(v));
+  }
+  while(i < end) {
+    count += fat_entry_is_free(buf, i++);
+  }
+  return count;
+}
+
 int fat_get_free_cluster() {
 #ifdef TRACE
   printf("fat_get_free_cluster\n");
 #endif
   blockno_t i;
   int j;
-  uint32_t e;
+  uint32_t cluster;
   
   if(GRISTLE_SYSLOCK) {
     for(i=fatfs.active_fat_start;i<fatfs.active_fat_start + fatfs.sectors_per_fat;i++) {
       if(block_read(i, fatfs.sysbuf)) {
+        GRISTLE_SYSUNLOCK;
         return 0xFFFFFFFF;
       }
-      for(j=0;j<(512/fatfs.fat_entry_len);j++) {
-        e = fatfs.sysbuf[j*fatfs.fat_entry_len];
-        e += fatfs.sysbuf[j*fatfs.fat_entry_len+1] << 8;
-        if(fatfs.type == PART_TYPE_FAT32) {
-          e += fatfs.sysbuf[j*fatfs.fat_entry_len+2] << 16;
-          e += fatfs.sysbuf[j*fatfs.fat_entry_len+3] << 24;
-        }
-        if(e == 0) {
-          /* this is a free cluster */
-          /* first, mark it as the end of the chain */
-          if(fatfs.type == PART_TYPE_FAT16) {
-            fatfs.sysbuf[j*fatfs.fat_entry_len] = 0xF8;
-            fatfs.sysbuf[j*fatfs.fat_entry_len+1] = 0xFF;
-          } else {
-            fatfs.sysbuf[j*fatfs.fat_entry_len] = 0xF8;
-            fatfs.sysbuf[j*fatfs.fat_entry_len+1] = 0xFF;
-            fatfs.sysbuf[j*fatfs.fat_entry_len+2] = 0xFF;
-            fatfs.sysbuf[j*fatfs.fat_entry_len+3] = 0x0F;
-          }
-          if(block_write(i, fatfs.sysbuf)) {
-            GRISTLE_SYSUNLOCK;
-            return 0xFFFFFFFF;
-          }
-  #ifdef TRACE
-    printf("fat_get_free_cluster returning %d\n", ((i - fatfs.active_fat_start) * (512 / fatfs.fat_entry_len)) + j);
-  #endif
-          GRISTLE_SYSUNLOCK;
-          return ((i - fatfs.active_fat_start) * (512 / fatfs.fat_entry_len)) + j;
-        }
+      if((j = fat_sector_first_free(fatfs.sysbuf, 0)) < 0) {
+        continue;
       }
+      cluster = ((i - fatfs.active_fat_start) * (512 >> FAT_ENTRY_SHIFT)) + j;
+      if(cluster > fatfs.max_cluster) {
+        /* the end of the FAT sector is past the end of the disc */
+        break;
+      }
+      /* this is a free cluster */
+      /* first, mark it as the end of the chain */
+      if(FAT_TYPE == PART_TYPE_FAT16) {
+        fatfs.sysbuf[(j << FAT_ENTRY_SHIFT)] = 0xF8;
+        fatfs.sysbuf[(j << FAT_ENTRY_SHIFT)+1] = 0xFF;
+      } else {
+        fatfs.sysbuf[(j << FAT_ENTRY_SHIFT)] = 0xF8;
+        fatfs.sysbuf[(j << FAT_ENTRY_SHIFT)+1] = 0xFF;
+        fatfs.sysbuf[(j << FAT_ENTRY_SHIFT)+2] = 0xFF;
+        fatfs.sysbuf[(j << FAT_ENTRY_SHIFT)+3] = 0x0F;
+      }
+      if(fat_write_fat_sector(i, fatfs.sysbuf)) {
+        GRISTLE_SYSUNLOCK;
+        return 0xFFFFFFFF;
+      }
+#ifdef TRACE
+      printf("fat_get_free_cluster returning %d\n", cluster);
+#endif
+      GRISTLE_SYSUNLOCK;
+      return cluster;
     }
     GRISTLE_SYSUNLOCK;
   }
@@ -440,33 +906,33 @@ int fat_free_clusters(uint32_t cluster) {
   
   if(GRISTLE_SYSLOCK) {
     while(1) {
-      if(fatfs.active_fat_start + ((cluster * fatfs.fat_entry_len) / 512) != current_block) {
+      if(fatfs.active_fat_start + (cluster >> (9 - FAT_ENTRY_SHIFT)) != current_block) {
         if(current_block != MAX_BLOCK) {
-          block_write(current_block, fatfs.sysbuf);
+          fat_write_fat_sector(current_block, fatfs.sysbuf);
         }
-        if(block_read(fatfs.active_fat_start + ((cluster * fatfs.fat_entry_len) / 512), fatfs.sysbuf)) {
+        if(block_read(fatfs.active_fat_start + (cluster >> (9 - FAT_ENTRY_SHIFT)), fatfs.sysbuf)) {
           GRISTLE_SYSUNLOCK;
           return -1;
         }
-        current_block = fatfs.active_fat_start + ((cluster * fatfs.fat_entry_len)/512);
+        current_block = fatfs.active_fat_start + (cluster >> (9 - FAT_ENTRY_SHIFT));
       }
-      estart = (cluster * fatfs.fat_entry_len) & 0x1ff;
+      estart = (cluster << FAT_ENTRY_SHIFT) & 0x1ff;
       j = fatfs.sysbuf[estart];
       fatfs.sysbuf[estart] = 0;
       j += fatfs.sysbuf[estart + 1] << 8;
       fatfs.sysbuf[estart+1] = 0;
-      if(fatfs.type == PART_TYPE_FAT32) {
+      if(FAT_TYPE == PART_TYPE_FAT32) {
         j += fatfs.sysbuf[estart + 2] << 16;
         fatfs.sysbuf[estart+2] = 0;
         j += fatfs.sysbuf[estart + 3] << 24;
         fatfs.sysbuf[estart+3] = 0;
       }
       cluster = j;
-      if(cluster >= fatfs.end_cluster_marker) {
+      if(cluster >= FAT_END_CLUSTER) {
         break;
       }
     }
-    block_write(current_block, fatfs.sysbuf);
+    fat_write_fat_sector(current_block, fatfs.sysbuf);
   } else {
     // failed to get mutex
     return -1;
@@ -475,980 +941,3444 @@ int fat_free_clusters(uint32_t cluster) {
   return 0;
 }
 
-/* write a sector back to disc */
-int fat_flush(int fd) {
-#ifdef GRISTLE_RO
-    (void)fd;
-#else
-  uint32_t cluster;
-#ifdef TRACE
-  printf("fat_flush\n");
-#endif
-  /* only write to disk if we need to */
-  if(file_num[fd].flags & FAT_FLAG_DIRTY) {
-    if(file_num[fd].sector == 0) {
-      /* this is a new file that's never been saved before, it needs a new cluster
-       * assigned to it, the data stored, then the meta info flushed */
-      cluster = fat_get_free_cluster();
-      if(cluster == 0xFFFFFFFF) {
-        return -1;
-      } else if(cluster == 0) {
-        return -1;
-      } else {
-//         file_num[fd].cluster = cluster;
-        file_num[fd].full_first_cluster = cluster;
-        file_num[fd].flags |= FAT_FLAG_FS_DIRTY;
-        file_num[fd].sector = cluster * fatfs.sectors_per_cluster + fatfs.cluster0;
-        file_num[fd].sectors_left = fatfs.sectors_per_cluster - 1;
-        file_num[fd].cluster = cluster;
-        //         file_num[fd].sector = cluster * fatfs.sectors_per_cluster + fatfs.cluster0;
-      }
-      if(block_write(file_num[fd].sector, file_num[fd].buffer)) {
-        /* write failed, don't clear the dirty flag */
-        return -1;
-      }
-      file_num[fd].flags &= ~FAT_FLAG_DIRTY;
-      fat_flush_fileinfo(fd);
-      
-//   block_pc_snapshot_all("writenfs.img");
-//       exit(-9);
-    } else {
-      if(block_write(file_num[fd].sector, file_num[fd].buffer)) {
-        /* write failed, don't clear the dirty flag */
-        return -1;
+/*
+ * fat_fat_entry - gets a pointer to the FAT entry for a cluster in sysbuf.
+ * 
+ * Loads the FAT sector holding the entry if it isn't the one in sysbuf already (current_block),
+ * writing the old sector back first if dirty has been set.  The caller must hold the system lock.
+ * Returns NULL on a read or write error.
+ */
+uint8_t *fat_fat_entry(uint32_t cluster, blockno_t *current_block, int *dirty) {
+  blockno_t block = fatfs.active_fat_start + (cluster >> (9 - FAT_ENTRY_SHIFT));
+  
+  if(block != *current_block) {
+    if(*dirty) {
+      if(fat_write_fat_sector(*current_block, fatfs.sysbuf)) {
+        return NULL;
       }
-      file_num[fd].flags &= ~FAT_FLAG_DIRTY;
+      *dirty = 0;
+    }
+    if(block_read(block, fatfs.sysbuf)) {
+      *current_block = MAX_BLOCK;
+      return NULL;
     }
+    *current_block = block;
   }
-#endif
-  return 0;
+  return &fatfs.sysbuf[(cluster << FAT_ENTRY_SHIFT) & 0x1ff];
 }
 
-/* get the first sector of a given cluster */
-int fat_select_cluster(int fd, uint32_t cluster) {
-#ifdef TRACE
-  printf("fat_select_cluster\n");
-#endif
-//   printf("%d: select cluster %d\n  sector=%d\n", fd, cluster, file_num[fd].sector);
-  if(cluster == 1) {
-    // this is an edge case for the fixed root directory on FAT16
-    file_num[fd].sector = fatfs.root_start;
-    file_num[fd].sectors_left = fatfs.root_len;
-    file_num[fd].cluster = 1;
-    file_num[fd].cursor = 0;
-  } else {
-    file_num[fd].sector = cluster * fatfs.sectors_per_cluster + fatfs.cluster0;
-    file_num[fd].sectors_left = fatfs.sectors_per_cluster - 1;
-    file_num[fd].cluster = cluster;
-    file_num[fd].cursor = 0;
+/* fat_entry_value - decodes a FAT entry found with fat_fat_entry() */
+uint32_t fat_entry_value(uint8_t *e) {
+  uint32_t v;
+  
+  v = e[0] + (e[1] << 8);
+  if(FAT_TYPE == PART_TYPE_FAT32) {
+    v += (e[2] << 16) + ((uint32_t)e[3] << 24);
   }
-//   printf("  sector=%d=%d * %d + %d\n", file_num[fd].sector, cluster, fatfs.sectors_per_cluster, fatfs.cluster0);
-
-  return block_read(file_num[fd].sector, file_num[fd].buffer);
+  return v;
 }
 
-/* get the next cluster in the current file */
-int fat_next_cluster(int fd, int *rerrno) {
-  uint32_t i;
-  uint32_t j;
-  uint32_t k;
-#ifdef TRACE
-  printf("fat_next_cluster\n");
-#endif
-  (*rerrno) = 0;
-  if(fat_flush(fd)) {
-    (*rerrno) = EIO;
-    return -1;
+/* fat_set_entry_value - stores a new value in a FAT entry found with fat_fat_entry() */
+void fat_set_entry_value(uint8_t *e, uint32_t v) {
+  e[0] = v & 0xff;
+  e[1] = (v >> 8) & 0xff;
+  if(FAT_TYPE == PART_TYPE_FAT32) {
+    e[2] = (v >> 16) & 0xff;
+    e[3] = (v >> 24) & 0xff;
   }
-  if(file_num[fd].cluster == 1) {
-    /* this is an edge case, FAT16 cluster 1 is the fixed length root directory
-     * so we return end of chain when selecting next cluster because there are
-     * no more clusters */
-    file_num[fd].error = FAT_END_OF_FILE;
-    (*rerrno) = 0;
-    return -1;
+}
+
+/*
+ * fat_find_free_run - scans the FAT for count consecutive free clusters.
+ * 
+ * The search starts at cluster hint and wraps round to the start of the data area, so a file can
+ * be extended from where its chain currently ends.  The caller must hold the system lock.
+ * Returns the first cluster of the run, 0 if there isn't a long enough run or 0xFFFFFFFF on error.
+ */
+uint32_t fat_find_free_run(uint32_t hint, uint32_t count) {
+  blockno_t current_block = MAX_BLOCK;
+  int dirty = 0;
+  uint32_t c;
+  uint32_t start = 0;
+  uint32_t run = 0;
+  uint8_t *e;
+  
+  if((hint < 2) || (hint > fatfs.max_cluster)) {
+    hint = 2;
   }
-  i = file_num[fd].cluster;
-  i = i * fatfs.fat_entry_len;     /* either 2 bytes for FAT16 or 4 for FAT32 */
-  j = (i / 512) + fatfs.active_fat_start; /* get the sector number we want */
-  if(block_read(j, file_num[fd].buffer)) {
-    (*rerrno) = EIO;
-    return -1;
+  c = hint;
+  do {
+    if((e = fat_fat_entry(c, &current_block, &dirty)) == NULL) {
+      return 0xFFFFFFFF;
+    }
+    if(fat_entry_value(e) == 0) {
+      if(run == 0) {
+        start = c;
+      }
+      if(++run == count) {
+        return start;
+      }
+    } else {
+      run = 0;
+    }
+    if(++c > fatfs.max_cluster) {
+      // runs can't wrap round the end of the FAT
+      c = 2;
+      run = 0;
+    }
+  } while(c != hint);
+  return 0;
+}
+
+/*
+ * fat_alloc_chain - allocates count clusters as a single chain and links it after cluster last
+ *                   (or leaves it unlinked if last is 0).
+ * 
+ * A contiguous run of free clusters is used if there is one, starting the search just after last
+ * so the file stays in one piece.  Otherwise free clusters are taken in order from there.  The new
+ * chain is written before it is linked on so a failure part way leaves the file as it was.
+ * Returns the first new cluster, 0 if there isn't enough free space or 0xFFFFFFFF on error.
+ */
+uint32_t fat_alloc_chain(uint32_t last, uint32_t count) {
+  blockno_t current_block = MAX_BLOCK;
+  int dirty = 0;
+  uint32_t first;
+  uint32_t prev;
+  uint32_t start;
+  uint32_t c;
+  uint32_t i;
+  uint8_t *e;
+  uint32_t eoc = FAT_EOC;
+  
+  if(!GRISTLE_SYSLOCK) {
+    return 0xFFFFFFFF;
   }
-  i = i & 0x1FF;
-  j = file_num[fd].buffer[i++];
-  j += (file_num[fd].buffer[i++] << 8);
-  if(fatfs.type == PART_TYPE_FAT32) {
-    j += file_num[fd].buffer[i++] << 16;
-    j += file_num[fd].buffer[i++] << 24;
+  first = fat_find_free_run(last + 1, count);
+  if(first == 0xFFFFFFFF) {
+    GRISTLE_SYSUNLOCK;
+    return 0xFFFFFFFF;
   }
-  if(j < 2) {
-    file_num[fd].error = FAT_ERROR_CLUSTER;
-    (*rerrno) = EIO;
-    return -1;
-  } else if(j >= fatfs.end_cluster_marker) {
-    if(file_num[fd].flags & FAT_FLAG_WRITE) {
-      /* opened for writing, we can extend the file */
-      /* find the first available cluster */
-      k = fat_get_free_cluster(fd);
-//       printf("get free cluster = %u\n", k);
-      if(k == 0) {
-        (*rerrno) = ENOSPC;
-        return -1;
+  if(first != 0) {
+    for(i=0;i<count;i++) {
+      if((e = fat_fat_entry(first + i, &current_block, &dirty)) == NULL) {
+        GRISTLE_SYSUNLOCK;
+        return 0xFFFFFFFF;
       }
-      if(k == 0xFFFFFFFF) {
-        (*rerrno) = EIO;
-        return -1;
+      fat_set_entry_value(e, (i == count - 1) ? eoc : first + i + 1);
+      dirty = 1;
+    }
+  } else {
+    /* no single run is long enough, chain together whatever is free */
+    prev = 0;
+    i = 0;
+    c = last + 1;
+    if((c < 2) || (c > fatfs.max_cluster)) {
+      c = 2;
+    }
+    start = c;
+    do {
+      if((e = fat_fat_entry(c, &current_block, &dirty)) == NULL) {
+        GRISTLE_SYSUNLOCK;
+        return 0xFFFFFFFF;
       }
-      i = file_num[fd].cluster;
-      i = i * fatfs.fat_entry_len;
-      j = (i/512) + fatfs.active_fat_start;
-      if(block_read(j, file_num[fd].buffer)) {
-        (*rerrno) = EIO;
-        return -1;
+      if(fat_entry_value(e) == 0) {
+        fat_set_entry_value(e, eoc);
+        dirty = 1;
+        if(prev == 0) {
+          first = c;
+        } else {
+          if((e = fat_fat_entry(prev, &current_block, &dirty)) == NULL) {
+            GRISTLE_SYSUNLOCK;
+            return 0xFFFFFFFF;
+          }
+          fat_set_entry_value(e, c);
+          dirty = 1;
+        }
+        prev = c;
+        i++;
       }
-      /* update the pointer to the new end of chain */
-      if(fatfs.type == PART_TYPE_FAT16) {
-        memcpy(&file_num[fd].buffer[i & 0x1FF], &k, 2);
-      } else {
-        memcpy(&file_num[fd].buffer[i & 0x1FF], &k, 4);
+      if(++c > fatfs.max_cluster) {
+        c = 2;
       }
-      if(block_write(j, file_num[fd].buffer)) {
-        (*rerrno) = EIO;
-        return -1;
+    } while((i < count) && (c != start));
+    if(i < count) {
+      // been all the way round without finding enough
+      if(dirty) {
+        fat_write_fat_sector(current_block, fatfs.sysbuf);
       }
-      /* periodically update the directory entry so that the file size gets flushed
-       * when more clusters are added to the file */
-      fat_flush_fileinfo(fd);
-      j = k;
-    } else {
-      /* end of the file cluster chain reached */
-      file_num[fd].error = FAT_END_OF_FILE;
-      (*rerrno) = 0;
-      return -1;
+      GRISTLE_SYSUNLOCK;
+      if(first != 0) {
+        fat_free_clusters(first);
+      }
+      return 0;
     }
   }
-  return j;
+  if(last >= 2) {
+    if((e = fat_fat_entry(last, &current_block, &dirty)) == NULL) {
+      GRISTLE_SYSUNLOCK;
+      return 0xFFFFFFFF;
+    }
+    fat_set_entry_value(e, first);
+    dirty = 1;
+  }
+  if(dirty) {
+    if(fat_write_fat_sector(current_block, fatfs.sysbuf)) {
+      GRISTLE_SYSUNLOCK;
+      return 0xFFFFFFFF;
+    }
+  }
+  GRISTLE_SYSUNLOCK;
+  return first;
 }
 
-/* get the next sector in the current file. */
-int fat_next_sector(int fd) {
-  int c;
-  int rerrno;
-#ifdef TRACE
-  printf("fat_next_sector(%d)\n", fd);
-#endif
-  /* if the current sector was written write to disc */
-  if(fat_flush(fd)) {
-    return -1;
+/*
+ * fat_zero_range - fills count sectors from sector with zeros.
+ * 
+ * A device that can discard the sectors and guarantees they then read as zeros does it that way,
+ * otherwise they're written from the shared zero buffer, up to GRISTLE_ZERO_SECTORS in each
+ * multi-block write.
+ */
+int fat_zero_range(blockno_t sector, uint32_t count) {
+  uint32_t n;
+  
+  // any of the sectors may be in a buffer window
+  GRISTLE_DATA_WRITTEN;
+  if(block_discard(sector, count) == 0) {
+    return 0;
   }
-  /* see if we need another cluster */
-//   printf("%d sectors_left: %d\n", fd, file_num[fd].sectors_left);
-  if(file_num[fd].sectors_left > 0) {
-    file_num[fd].sectors_left--;
-    file_num[fd].file_sector++;
-    file_num[fd].cursor = 0;
-    return block_read(++file_num[fd].sector, file_num[fd].buffer);
-  } else {
-//     printf("At cluster %d\n", file_num[fd].cluster);
-    c = fat_next_cluster(fd, &rerrno);
-//     printf("Next cluster %d\n", c);
-    if(c > -1) {
-      file_num[fd].file_sector++;
-      return fat_select_cluster(fd, c);
-    } else {
+  while(count) {
+    n = (count < GRISTLE_ZERO_SECTORS) ? count : GRISTLE_ZERO_SECTORS;
+    if(block_write_multi(sector, n, fat_zero_buf)) {
       return -1;
     }
+    sector += n;
+    count -= n;
   }
+  return 0;
 }
 
-/* Function to save file meta-info, (size modified date etc.) */
-int fat_flush_fileinfo(int fd) {
-#ifdef GRISTLE_RO
-    (void)fd;
-#else
-  direntS de;
-  direntS *de2;
+/*
+ * Seek checkpoints
+ * 
+ * The extent map only has room for MAX_FILE_EXTENTS runs, so in a fragmented file a seek beyond
+ * it has to follow the cluster chain.  Each open file also keeps the disk cluster of every
+ * 2^checkpoint_shift-th cluster of the file that's been passed through, so the walk can start
+ * from the nearest one before the target rather than the end of the map.  When a checkpoint falls
+ * beyond the last slot every other one is dropped and the interval doubled, so the table is the
+ * same size however big the file.  They're filled in by fat_extent_add() as links are followed.
+ */
+void fat_checkpoint_start(int fd, uint32_t first_cluster) {
+  file_num[fd].chain_index = 0;
+  file_num[fd].chain_cluster = (first_cluster < 2) ? 0 : first_cluster;
+  file_num[fd].checkpoint_shift = GRISTLE_CHECKPOINT_SHIFT;
+  memset(file_num[fd].checkpoints, 0, sizeof(file_num[fd].checkpoints));
+}
+
+/* fat_extent_index - where a disk cluster is in the file according to the extent map,
+ *                    0xFFFFFFFF if it isn't in the map */
+uint32_t fat_extent_index(int fd, uint32_t cluster) {
+  extentS *e;
   int i;
-  uint32_t temp_sectors_left;
-  uint32_t temp_file_sector;
-  uint32_t temp_cluster;
-  uint32_t temp_sector;
-  uint32_t temp_cursor;
-#ifdef TRACE
-  printf("fat_flush_fileinfo(%d)\n", fd);
+  
+  for(i=0;i<file_num[fd].num_extents;i++) {
+    e = &file_num[fd].extents[i];
+    if((cluster >= e->disk_cluster) && (cluster < e->disk_cluster + e->length)) {
+      return e->file_cluster + (cluster - e->disk_cluster);
+    }
+  }
+  return 0xFFFFFFFF;
+}
+
+/* fat_checkpoint_link - cluster next follows cluster prev, noted if prev's place in the file is
+ *                       known (it may be a link in some other chain, e.g. the parent directory) */
+void fat_checkpoint_link(int fd, uint32_t prev, uint32_t next) {
+  uint32_t index;
+#if GRISTLE_CHECKPOINTS > 0
+  uint32_t slot;
+  uint32_t i;
 #endif
   
-  if(file_num[fd].full_first_cluster == fatfs.root_cluster) {
-    // do nothing to try and update meta info on the root directory
-    return 0;
+  if((prev >= 2) && (prev == file_num[fd].chain_cluster)) {
+    index = file_num[fd].chain_index + 1;
+  } else if((index = fat_extent_index(fd, prev)) != 0xFFFFFFFF) {
+    index++;
+  } else {
+    return;
   }
-  // non existent file opened for reading, don't update a-time or you'll create an empty file!
-  if((file_num[fd].entry_sector == 0) && (!(file_num[fd].flags & FAT_FLAG_WRITE))) {
-    return 0;
+  file_num[fd].chain_index = index;
+  file_num[fd].chain_cluster = next;
+#if GRISTLE_CHECKPOINTS > 0
+  if(index & ((1u << file_num[fd].checkpoint_shift) - 1)) {
+    return;
   }
-  if(file_num[fd].full_first_cluster == 0) {
-//     printf("Bad first cluster!\r\n");
-//     printf("  %s\r\n", file_num[fd].filename);
-    return 0;
+  slot = (index >> file_num[fd].checkpoint_shift) - 1;
+  while(slot >= GRISTLE_CHECKPOINTS) {
+    // out of slots, keep every other checkpoint and double the interval
+    for(i=0;i<GRISTLE_CHECKPOINTS / 2;i++) {
+      file_num[fd].checkpoints[i] = file_num[fd].checkpoints[i * 2 + 1];
+    }
+    for(;i<GRISTLE_CHECKPOINTS;i++) {
+      file_num[fd].checkpoints[i] = 0;
+    }
+    file_num[fd].checkpoint_shift++;
+    if(index & ((1u << file_num[fd].checkpoint_shift) - 1)) {
+      return;
+    }
+    slot = (index >> file_num[fd].checkpoint_shift) - 1;
   }
-  memcpy(de.filename, file_num[fd].filename, 8);
-  memcpy(de.extension, file_num[fd].extension, 3);
-  de.attributes = file_num[fd].attributes;
-  /* fine resolution = 10ms, only using unix time stamp so save
-   * the unit second, create_time only saves in 2s resolution */
-  de.create_time_fine = (file_num[fd].created & 1) * 100;
-  de.create_time = fat_from_unix_time(file_num[fd].created);
-  de.create_date = fat_from_unix_date(file_num[fd].created);
-  de.access_date = fat_from_unix_date(file_num[fd].accessed);
-  de.high_first_cluster = file_num[fd].full_first_cluster >> 16;
-  de.modified_time = fat_from_unix_time(file_num[fd].modified);
-  de.modified_date = fat_from_unix_date(file_num[fd].modified);
-  de.first_cluster = file_num[fd].full_first_cluster & 0xffff;
-  de.size = file_num[fd].size;
+  file_num[fd].checkpoints[slot] = next;
+#endif
+}
+
+/*
+ * fat_checkpoint_nearest - moves index/cluster, a known place in the file's chain, on to the
+ *                          nearest checkpoint or the last cluster passed through that's still at
+ *                          or before file_cluster, if either is nearer.
+ */
+void fat_checkpoint_nearest(int fd, uint32_t file_cluster, uint32_t *index, uint32_t *cluster) {
+  uint32_t slot;
   
-  /* make sure the buffer has no changes in it */
-  if(fat_flush(fd)) {
-    return -1;
+  if((file_num[fd].chain_cluster >= 2) && (file_num[fd].chain_index <= file_cluster) &&
+     (file_num[fd].chain_index > *index)) {
+    *index = file_num[fd].chain_index;
+    *cluster = file_num[fd].chain_cluster;
   }
-  if(file_num[fd].entry_sector == 0) {
-    /* this is a new file that's never been written to disc */
-    // save the tracking info for this file, we'll need to seek through the parent with
-    // this file descriptor
-    temp_sectors_left = file_num[fd].sectors_left;
-    temp_file_sector = file_num[fd].file_sector;
-    temp_cursor = file_num[fd].cursor;
-    temp_sector = file_num[fd].sector;
-    temp_cluster = file_num[fd].cluster;
-    fat_select_cluster(fd, file_num[fd].parent_cluster);
-    
-    // find the first empty file location in the directory
-    while(1) {
-      // 16 entries per disc block
-      for(i=0;i<16;i++) {
-        de2 = (direntS *)(file_num[fd].buffer + i * 32);
-        if(de2->filename[0] == 0) {
-          // this is an empty entry
-          break;
-        }
-      }
-      if(i < 16) {
-        // we found an empty in this block
-        break;
-      }
-      fat_next_sector(fd);
-    }
-    
-    // save the entry_sector and entry_number
-    file_num[fd].entry_sector = file_num[fd].sector;
-    file_num[fd].entry_number = i;
-    
-    // restore the file tracking info
-    file_num[fd].sectors_left = temp_sectors_left;
-    file_num[fd].file_sector = temp_file_sector;
-    file_num[fd].cursor = temp_cursor;
-    file_num[fd].sector = temp_sector;
-    file_num[fd].cluster = temp_cluster;
+  slot = file_cluster >> file_num[fd].checkpoint_shift;
+  if(slot > GRISTLE_CHECKPOINTS) {
+    slot = GRISTLE_CHECKPOINTS;
+  }
+  // slot is one more than the last one that could be used
+  while((slot > 0) && (file_num[fd].checkpoints[slot - 1] == 0)) {
+    slot--;
+  }
+  if((slot > 0) && ((slot << file_num[fd].checkpoint_shift) > *index)) {
+    *index = slot << file_num[fd].checkpoint_shift;
+    *cluster = file_num[fd].checkpoints[slot - 1];
+  }
+}
+
+/*
+ * fat_extent_start - resets the extent map of an open file so it only holds the first cluster.
+ *                    A first cluster of 0 (nothing allocated yet) leaves the map empty.
+ */
+void fat_extent_start(int fd, uint32_t first_cluster) {
+  if(first_cluster < 2) {
+    file_num[fd].num_extents = 0;
   } else {
-    /* read the directory entry for this file */
-    if(block_read(file_num[fd].entry_sector, file_num[fd].buffer)) {
-      return -1;
-    }
+    file_num[fd].extents[0].file_cluster = 0;
+    file_num[fd].extents[0].disk_cluster = first_cluster;
+    file_num[fd].extents[0].length = 1;
+    file_num[fd].num_extents = 1;
   }
-  /* copy the new entry over the old */
-  memcpy(&file_num[fd].buffer[file_num[fd].entry_number * 32], &de, 32);
-  /* write the modified directory entry back to disc */
-  if(block_write(file_num[fd].entry_sector, file_num[fd].buffer)) {
-    return -1;
+  fat_checkpoint_start(fd, first_cluster);
+}
+
+/*
+ * fat_extent_add - records that cluster next follows cluster prev in the chain of an open file.
+ * 
+ * Only links that continue on from the end of the map are recorded so the map always describes
+ * an unbroken run from the start of the file.  Links from any other chain walked with this fd
+ * (e.g. a parent directory) never match the end of the map and are ignored.  Once all the extent
+ * slots are used the map stops growing and seeks beyond it walk the chain from the nearest seek
+ * checkpoint, which every link is also passed on to.
+ */
+void fat_extent_add(int fd, uint32_t prev, uint32_t next) {
+  extentS *last;
+  
+  fat_checkpoint_link(fd, prev, next);
+  if(file_num[fd].num_extents == 0) {
+    return;
   }
-  /* fetch the sector that was expected back into the buffer */
-  if(block_read(file_num[fd].sector, file_num[fd].buffer)) {
-    return -1;
+  last = &file_num[fd].extents[file_num[fd].num_extents - 1];
+  if(last->disk_cluster + last->length - 1 != prev) {
+    return;
+  }
+  if(next == prev + 1) {
+    last->length++;
+  } else if(file_num[fd].num_extents < MAX_FILE_EXTENTS) {
+    file_num[fd].extents[file_num[fd].num_extents].file_cluster = last->file_cluster + last->length;
+    file_num[fd].extents[file_num[fd].num_extents].disk_cluster = next;
+    file_num[fd].extents[file_num[fd].num_extents].length = 1;
+    file_num[fd].num_extents++;
   }
-#endif
-  /* mark the filesystem as consistent now */
-  file_num[fd].flags &= ~FAT_FLAG_FS_DIRTY;
-  return 0;
 }
 
-int fat_lookup_path(int fd, const char *path, int *rerrno) {
-  char dosname[12];
-  char dosname2[13];
-  char isdir;
-  int i;
-  int path_pointer = 0;
-  direntS *de;
-  char local_path[100];
-  char *elements[20];
-  int levels = 0;
-  int depth = 0;
+/*
+ * fat_extent_lookup - binary search of the extent map for a cluster index within the file.
+ *                     Returns the disk cluster or 0 if that part of the file isn't mapped yet.
+ */
+uint32_t fat_extent_lookup(int fd, uint32_t file_cluster) {
+  int lo = 0;
+  int hi = file_num[fd].num_extents - 1;
+  int mid;
+  extentS *e;
   
-//   printf("fat_lookup_path(%d, %s)\r\n", fd, path);
-  /* Make sure the file system has all changes flushed before searching it */
-//   for(i=0;i<MAX_OPEN_FILES;i++) {
-//     if(file_num[i].flags & FAT_FLAG_FS_DIRTY) {
-//       fat_flush_fileinfo(i);
-//     }
-//   }
+  while(lo <= hi) {
+    mid = (lo + hi) / 2;
+    e = &file_num[fd].extents[mid];
+    if(file_cluster < e->file_cluster) {
+      hi = mid - 1;
+    } else if(file_cluster >= e->file_cluster + e->length) {
+      lo = mid + 1;
+    } else {
+      return e->disk_cluster + (file_cluster - e->file_cluster);
+    }
+  }
+  return 0;
+}
 
-  if(strlen(path) > (sizeof(local_path) - 1)) {
-    *rerrno = ENAMETOOLONG;
-    return -1;
+/*
+ * fat_extent_next - returns the cluster that follows the current cluster of the file according to
+ *                   the extent map, or 0 if the map doesn't cover it.
+ * 
+ * The current cluster is checked against the map first, since the fd may be being used to walk
+ * some other chain (e.g. the parent directory in fat_flush_fileinfo()).
+ */
+uint32_t fat_extent_next(int fd) {
+  uint32_t i;
+  
+  if((file_num[fd].num_extents == 0) || (file_num[fd].cluster < 2)) {
+    return 0;
   }
-//   if(path[0] != '/') {
-//     (*rerrno) = ENAMETOOLONG;
-//     return -1;                                /* bad path, we have no cwd */
-//   }
-  strcpy(local_path, path);
+  i = file_num[fd].file_sector >> fatfs.cluster_shift;
+  if(fat_extent_lookup(fd, i) != file_num[fd].cluster) {
+    return 0;
+  }
+  return fat_extent_lookup(fd, i + 1);
+}
+
+/*
+ * fat_reserve_chain - allocates the next cluster of a growing file together with a reservation of
+ *                     fatfs.reserve_clusters more, linked on after cluster last (0 for a file with
+ *                     no clusters yet).
+ * 
+ * The batch is found and linked in one go under the system lock, from a single run of free
+ * clusters where there is one.  The reserved clusters go straight into the extent map so the file
+ * can move on to them later without reading the FAT or taking the lock.  Only the file's own
+ * chain gets a reservation, the fd is also used to walk the parent directory and last then isn't
+ * the end of the map.  Returns the new cluster, 0 if no reservation was made (the caller should
+ * allocate a single cluster instead) or 0xFFFFFFFF on error.
+ */
+uint32_t fat_reserve_chain(int fd, uint32_t last) {
+  blockno_t current_block = MAX_BLOCK;
+  int dirty = 0;
+  uint32_t first;
+  uint32_t used;
+  uint32_t c;
+  uint32_t i;
+  uint8_t *e;
+  extentS *ext;
   
-  if((elements[levels] = strtok(local_path, "/"))) {
-    while(++levels < 20) {
-      if(!(elements[levels] = strtok(NULL, "/"))) {
+  if((fatfs.reserve_clusters == 0) || (file_num[fd].attributes & FAT_ATT_SUBDIR)) {
+    return 0;
+  }
+  if(last == 0) {
+    used = 1;
+  } else {
+    if(file_num[fd].num_extents == 0) {
+      return 0;
+    }
+    ext = &file_num[fd].extents[file_num[fd].num_extents - 1];
+    if(ext->disk_cluster + ext->length - 1 != last) {
+      return 0;
+    }
+    used = ext->file_cluster + ext->length + 1;
+  }
+  first = fat_alloc_chain(last, fatfs.reserve_clusters + 1);
+  if((first == 0) || (first == 0xFFFFFFFF)) {
+    return first;
+  }
+  if(last == 0) {
+    fat_extent_start(fd, first);
+  } else {
+    fat_extent_add(fd, last, first);
+  }
+  if(GRISTLE_SYSLOCK) {
+    c = first;
+    for(i=0;i<fatfs.reserve_clusters;i++) {
+      if((e = fat_fat_entry(c, &current_block, &dirty)) == NULL) {
+        // the clusters still get used, through the FAT rather than the map
         break;
       }
+      fat_extent_add(fd, c, fat_entry_value(e));
+      c = fat_entry_value(e);
     }
+    GRISTLE_SYSUNLOCK;
   }
-  
-//   printf("\tSPLIT PATH:\n");
-//   for(i=0;i<levels;i++) {
-//     printf("\t%s\n", elements[i]);
-//   }
-//   printf("\t--------------\n");
-  /* select root directory */
-  fat_select_cluster(fd, fatfs.root_cluster);
+  file_num[fd].reserve_from = used;
+  return first;
+}
 
-  path_pointer++;
+/*
+ * fat_reserve_taken - moves the start of a file's reservation past any clusters its size now
+ *                     reaches into, counting them as added for the metadata writeback policy.
+ */
+void fat_reserve_taken(int fd) {
+  uint32_t cluster_size = fatfs.sectors_per_cluster * 512;
+  uint32_t used = (file_num[fd].size + cluster_size - 1) / cluster_size;
+  
+  if((file_num[fd].reserve_from) && (used > file_num[fd].reserve_from)) {
+    file_num[fd].clusters_added += used - file_num[fd].reserve_from;
+    file_num[fd].reserve_from = used;
+  }
+}
 
-  if(levels == 0) {
-    /* user selected the root directory to open. */
-    file_num[fd].full_first_cluster = fatfs.root_cluster;
-    file_num[fd].entry_sector = 0;
-    file_num[fd].entry_number = 0;
-    file_num[fd].file_sector = 0;
-    file_num[fd].attributes = FAT_ATT_SUBDIR;
-    file_num[fd].size = 0;
-    file_num[fd].accessed = 0;
-    file_num[fd].modified = 0;
-    file_num[fd].created = 0;
-    fat_select_cluster(fd, file_num[fd].full_first_cluster);
+/*
+ * fat_release_reserve - frees whatever is left of a file's reservation, ending its chain after
+ *                       the last cluster in use.
+ */
+int fat_release_reserve(int fd) {
+  blockno_t current_block = MAX_BLOCK;
+  int dirty = 0;
+  uint32_t keep;
+  uint32_t c;
+  uint32_t i;
+  uint32_t next;
+  uint8_t *e;
+  extentS *ext;
+  
+  fat_reserve_taken(fd);
+  keep = file_num[fd].reserve_from;
+  file_num[fd].reserve_from = 0;
+  if((keep == 0) || (file_num[fd].num_extents == 0)) {
     return 0;
   }
-
-  file_num[fd].parent_cluster = fatfs.root_cluster;
+  if(file_num[fd].size == 0) {
+    // nothing was written into the space set aside, the whole chain goes back
+    c = file_num[fd].full_first_cluster;
+    file_num[fd].full_first_cluster = 0;
+    file_num[fd].sector = 0;
+    file_num[fd].cluster = 0;
+    file_num[fd].sectors_left = 0;
+    file_num[fd].file_sector = 0;
+    file_num[fd].num_extents = 0;
+    file_num[fd].flags |= FAT_FLAG_FS_DIRTY;
+    return fat_free_clusters(c);
+  }
+  // start from the last kept cluster if the map reaches it, otherwise from the end of the map
+  ext = &file_num[fd].extents[file_num[fd].num_extents - 1];
+  if(keep <= ext->file_cluster + ext->length) {
+    i = keep - 1;
+    c = fat_extent_lookup(fd, i);
+  } else {
+    i = ext->file_cluster + ext->length - 1;
+    c = ext->disk_cluster + ext->length - 1;
+  }
+  if(!GRISTLE_SYSLOCK) {
+    return -1;
+  }
   while(1) {
-    if(depth > levels) {
-//       printf("Serious filesystem error\r\n");
-      *rerrno = EIO;
+    if((e = fat_fat_entry(c, &current_block, &dirty)) == NULL) {
+      GRISTLE_SYSUNLOCK;
       return -1;
     }
-//     if((r = str_to_fatname(&path[path_pointer], dosname)) < 0) {
-//     if(make_dos_name(dosname, path, &path_pointer)) {
-//     printf("depth = %d, levels = %d\n", depth, levels);
-    if(str_to_fatname(elements[depth], dosname2)) {
-//       printf("didn't make a dos name :(\n");
-//       printf("Path: %s\n", path);
-      (*rerrno) = EIO; // can't be ENOENT or the driver may decide to create it if open for writing
-      return -1;  /* invalid path name */
+    next = fat_entry_value(e);
+    if((next < 2) || (next >= FAT_END_CLUSTER)) {
+      // the whole reservation has been used
+      GRISTLE_SYSUNLOCK;
+      return 0;
     }
-    path_pointer = 0;
-    if(make_dos_name(dosname, dosname2, &path_pointer)) {
-//       printf("step 2 dosname failure.\n");
-      *rerrno = EIO;
-      return -1;
+    if(i == keep - 1) {
+      fat_set_entry_value(e, FAT_EOC);
+      break;
     }
-//     path_pointer += r;
-//     printf("\"%s\" depth=%d, levels=%d\r\n", dosname, depth, levels);
-    depth ++;
-    while(1) {
-//       printf("looping [s:%d/%d c:%d]\r\n", file_num[fd].sectors_left, fatfs.sectors_per_cluster, file_num[fd].cluster);
-      for(i=0;i<16;i++) {
-        if(*(char *)(file_num[fd].buffer + (i * 32)) == 0) {
-          memcpy(file_num[fd].filename, dosname, 8);
-          memcpy(file_num[fd].extension, dosname+8, 3);
-          if(depth < levels) {
-            *rerrno = GRISTLE_BAD_PATH;
-          } else {
-            *rerrno = ENOENT;
-          }
-          return -1;
-        }
-        if(strncmp(dosname, (char *)(file_num[fd].buffer + (i * 32)), 11) == 0) {
-          break;
-        }
-//         file_num[fd].buffer[i * 32 + 11] = 0;
-//         printf("%s %d\r\n", (char *)(file_num[fd].buffer + (i * 32)), i);
-      }
-      if(i == 16) {
-        if(fat_next_sector(fd) != 0) {
-          memcpy(file_num[fd].filename, dosname, 8);
-          memcpy(file_num[fd].extension, dosname+8, 3);
-          if(depth < levels) {
-            (*rerrno) = GRISTLE_BAD_PATH;
-          } else {
-            (*rerrno) = ENOENT;
-          }
-          return -1;
-        }
-      } else {
-        break;
+    c = next;
+    i++;
+  }
+  if(fat_write_fat_sector(current_block, fatfs.sysbuf)) {
+    GRISTLE_SYSUNLOCK;
+    return -1;
+  }
+  GRISTLE_SYSUNLOCK;
+  // the rest of the chain is cut off so it can be freed without holding the lock throughout
+  if(fat_free_clusters(next)) {
+    return -1;
+  }
+  // forget the freed clusters
+  while((file_num[fd].num_extents > 1) &&
+        (file_num[fd].extents[file_num[fd].num_extents - 1].file_cluster >= keep)) {
+    file_num[fd].num_extents--;
+  }
+  ext = &file_num[fd].extents[file_num[fd].num_extents - 1];
+  if(ext->file_cluster + ext->length > keep) {
+    ext->length = keep - ext->file_cluster;
+  }
+  return 0;
+}
+
+/* write a sector back to disc */
+int fat_flush(int fd) {
+#ifdef GRISTLE_RO
+    (void)fd;
+#else
+  uint32_t cluster;
+  int r;
+  int rerrno;
+#ifdef TRACE
+  printf("fat_flush\n");
+#endif
+  /* only write to disk if we need to */
+  if(file_num[fd].flags & FAT_FLAG_DIRTY) {
+    if(file_num[fd].sector == 0) {
+      /* this is a new file that's never been saved before, it needs a new cluster
+       * assigned to it, the data stored, then the meta info flushed */
+      cluster = fat_reserve_chain(fd, 0);
+      if(cluster == 0) {
+        cluster = fat_get_free_cluster();
       }
-    }
-//     printf("got here %d\r\n", i);
-    de = (direntS *)(file_num[fd].buffer + (i * 32));
-//     iprintf("%s\r\n", de->filename);
-    isdir = de->attributes & 0x10;
-    /* if dir, and there are more path elements, select */
-    if(isdir && (depth < levels)) {
-//       depth++;
-      if(fatfs.type == PART_TYPE_FAT16) {
-        if(de->first_cluster == 0) {
-          file_num[fd].parent_cluster = fatfs.root_cluster;
-          fat_select_cluster(fd, fatfs.root_cluster);
-        } else {
-          file_num[fd].parent_cluster = de->first_cluster;
-          fat_select_cluster(fd, de->first_cluster);
-        }
+      if(cluster == 0xFFFFFFFF) {
+        return -1;
+      } else if(cluster == 0) {
+        return -1;
       } else {
-        if(de->first_cluster + (de->high_first_cluster << 16) == 0) {
-          file_num[fd].parent_cluster = fatfs.root_cluster;
-          fat_select_cluster(fd, fatfs.root_cluster);
-        } else {
-          file_num[fd].parent_cluster = de->first_cluster + (de->high_first_cluster << 16);
-          fat_select_cluster(fd, de->first_cluster + (de->high_first_cluster << 16));
+//         file_num[fd].cluster = cluster;
+        file_num[fd].full_first_cluster = cluster;
+        file_num[fd].flags |= FAT_FLAG_FS_DIRTY;
+        file_num[fd].sector = FAT_CLUSTER_SECTOR(cluster);
+        file_num[fd].sectors_left = fatfs.sectors_per_cluster - 1;
+        file_num[fd].cluster = cluster;
+        if(file_num[fd].reserve_from == 0) {
+          // a reservation has already filled in the extent map
+          fat_extent_start(fd, cluster);
         }
+        //         file_num[fd].sector = cluster * fatfs.sectors_per_cluster + fatfs.cluster0;
       }
-    } else if((depth < levels)) {
-      /* path end not reached but this is not a directory */
-      (*rerrno) = ENOTDIR;
-      return -1;
-    } else {
-      /* otherwise, setup the fd */
-      file_num[fd].error = 0;
-      file_num[fd].flags = FAT_FLAG_OPEN;
-      memcpy(file_num[fd].filename, de->filename, 8);
-      memcpy(file_num[fd].extension, de->extension, 3);
-      file_num[fd].attributes = de->attributes;
-      file_num[fd].size = de->size;
-      if(fatfs.type == PART_TYPE_FAT16) {
-        file_num[fd].full_first_cluster = de->first_cluster;
-      } else {
-        file_num[fd].full_first_cluster = de->first_cluster + (de->high_first_cluster << 16);
-      }
-
-      /* this following special case occurs when a subdirectory's .. entry is opened. */
-      if(file_num[fd].full_first_cluster == 0) {
-        file_num[fd].full_first_cluster = fatfs.root_cluster;
+      if(block_write(file_num[fd].sector, file_num[fd].buffer)) {
+        /* write failed, don't clear the dirty flag */
+        return -1;
       }
-
-      file_num[fd].entry_sector = file_num[fd].sector;
-      file_num[fd].entry_number = i;
-      file_num[fd].file_sector = 0;
+      GRISTLE_DATA_WRITTEN;
+      file_num[fd].flags &= ~FAT_FLAG_DIRTY;
+      // a failure leaves FS_DIRTY set for fat_write_done() or fat_close() to report
+      fat_flush_fileinfo(fd, &rerrno);
       
-      file_num[fd].created = fat_to_unix_date(de->create_date) + fat_to_unix_time(de->create_time) + de->create_time_fine;
-      file_num[fd].modified = fat_to_unix_date(de->modified_date) + fat_to_unix_time(de->modified_date);
-      file_num[fd].accessed = fat_to_unix_date(de->access_date);
-      fat_select_cluster(fd, file_num[fd].full_first_cluster);
-      break;
+//   block_pc_snapshot_all("writenfs.img");
+//       exit(-9);
+    } else {
+      /* a file with a buffer window collects the sector there to write back later */
+      r = fat_window_store(fd);
+      if(r < 0) {
+        return -1;
+      } else if(r == 0) {
+        if(block_write(file_num[fd].sector, file_num[fd].buffer)) {
+          /* write failed, don't clear the dirty flag */
+          return -1;
+        }
+        GRISTLE_DATA_WRITTEN;
+      }
+      file_num[fd].flags &= ~FAT_FLAG_DIRTY;
     }
   }
-
+#endif
   return 0;
 }
 
-int fat_mount_fat16(blockno_t start, blockno_t volume_size) {
-  blockno_t i;
-  boot_sector_fat16 *boot16;
-  
-  if(GRISTLE_SYSLOCK) {
-    fatfs.read_only = block_get_device_read_only();
-    block_read(start, fatfs.sysbuf);
-    
-    boot16 = (boot_sector_fat16 *)fatfs.sysbuf;
-    // now validate all fields and reject the block device if anything fails
-    
-    // could check the volume name is all printable characters
-    
-    // we can only handle sector size equal to the disk block size
-    // for now at least.
-    if(!(boot16->sector_size == 512)) {
-#ifdef FAT_DEBUG
-      printf("Sector size not 512 bytes.\r\n");
+/* point the file at the first sector of a given cluster without loading it */
+void fat_set_cluster(int fd, uint32_t cluster) {
+  if(FAT_FIXED_ROOT(cluster)) {
+    // this is an edge case for the fixed root directory on FAT16
+    file_num[fd].sector = fatfs.root_start;
+    file_num[fd].sectors_left = fatfs.root_len - 1;
+    file_num[fd].cluster = 1;
+    file_num[fd].cursor = 0;
+  } else {
+    file_num[fd].sector = FAT_CLUSTER_SECTOR(cluster);
+    file_num[fd].sectors_left = fatfs.sectors_per_cluster - 1;
+    file_num[fd].cluster = cluster;
+    file_num[fd].cursor = 0;
+  }
+}
+
+/* get the first sector of a given cluster */
+int fat_select_cluster(int fd, uint32_t cluster) {
+#ifdef TRACE
+  printf("fat_select_cluster\n");
 #endif
-      GRISTLE_SYSUNLOCK;
-      return -1;
-    }
-    
-    // cluster size is a number of sectors per cluster.  Must be a
-    // power of two in 8 bits (i.e. 1, 2, 4, 8, 16, 32, 64 or 128)
-    for(i=0;i<8;i++) {
-      if(boot16->cluster_size == (1 << i)) {
-        break;
+//   printf("%d: select cluster %d\n  sector=%d\n", fd, cluster, file_num[fd].sector);
+  fat_set_cluster(fd, cluster);
+//   printf("  sector=%d=%d * %d + %d\n", file_num[fd].sector, cluster, fatfs.sectors_per_cluster, fatfs.cluster0);
+
+  return block_read(file_num[fd].sector, file_num[fd].buffer);
+}
+
+/*
+ * fat_writeback_due - checks the metadata writeback policy to see if the directory entry of a
+ *                     growing file should be brought up to date now.
+ */
+int fat_writeback_due(int fd) {
+  if((fatfs.writeback_clusters) && (file_num[fd].clusters_added >= fatfs.writeback_clusters)) {
+    return 1;
+  }
+  if((fatfs.writeback_seconds) && (file_num[fd].flags & FAT_FLAG_FS_DIRTY) &&
+     (GRISTLE_TIME - file_num[fd].info_flushed >= (time_t)fatfs.writeback_seconds)) {
+    return 1;
+  }
+  return 0;
+}
+
+/* get the next cluster in the current file */
+int fat_next_cluster(int fd, int *rerrno) {
+  uint32_t i;
+  uint32_t j;
+  uint32_t k;
+#ifdef TRACE
+  printf("fat_next_cluster\n");
+#endif
+  (*rerrno) = 0;
+  if(fat_flush(fd)) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+  if(FAT_FIXED_ROOT(file_num[fd].cluster)) {
+    /* this is an edge case, FAT16 cluster 1 is the fixed length root directory
+     * so we return end of chain when selecting next cluster because there are
+     * no more clusters */
+    file_num[fd].error = FAT_END_OF_FILE;
+    (*rerrno) = 0;
+    return -1;
+  }
+  i = file_num[fd].cluster;
+  i = i << FAT_ENTRY_SHIFT;     /* either 2 bytes for FAT16 or 4 for FAT32 */
+  j = (i / 512) + fatfs.active_fat_start; /* get the sector number we want */
+  if(block_read(j, file_num[fd].buffer)) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+  i = i & 0x1FF;
+  j = file_num[fd].buffer[i++];
+  j += (file_num[fd].buffer[i++] << 8);
+  if(FAT_TYPE == PART_TYPE_FAT32) {
+    j += file_num[fd].buffer[i++] << 16;
+    j += file_num[fd].buffer[i++] << 24;
+  }
+  if(j < 2) {
+    file_num[fd].error = FAT_ERROR_CLUSTER;
+    (*rerrno) = EIO;
+    return -1;
+  } else if(j >= FAT_END_CLUSTER) {
+    if(file_num[fd].flags & FAT_FLAG_WRITE) {
+      /* opened for writing, we can extend the file */
+      /* take a batch of clusters if reserving, otherwise find the first available cluster */
+      k = fat_reserve_chain(fd, file_num[fd].cluster);
+      if(k == 0xFFFFFFFF) {
+        (*rerrno) = EIO;
+        return -1;
+      }
+      if(k == 0) {
+        k = fat_get_free_cluster(fd);
+//         printf("get free cluster = %u\n", k);
+        if(k == 0) {
+          (*rerrno) = ENOSPC;
+          return -1;
+        }
+        if(k == 0xFFFFFFFF) {
+          (*rerrno) = EIO;
+          return -1;
+        }
+        i = file_num[fd].cluster;
+        i = i << FAT_ENTRY_SHIFT;
+        j = (i/512) + fatfs.active_fat_start;
+        /* the FAT sector may hold entries other threads are changing */
+        if(!GRISTLE_SYSLOCK) {
+          (*rerrno) = EBUSY;
+          return -1;
+        }
+        if(block_read(j, file_num[fd].buffer)) {
+          GRISTLE_SYSUNLOCK;
+          (*rerrno) = EIO;
+          return -1;
+        }
+        /* update the pointer to the new end of chain */
+        if(FAT_TYPE == PART_TYPE_FAT16) {
+          memcpy(&file_num[fd].buffer[i & 0x1FF], &k, 2);
+        } else {
+          memcpy(&file_num[fd].buffer[i & 0x1FF], &k, 4);
+        }
+        if(fat_write_fat_sector(j, file_num[fd].buffer)) {
+          GRISTLE_SYSUNLOCK;
+          (*rerrno) = EIO;
+          return -1;
+        }
+        GRISTLE_SYSUNLOCK;
+      }
+      /* periodically update the directory entry so that the file size gets flushed
+       * when more clusters are added to the file, how often is set by the writeback policy */
+      file_num[fd].clusters_added++;
+      if(fat_writeback_due(fd)) {
+        fat_flush_fileinfo(fd, rerrno);
+        (*rerrno) = 0;
       }
+      j = k;
+    } else {
+      /* end of the file cluster chain reached */
+      file_num[fd].error = FAT_END_OF_FILE;
+      (*rerrno) = 0;
+      return -1;
     }
-    if(i == 8) {
-#ifdef FAT_DEBUG
-      printf("Cluster size not power of two.\r\n");
+  }
+  return j;
+}
+
+/*
+ * fat_step_sector - move on to the next sector in the current file without loading it into the
+ *                   file buffer.  The cursor is left at 0 but the buffer contents are stale.
+ */
+int fat_step_sector(int fd) {
+  int c;
+  int rerrno;
+#ifdef TRACE
+  printf("fat_step_sector(%d)\n", fd);
 #endif
-      GRISTLE_SYSUNLOCK;
+  /* if the current sector was written write to disc */
+  if(fat_flush(fd)) {
+    return -1;
+  }
+  /* see if we need another cluster */
+//   printf("%d sectors_left: %d\n", fd, file_num[fd].sectors_left);
+  if(file_num[fd].sectors_left > 0) {
+    file_num[fd].sectors_left--;
+    file_num[fd].file_sector++;
+    file_num[fd].sector++;
+    file_num[fd].cursor = 0;
+    return 0;
+  } else {
+//     printf("At cluster %d\n", file_num[fd].cluster);
+    /* clusters that have been visited or preallocated before don't need a FAT lookup */
+    c = fat_extent_next(fd);
+    if(c == 0) {
+      c = fat_next_cluster(fd, &rerrno);
+    }
+//     printf("Next cluster %d\n", c);
+    if(c > -1) {
+      fat_extent_add(fd, file_num[fd].cluster, c);
+      file_num[fd].file_sector++;
+      fat_set_cluster(fd, c);
+      return 0;
+    } else {
       return -1;
     }
-    
-    // number of reserved sectors must be at least 1, can't be
-    // the size of the partition.
-    if((boot16->reserved_sectors < 1) || (boot16->reserved_sectors >= volume_size)) {
-#ifdef FAT_DEBUG
-      printf("Reserved sector count was not valid: %d\r\n", boot16->reserved_sectors);
+  }
+}
+
+/* get the next sector in the current file. */
+int fat_next_sector(int fd) {
+#ifdef TRACE
+  printf("fat_next_sector(%d)\n", fd);
 #endif
-      GRISTLE_SYSUNLOCK;
+  if(fat_step_sector(fd)) {
+    return -1;
+  }
+  return block_read(file_num[fd].sector, file_num[fd].buffer);
+}
+
+/*
+ * fat_sector_run - counts how many sectors from the current one (up to max) are contiguous on
+ *                  the disk.
+ * 
+ * The run covers the rest of the current cluster plus any following clusters the extent map shows
+ * are next to it on the disk.  The cluster holding the last sector of the run is stored in
+ * last_cluster and the total length of the run before it was limited by max in run_len.
+ */
+uint32_t fat_sector_run(int fd, uint32_t max, uint32_t *last_cluster, uint32_t *run_len) {
+  uint32_t run;
+  uint32_t cluster;
+  
+  run = file_num[fd].sectors_left + 1;
+  cluster = file_num[fd].cluster;
+  while((run < max) && (cluster > 1) &&
+        (fat_extent_lookup(fd, (file_num[fd].file_sector + run) >> fatfs.cluster_shift) == cluster + 1)) {
+    cluster++;
+    run += fatfs.sectors_per_cluster;
+  }
+  *last_cluster = cluster;
+  *run_len = run;
+  if(run > max) {
+    return max;
+  }
+  return run;
+}
+
+/*
+ * fat_skip_sectors - moves the file on to the last of n sectors that have just been transferred
+ *                    directly, leaving the cursor at the end of it.
+ */
+void fat_skip_sectors(int fd, uint32_t n, uint32_t last_cluster, uint32_t run_len) {
+  file_num[fd].cluster = last_cluster;
+  file_num[fd].sector += n - 1;
+  file_num[fd].sectors_left = run_len - n;
+  file_num[fd].file_sector += n - 1;
+  file_num[fd].cursor = 512;
+}
+
+#if GRISTLE_BUFFER_SECTORS > 1
+/*
+ * fat_window_valid - checks whether the buffer window of a file holds the given sector.
+ * 
+ * A clean window read before the latest write of file data (through any fd) may be out of date
+ * and is ignored, a dirty one holds the newest copy of its sectors whatever has happened since.
+ */
+int fat_window_valid(int fd, uint32_t sector) {
+  return (file_num[fd].window_len) &&
+         (sector >= file_num[fd].window_sector) &&
+         (sector < file_num[fd].window_sector + file_num[fd].window_len) &&
+         ((file_num[fd].window_dirty) || (file_num[fd].window_gen == GRISTLE_DATA_GEN));
+}
+
+/* fat_window_flush - writes the buffer window of a file back to the disc if it has changed */
+int fat_window_flush(int fd) {
+  if(!file_num[fd].window_dirty) {
+    return 0;
+  }
+  if(block_write_multi(file_num[fd].window_sector, file_num[fd].window_len, file_num[fd].window)) {
+    return -1;
+  }
+  file_num[fd].window_dirty = 0;
+  file_num[fd].window_gen = GRISTLE_DATA_WRITTEN;
+  return 0;
+}
+
+/*
+ * fat_window_read - loads the current sector of a file into its buffer, from the buffer window if
+ *                   it is there.
+ * 
+ * With ahead set a miss refills the window with as many sectors from the current one as are
+ * contiguous on the disc and inside the file, otherwise (e.g. after a seek, where the next access
+ * could be anywhere) only the one sector is read.
+ */
+int fat_window_read(int fd, int ahead) {
+  uint32_t n;
+  uint32_t end;
+  uint32_t last_cluster;
+  uint32_t run_len;
+  
+  if(fat_window_valid(fd, file_num[fd].sector)) {
+    memcpy(file_num[fd].buffer, &file_num[fd].window[(file_num[fd].sector - file_num[fd].window_sector) * 512], 512);
+    return 0;
+  }
+  if((!ahead) || (file_num[fd].window_size < 2) || (file_num[fd].attributes & FAT_ATT_SUBDIR) ||
+     (!fat_window_borrow(fd))) {
+    return block_read(file_num[fd].sector, file_num[fd].buffer);
+  }
+  if(fat_window_flush(fd)) {
+    return -1;
+  }
+  n = fat_sector_run(fd, file_num[fd].window_size, &last_cluster, &run_len);
+  end = (file_num[fd].size + 511) / 512;
+  if(file_num[fd].file_sector + n > end) {
+    n = (end > file_num[fd].file_sector) ? end - file_num[fd].file_sector : 1;
+  }
+  // taken before the read so a write by another file while it's going on counts against it
+  file_num[fd].window_gen = GRISTLE_DATA_GEN;
+  if(block_read_multi(file_num[fd].sector, n, file_num[fd].window)) {
+    file_num[fd].window_len = 0;
+    return -1;
+  }
+  file_num[fd].window_sector = file_num[fd].sector;
+  file_num[fd].window_len = n;
+  memcpy(file_num[fd].buffer, file_num[fd].window, 512);
+  return 0;
+}
+
+/*
+ * fat_window_store - puts the current sector of a file in its buffer window to be written back
+ *                    later.  Returns 1 if it was stored, 0 if the file doesn't use a window (the
+ *                    caller writes the sector itself) or -1 on error.
+ * 
+ * The sector can replace one already in the window or extend it when it's the next sector on the
+ * disc, otherwise the window is written back and started again from this sector.  A file that
+ * can't have its window at the moment writes the sector itself.
+ */
+int fat_window_store(int fd) {
+  uint32_t sector = file_num[fd].sector;
+  
+  if((file_num[fd].window_size < 2) || (file_num[fd].attributes & FAT_ATT_SUBDIR) ||
+     (!fat_window_borrow(fd))) {
+    return 0;
+  }
+  if((file_num[fd].window_len) && (file_num[fd].window_len < file_num[fd].window_size) &&
+     (sector == file_num[fd].window_sector + file_num[fd].window_len) &&
+     ((file_num[fd].window_dirty) || (file_num[fd].window_gen == GRISTLE_DATA_GEN))) {
+    file_num[fd].window_len++;
+  } else if(!fat_window_valid(fd, sector)) {
+    if(fat_window_flush(fd)) {
       return -1;
     }
-    
-    // number of fats, normally two but must be between 1 and 15
-    if((boot16->num_fats < 1) || (boot16->num_fats >= 15)) {
-#ifdef FAT_DEBUG
-      printf("Invalid number of FATs: %d\r\n", boot16->num_fats);
+    file_num[fd].window_sector = sector;
+    file_num[fd].window_len = 1;
+  }
+  memcpy(&file_num[fd].window[(sector - file_num[fd].window_sector) * 512], file_num[fd].buffer, 512);
+  file_num[fd].window_dirty = 1;
+  return 1;
+}
+#else
+int fat_window_flush(int fd __attribute__((__unused__))) {
+  return 0;
+}
+
+int fat_window_read(int fd, int ahead __attribute__((__unused__))) {
+  return block_read(file_num[fd].sector, file_num[fd].buffer);
+}
+
+int fat_window_store(int fd __attribute__((__unused__))) {
+  return 0;
+}
 #endif
-      GRISTLE_SYSUNLOCK;
+
+/* fat_window_drop - forgets the buffer window of a file, any changes in it must be flushed first */
+void fat_window_drop(int fd) {
+  file_num[fd].window_len = 0;
+  file_num[fd].window_dirty = 0;
+}
+
+/*
+ * Buffer pool
+ * 
+ * The sector buffer of every file and the buffer windows all come out of fat_pool.  A file is
+ * pinned by each call using it (fat_fd_lock() does this for the public calls taking an fd) and
+ * only pinned files can be sure of their buffers.  When the pool runs out one that isn't pinned,
+ * the least recently used first, is written back and gives up its sectors.  It gets a buffer
+ * again, reloaded with its current sector, the next time it's pinned, while a window is borrowed
+ * again when the file next reads ahead or writes a sector.  Closing a file gives everything back.
+ */
+#define FAT_POOL_BUSY 0xFFFFFFFF
+#define FAT_POOL_COPY 0xFF      // owner of sectors lent to fat_copy_file_range() for its data
+
+/* fat_pool_release - gives the sector buffer of a file back to the pool, or else its window */
+void fat_pool_release(int fd, int window) {
+  uint32_t i;
+  
+  for(i=0;i<GRISTLE_POOL_SECTORS;i++) {
+    if((fat_pool_owner[i] == fd + 1) && ((fat_pool[i] == file_num[fd].buffer) == !window)) {
+      fat_pool_owner[i] = 0;
+    }
+  }
+  if(window) {
+    file_num[fd].window = NULL;
+    fat_window_drop(fd);
+  } else {
+    file_num[fd].buffer = NULL;
+  }
+}
+
+/*
+ * fat_pool_cost - what taking a sector of the pool would cost, 0 if it's free, FAT_POOL_BUSY if
+ *                 it can't be taken or otherwise the LRU stamp of the file using it plus one.
+ */
+uint32_t fat_pool_cost(uint32_t i) {
+  int fd = fat_pool_owner[i] - 1;
+  
+  if(fd < 0) {
+    return 0;
+  }
+  if(fat_pool_owner[i] == FAT_POOL_COPY) {
+    return FAT_POOL_BUSY;
+  }
+  if(file_num[fd].pins) {
+    return FAT_POOL_BUSY;
+  }
+  // a new file's first sector can't be written until it's given a directory entry
+  if((fat_pool[i] == file_num[fd].buffer) && (file_num[fd].flags & FAT_FLAG_DIRTY) &&
+     (file_num[fd].sector == 0)) {
+    return FAT_POOL_BUSY;
+  }
+  return file_num[fd].buffer_used + 1;
+}
+
+/* fat_pool_take - writes back and frees a sector of the pool, and the rest of a window it is in */
+int fat_pool_take(uint32_t i) {
+  int fd = fat_pool_owner[i] - 1;
+  
+  if(fd < 0) {
+    return 0;
+  }
+  if(fat_pool[i] == file_num[fd].buffer) {
+    if(fat_flush(fd)) {
       return -1;
     }
-    
-    // number of root directory entries
-    if((boot16->root_entries == 0)) {
-#ifdef FAT_DEBUG
-      printf("No root directory entries, looks like a FAT32 partition.\r\n");
-#endif
-      GRISTLE_SYSUNLOCK;
+    fat_pool_release(fd, 0);
+  } else {
+    if(fat_window_flush(fd)) {
       return -1;
     }
-    
-    // number of root directory entries must be an integer multiple of the sector size
-    if((boot16->root_entries) & ((boot16->sector_size / 32) - 1)) {
-#ifdef FAT_DEBUG
-      printf("Root directory will not be an integer number of sectors.\r\n");
-#endif
-      GRISTLE_SYSUNLOCK;
+    fat_pool_release(fd, 1);
+  }
+  return 0;
+}
+
+/*
+ * fat_pool_find - frees n consecutive sectors of the pool, returns the index of the first or -1 if
+ *                 there aren't that many that can be taken.
+ * 
+ * A free run is used if there is one, otherwise the run whose most recently used file has gone
+ * unused the longest.  Must be called with GRISTLE_SYSLOCK held.
+ */
+int fat_pool_find(uint32_t n) {
+  uint32_t i;
+  uint32_t j;
+  uint32_t cost;
+  uint32_t best_cost = FAT_POOL_BUSY;
+  int best = -1;
+  
+  for(i=0;(i + n <= GRISTLE_POOL_SECTORS) && (best_cost);i++) {
+    cost = 0;
+    for(j=0;(j<n) && (cost < best_cost);j++) {
+      if(fat_pool_cost(i + j) > cost) {
+        cost = fat_pool_cost(i + j);
+      }
+    }
+    if(cost < best_cost) {
+      best_cost = cost;
+      best = i;
+    }
+  }
+  if(best < 0) {
+    return -1;
+  }
+  for(j=0;j<n;j++) {
+    if(fat_pool_take(best + j)) {
+      return -1;
+    }
+  }
+  return best;
+}
+
+/*
+ * fat_window_borrow - makes sure a file has the sectors for its buffer window, returns 0 if it
+ *                     can't have them at the moment.
+ */
+int fat_window_borrow(int fd) {
+  uint32_t j;
+  int i;
+  
+  if(file_num[fd].window) {
+    return 1;
+  }
+  // a file that isn't pinned is only being written back so its sectors can be taken
+  if((!file_num[fd].pins) || (!GRISTLE_SYSLOCK)) {
+    return 0;
+  }
+  if((i = fat_pool_find(file_num[fd].window_size)) >= 0) {
+    for(j=0;j<file_num[fd].window_size;j++) {
+      fat_pool_owner[i + j] = fd + 1;
+    }
+    file_num[fd].window = fat_pool[i];
+    fat_window_drop(fd);
+  }
+  GRISTLE_SYSUNLOCK;
+  return i >= 0;
+}
+
+/*
+ * fat_pool_lend - borrows a run of the pool for fat_copy_file_range(), as many sectors as a
+ *                 cluster if it can or else fewer, halving down to min.  Returns the first sector
+ *                 and sets *n to the length of the run, or NULL if not even min could be had.
+ */
+uint8_t *fat_pool_lend(uint32_t min, uint32_t *n) {
+  uint32_t j;
+  int i = -1;
+  
+  if(!GRISTLE_SYSLOCK) {
+    return NULL;
+  }
+  for((*n) = fatfs.sectors_per_cluster;(*n) >= min;(*n) >>= 1) {
+    if((i = fat_pool_find(*n)) >= 0) {
+      for(j=0;j<(*n);j++) {
+        fat_pool_owner[i + j] = FAT_POOL_COPY;
+      }
+      break;
+    }
+  }
+  GRISTLE_SYSUNLOCK;
+  return (i >= 0) ? fat_pool[i] : NULL;
+}
+
+/* fat_pool_give_back - returns a run of sectors lent by fat_pool_lend() */
+void fat_pool_give_back(uint8_t *p, uint32_t n) {
+  uint32_t i = (p - fat_pool[0]) / 512;
+  
+  if(GRISTLE_SYSLOCK) {
+    while(n--) {
+      fat_pool_owner[i++] = 0;
+    }
+    GRISTLE_SYSUNLOCK;
+  }
+}
+
+/* fat_buffer_unpin - undoes a fat_buffer_pin(), a file that has been closed gives its sectors back */
+void fat_buffer_unpin(int fd) {
+  if(GRISTLE_SYSLOCK) {
+    if(file_num[fd].pins) {
+      file_num[fd].pins--;
+    }
+    if((!file_num[fd].pins) && (!(file_num[fd].flags & FAT_FLAG_OPEN))) {
+      fat_pool_release(fd, 0);
+      fat_pool_release(fd, 1);
+    }
+    GRISTLE_SYSUNLOCK;
+  }
+}
+
+/*
+ * fat_buffer_pin - stops the buffers of a file being taken until fat_buffer_unpin(), first giving
+ *                  it a sector buffer if it has lost its own.  Returns -1 with ENOMEM if every
+ *                  sector in the pool belongs to a pinned file.
+ */
+int fat_buffer_pin(int fd, int *rerrno) {
+  int i = 0;
+  
+  if(!GRISTLE_SYSLOCK) {
+    (*rerrno) = EBUSY;
+    return -1;
+  }
+  file_num[fd].pins++;
+  file_num[fd].buffer_used = ++fat_pool_clock;
+  if(!file_num[fd].buffer) {
+    if((i = fat_pool_find(1)) >= 0) {
+      fat_pool_owner[i] = fd + 1;
+      file_num[fd].buffer = fat_pool[i];
+    } else {
+      file_num[fd].pins--;
+    }
+    GRISTLE_SYSUNLOCK;
+    if(i < 0) {
+      (*rerrno) = ENOMEM;
+      return -1;
+    }
+    // the sector the file was on when its buffer was taken, which is up to date on the disc
+    if((file_num[fd].sector) && (file_num[fd].flags & (FAT_FLAG_READ | FAT_FLAG_WRITE))) {
+      if(fat_window_read(fd, 0)) {
+        fat_buffer_unpin(fd);
+        (*rerrno) = EIO;
+        return -1;
+      }
+    } else {
+      memset(file_num[fd].buffer, 0, 512);
+    }
+    return 0;
+  }
+  GRISTLE_SYSUNLOCK;
+  return 0;
+}
+
+/*
+ * fat_fd_lock - takes the lock of an open file and pins it for a public call.  Returns -1, having
+ *               let the lock go again, with EBADF if the file isn't open or the error from
+ *               fat_buffer_pin().
+ */
+int fat_fd_lock(int fd, int *rerrno) {
+  GRISTLE_FD_LOCK(fd);
+  if(!(file_num[fd].flags & FAT_FLAG_OPEN)) {
+    GRISTLE_FD_UNLOCK(fd);
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(fat_buffer_pin(fd, rerrno)) {
+    GRISTLE_FD_UNLOCK(fd);
+    return -1;
+  }
+  return 0;
+}
+
+void fat_fd_unlock(int fd) {
+  fat_buffer_unpin(fd);
+  GRISTLE_FD_UNLOCK(fd);
+}
+
+/* get the next sector of a regular file's data, through its buffer window */
+int fat_next_data_sector(int fd) {
+  if(fat_step_sector(fd)) {
+    return -1;
+  }
+  return fat_window_read(fd, 1);
+}
+
+/*
+ * fat_read_sectors - reads whole sectors following the current one straight into buf.
+ * 
+ * Moves on to the next sector and reads as many contiguous sectors as possible (up to max) in one
+ * block_read_multi(), by-passing the file buffer.  The file is left positioned at the end of the
+ * last sector read, as if it had been read through the buffer.  Returns the number of sectors
+ * read, 0 means the end of the cluster chain was reached or there was an error.
+ */
+uint32_t fat_read_sectors(int fd, uint8_t *buf, uint32_t max) {
+  uint32_t n;
+  uint32_t run;
+  uint32_t cluster;
+  
+  /* the disc has to be up to date with anything waiting in the buffer window */
+  if(fat_window_flush(fd)) {
+    return 0;
+  }
+  if(fat_step_sector(fd)) {
+    file_num[fd].cursor = 512;
+    return 0;
+  }
+  n = fat_sector_run(fd, max, &cluster, &run);
+  if(block_read_multi(file_num[fd].sector, n, buf)) {
+    /* leave the file at the start of the sector that failed so a retry goes through the buffer */
+    block_read(file_num[fd].sector, file_num[fd].buffer);
+    return 0;
+  }
+  fat_skip_sectors(fd, n, cluster, run);
+  return n;
+}
+
+/*
+ * fat_write_sectors - writes whole sectors following the current one straight from buf.
+ * 
+ * The write counterpart of fat_read_sectors(), moving on to the next sector extends the file
+ * with a new cluster if needed.  Since every byte of the sectors is replaced nothing is read
+ * from them first.  Returns the number of sectors written, 0 on error.
+ */
+uint32_t fat_write_sectors(int fd, const uint8_t *buf, uint32_t max) {
+  uint32_t n;
+  uint32_t run;
+  uint32_t cluster;
+  
+  /* the sectors may be in the buffer window, which would then be out of date */
+  if(fat_window_flush(fd)) {
+    return 0;
+  }
+  fat_window_drop(fd);
+  if(fat_step_sector(fd)) {
+    file_num[fd].cursor = 512;
+    return 0;
+  }
+  n = fat_sector_run(fd, max, &cluster, &run);
+  if(block_write_multi(file_num[fd].sector, n, (void *)buf)) {
+    block_read(file_num[fd].sector, file_num[fd].buffer);
+    return 0;
+  }
+  GRISTLE_DATA_WRITTEN;
+  fat_skip_sectors(fd, n, cluster, run);
+  return n;
+}
+
+/*
+ * fat_zero_sectors - as fat_write_sectors() but fills the sectors with zeros, a whole contiguous
+ *                    run in one fat_zero_range().
+ */
+uint32_t fat_zero_sectors(int fd, uint32_t max) {
+  uint32_t n;
+  uint32_t run;
+  uint32_t cluster;
+  
+  if(fat_window_flush(fd)) {
+    return 0;
+  }
+  fat_window_drop(fd);
+  if(fat_step_sector(fd)) {
+    file_num[fd].cursor = 512;
+    return 0;
+  }
+  n = fat_sector_run(fd, max, &cluster, &run);
+  if(fat_zero_range(file_num[fd].sector, n)) {
+    block_read(file_num[fd].sector, file_num[fd].buffer);
+    return 0;
+  }
+  fat_skip_sectors(fd, n, cluster, run);
+  return n;
+}
+
+/*
+ * fat_seek_cluster - makes the given cluster index within the file the current cluster.
+ * 
+ * The extent map is checked first, if the cluster isn't mapped yet the chain is walked from the
+ * last mapped cluster, the nearest seek checkpoint or the last cluster passed through, whichever
+ * is furthest on without going past, extending the map as it goes.
+ */
+int fat_seek_cluster(int fd, uint32_t file_cluster, int *rerrno) {
+  blockno_t current_block = MAX_BLOCK;
+  int dirty = 0;
+  uint32_t i;
+  uint32_t cluster;
+  uint32_t next;
+  uint8_t *e;
+  int c;
+  extentS *last;
+  
+  cluster = fat_extent_lookup(fd, file_cluster);
+  if(cluster) {
+    file_num[fd].cluster = cluster;
+    return 0;
+  }
+  if(file_num[fd].num_extents == 0) {
+    fat_extent_start(fd, file_num[fd].full_first_cluster);
+    i = 0;
+    cluster = file_num[fd].full_first_cluster;
+  } else {
+    last = &file_num[fd].extents[file_num[fd].num_extents - 1];
+    i = last->file_cluster + last->length - 1;
+    cluster = last->disk_cluster + last->length - 1;
+  }
+  fat_checkpoint_nearest(fd, file_cluster, &i, &cluster);
+  file_num[fd].chain_index = i;
+  file_num[fd].chain_cluster = cluster;
+  // walk the FAT cluster chain until we get to the right one, reading each FAT sector only once
+  if((i < file_cluster) && (cluster >= 2)) {
+    if(!GRISTLE_SYSLOCK) {
+      (*rerrno) = EBUSY;
+      return -1;
+    }
+    while(i < file_cluster) {
+      if((e = fat_fat_entry(cluster, &current_block, &dirty)) == NULL) {
+        GRISTLE_SYSUNLOCK;
+        (*rerrno) = EIO;
+        return -1;
+      }
+      next = fat_entry_value(e);
+      if((next < 2) || (next >= FAT_END_CLUSTER)) {
+        break;
+      }
+      fat_extent_add(fd, cluster, next);
+      cluster = next;
+      i++;
+    }
+    GRISTLE_SYSUNLOCK;
+  }
+  file_num[fd].cluster = cluster;
+  // the end of the chain, fat_next_cluster() extends a file that's open for writing
+  while(i < file_cluster) {
+    c = fat_next_cluster(fd, rerrno);
+    if(c < 0) {
+      return -1;
+    }
+    fat_extent_add(fd, file_num[fd].cluster, c);
+    file_num[fd].cluster = c;
+    i++;
+  }
+  return 0;
+}
+
+/*
+ * fat_dir_mask - tests all 16 entries of a directory sector at once.  Returns a bit mask of the
+ *                entries with the given 11 byte name (0 if name is NULL) and sets end to the
+ *                entries starting with the end of directory marker and deleted to the ones
+ *                marked deleted, bit n standing for entry n.
+ * 
+ * The first bytes of the entries are gathered into one vector and tested against both markers
+ * with SSE2 or NEON where the compiler targets them, the names are compared a whole entry per
+ * vector operation without stopping at the first match.  Other targets compare names a word at
+ * a time.
+ */
+#if defined(__SSE2__)
+uint16_t fat_dir_mask(const uint8_t *buf, const char *name, uint16_t *end, uint16_t *deleted) {
+  uint8_t padded[16];
+  __m128i n;
+  __m128i e;
+  __m128i first;
+  uint16_t match = 0;
+  int i;
+  
+  memset(padded, 0, sizeof(padded));
+  if(name) {
+    memcpy(padded, name, 11);
+  }
+  n = _mm_loadu_si128((const __m128i *)padded);
+  first = _mm_setzero_si128();
+  // last entry first so each first byte is shifted up into its own lane
+  for(i=15;i>=0;i--) {
+    e = _mm_loadu_si128((const __m128i *)(buf + i * 32));
+    first = _mm_or_si128(_mm_slli_si128(first, 1), _mm_and_si128(e, _mm_cvtsi32_si128(0xff)));
+    match = (match << 1) | ((_mm_movemask_epi8(_mm_cmpeq_epi8(e, n)) & 0x7FF) == 0x7FF);
+  }
+  *end = _mm_movemask_epi8(_mm_cmpeq_epi8(first, _mm_setzero_si128()));
+  *deleted = _mm_movemask_epi8(_mm_cmpeq_epi8(first, _mm_set1_epi8((char)0xe5)));
+  return name ? match : 0;
+}
+#elif defined(__ARM_NEON) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+/* fat_neon_movemask - the top bits of the 16 bytes of a comparison result as a bit mask */
+uint16_t fat_neon_movemask(uint8x16_t eq) {
+  static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  uint64x2_t sum;
+  
+  sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vandq_u8(eq, vld1q_u8(weights)))));
+  return vgetq_lane_u64(sum, 0) | (vgetq_lane_u64(sum, 1) << 8);
+}
+
+uint16_t fat_dir_mask(const uint8_t *buf, const char *name, uint16_t *end, uint16_t *deleted) {
+  uint8_t padded[16];
+  uint8_t first[16];
+  uint8x16_t n;
+  uint8x16_t f;
+  uint64x2_t eq;
+  uint16_t match = 0;
+  int i;
+  
+  for(i=0;i<16;i++) {
+    first[i] = buf[i * 32];
+  }
+  f = vld1q_u8(first);
+  *end = fat_neon_movemask(vceqq_u8(f, vdupq_n_u8(0)));
+  *deleted = fat_neon_movemask(vceqq_u8(f, vdupq_n_u8(0xe5)));
+  if(name) {
+    memset(padded, 0, sizeof(padded));
+    memcpy(padded, name, 11);
+    n = vld1q_u8(padded);
+    for(i=0;i<16;i++) {
+      eq = vreinterpretq_u64_u8(vceqq_u8(vld1q_u8(buf + i * 32), n));
+      match |= ((vgetq_lane_u64(eq, 0) == 0xFFFFFFFFFFFFFFFFULL) &&
+                ((vgetq_lane_u64(eq, 1) & 0xFFFFFF) == 0xFFFFFF)) << i;
+    }
+  }
+  return match;
+}
+#else
+uint16_t fat_dir_mask(const uint8_t *buf, const char *name, uint16_t *end, uint16_t *deleted) {
+  uint32_t n[3];
+  uint32_t e[3];
+  uint16_t match = 0;
+  int i;
+  
+  *end = 0;
+  *deleted = 0;
+  for(i=0;i<16;i++) {
+    *end |= (buf[i * 32] == 0) << i;
+    *deleted |= (buf[i * 32] == 0xe5) << i;
+  }
+  if(name) {
+    n[2] = 0;
+    e[2] = 0;
+    memcpy(n, name, 11);
+    for(i=0;i<16;i++) {
+      memcpy(e, buf + i * 32, 11);
+      match |= ((e[0] == n[0]) && (e[1] == n[1]) && (e[2] == n[2])) << i;
+    }
+  }
+  return match;
+}
+#endif
+
+/*
+ * fat_dir_scan - the first entry of a directory sector that is either the end of directory
+ *                marker or has the given 11 byte name, 16 if there isn't one.  The caller
+ *                checks the first byte of the entry to tell which it was.
+ */
+int fat_dir_scan(const uint8_t *buf, const char *name) {
+  uint16_t end;
+  uint16_t deleted;
+  uint16_t m;
+  
+  m = fat_dir_mask(buf, name, &end, &deleted) | end;
+  return m ? __builtin_ctz(m) : 16;
+}
+
+/*
+ * fat_dirent_cluster - first cluster of a directory entry, an entry pointing at cluster 0 (the
+ *                      .. entry of a directory in the root) means the root directory.
+ */
+uint32_t fat_dirent_cluster(direntS *de) {
+  uint32_t cluster;
+  
+  if(FAT_TYPE == PART_TYPE_FAT16) {
+    cluster = de->first_cluster;
+  } else {
+    cluster = de->first_cluster + (de->high_first_cluster << 16);
+  }
+  if(cluster == 0) {
+    cluster = FAT_ROOT_CLUSTER;
+  }
+  return cluster;
+}
+
+/*
+ * Directory entry cache
+ * 
+ * A small LRU list of names already looked up by fat_lookup_path(), keyed by the cluster of the
+ * directory they're in.  Directories on the way down a path are resolved from their cached first
+ * cluster without reading the disc, the entry at the end of the path is read straight from its
+ * cached sector instead of scanning the directory.  Names found not to exist are cached too
+ * (entry_sector 0) so repeatedly testing for a file before creating it is cheap.  Anything that
+ * adds or removes directory entries must keep the cache up to date with the functions below.
+ */
+void fat_dcache_clear() {
+  int i;
+  
+  for(i=0;i<GRISTLE_DCACHE_SIZE;i++) {
+    dcache[i].last_used = 0;
+  }
+}
+
+dcacheS *fat_dcache_find(uint32_t parent_cluster, const char *name) {
+  int i;
+  
+  for(i=0;i<GRISTLE_DCACHE_SIZE;i++) {
+    if((dcache[i].last_used) && (dcache[i].parent_cluster == parent_cluster) &&
+       (memcmp(dcache[i].name, name, 11) == 0)) {
+      dcache[i].last_used = ++dcache_clock;
+      return &dcache[i];
+    }
+  }
+  return NULL;
+}
+
+/* fat_dcache_add - caches a name, replacing any entry for it or else the least recently used */
+void fat_dcache_add(uint32_t parent_cluster, const char *name, uint32_t entry_sector,
+                    uint8_t entry_number, uint32_t first_cluster, uint8_t attributes) {
+  int i;
+  dcacheS *dc;
+  
+  if(GRISTLE_DCACHE_SIZE == 0) {
+    return;
+  }
+  if((dc = fat_dcache_find(parent_cluster, name)) == NULL) {
+    dc = &dcache[0];
+    for(i=1;i<GRISTLE_DCACHE_SIZE;i++) {
+      if(dcache[i].last_used < dc->last_used) {
+        dc = &dcache[i];
+      }
+    }
+  }
+  dc->parent_cluster = parent_cluster;
+  memcpy(dc->name, name, 11);
+  dc->entry_sector = entry_sector;
+  dc->entry_number = entry_number;
+  dc->first_cluster = first_cluster;
+  dc->attributes = attributes;
+  dc->last_used = ++dcache_clock;
+}
+
+/* fat_dcache_drop - forgets a name, call when an entry is deleted or created */
+void fat_dcache_drop(uint32_t parent_cluster, const char *name) {
+  dcacheS *dc;
+  
+  if((dc = fat_dcache_find(parent_cluster, name))) {
+    dc->last_used = 0;
+  }
+}
+
+/*
+ * fat_dcache_drop_dir - forgets every name in a directory, call when a directory is removed or a
+ *                       cluster is made into a new directory so nothing cached under that cluster
+ *                       number survives.
+ */
+void fat_dcache_drop_dir(uint32_t cluster) {
+  int i;
+  
+  for(i=0;i<GRISTLE_DCACHE_SIZE;i++) {
+    if(dcache[i].parent_cluster == cluster) {
+      dcache[i].last_used = 0;
+    }
+  }
+}
+
+/*
+ * Directory free slot hints
+ * 
+ * For each of the most recently used directories where the search for a free entry can start,
+ * so a new entry doesn't mean reading the directory from the start every time.  No entry before
+ * the hint is free, creating an entry moves the hint on past it and deleting one before it moves
+ * it back (or drops it, if the two can't be put in order).
+ */
+void fat_dir_hint_clear() {
+  int i;
+  
+  for(i=0;i<GRISTLE_DIR_HINTS;i++) {
+    dir_hint[i].last_used = 0;
+  }
+}
+
+dirhintS *fat_dir_hint_find(uint32_t cluster) {
+  int i;
+  
+  for(i=0;i<GRISTLE_DIR_HINTS;i++) {
+    if((dir_hint[i].last_used) && (dir_hint[i].cluster == cluster)) {
+      dir_hint[i].last_used = ++dir_hint_clock;
+      return &dir_hint[i];
+    }
+  }
+  return NULL;
+}
+
+/* fat_dir_hint_set - records that the next free entry in a directory is at or after entry of the
+ *                    sector the fd is on */
+void fat_dir_hint_set(uint32_t cluster, int fd, uint8_t entry) {
+  int i;
+  dirhintS *h;
+  
+  if(GRISTLE_DIR_HINTS == 0) {
+    return;
+  }
+  if((h = fat_dir_hint_find(cluster)) == NULL) {
+    h = &dir_hint[0];
+    for(i=1;i<GRISTLE_DIR_HINTS;i++) {
+      if(dir_hint[i].last_used < h->last_used) {
+        h = &dir_hint[i];
+      }
+    }
+  }
+  h->cluster = cluster;
+  h->sector = file_num[fd].sector;
+  h->sector_cluster = file_num[fd].cluster;
+  h->sectors_left = file_num[fd].sectors_left;
+  h->entry = entry;
+  h->last_used = ++dir_hint_clock;
+}
+
+/* fat_dir_hint_freed - an entry has been deleted, the hint mustn't be after it */
+void fat_dir_hint_freed(uint32_t cluster, uint32_t sector, uint8_t entry) {
+  dirhintS *h;
+  
+  if((h = fat_dir_hint_find(cluster))) {
+    if(h->sector != sector) {
+      h->last_used = 0;
+    } else if(entry < h->entry) {
+      h->entry = entry;
+    }
+  }
+}
+
+/* fat_dir_hint_drop - forgets the hint for a directory that's been removed */
+void fat_dir_hint_drop(uint32_t cluster) {
+  dirhintS *h;
+  
+  if((h = fat_dir_hint_find(cluster))) {
+    h->last_used = 0;
+  }
+}
+
+/*
+ * fat_dir_extend - adds a cluster of zeros onto the end of a directory's chain after cluster last.
+ *                  The cluster is cleared before it's linked in so the directory never has junk
+ *                  entries.  Returns the new cluster, 0 if the disc is full or 0xFFFFFFFF on error.
+ */
+uint32_t fat_dir_extend(uint32_t last) {
+  blockno_t current_block = MAX_BLOCK;
+  int dirty = 0;
+  uint32_t c;
+  uint8_t *e;
+  
+  c = fat_alloc_chain(0, 1);
+  if((c == 0) || (c == 0xFFFFFFFF)) {
+    return c;
+  }
+  if(fat_zero_range(FAT_CLUSTER_SECTOR(c), fatfs.sectors_per_cluster)) {
+    fat_free_clusters(c);
+    return 0xFFFFFFFF;
+  }
+  if(!GRISTLE_SYSLOCK) {
+    fat_free_clusters(c);
+    return 0xFFFFFFFF;
+  }
+  if((e = fat_fat_entry(last, &current_block, &dirty)) == NULL) {
+    GRISTLE_SYSUNLOCK;
+    fat_free_clusters(c);
+    return 0xFFFFFFFF;
+  }
+  fat_set_entry_value(e, c);
+  if(fat_write_fat_sector(current_block, fatfs.sysbuf)) {
+    GRISTLE_SYSUNLOCK;
+    fat_free_clusters(c);
+    return 0xFFFFFFFF;
+  }
+  GRISTLE_SYSUNLOCK;
+  return c;
+}
+
+/*
+ * fat_dir_free_slot - finds a free or deleted entry in the directory starting at cluster dir.
+ * 
+ * The search starts from the directory's hint if it has one.  A full directory gets a new zeroed
+ * cluster, except the fixed size FAT16 root.  The fd is used to walk the directory and is left
+ * on the sector with the free entry, loaded into its buffer.  It mustn't be open for writing or
+ * running off the end would extend the directory as if it was the file.  The caller should write
+ * the entry and then move the hint on with fat_dir_hint_set().  Returns the entry number within
+ * the sector or -1 on error.
+ */
+int fat_dir_free_slot(int fd, uint32_t dir, int *rerrno) {
+  dirhintS *h;
+  uint32_t c;
+  uint16_t end;
+  uint16_t deleted;
+  uint16_t free_entries;
+  int i;
+  
+  (*rerrno) = EIO;
+  if((h = fat_dir_hint_find(dir))) {
+    file_num[fd].sector = h->sector;
+    file_num[fd].cluster = h->sector_cluster;
+    file_num[fd].sectors_left = h->sectors_left;
+    file_num[fd].cursor = 0;
+    i = h->entry;
+    if((i < 16) && (block_read(file_num[fd].sector, file_num[fd].buffer))) {
+      i = -1;
+    }
+  } else {
+    i = fat_select_cluster(fd, dir) ? -1 : 0;
+  }
+  while(i >= 0) {
+    if(i < 16) {
+      fat_dir_mask(file_num[fd].buffer, NULL, &end, &deleted);
+      // only the entries from i on are wanted
+      free_entries = (end | deleted) >> i << i;
+      if(free_entries) {
+        i = __builtin_ctz(free_entries);
+        break;
+      }
+    }
+    file_num[fd].error = 0;
+    if(fat_next_sector(fd) == 0) {
+      i = 0;
+    } else if(file_num[fd].error != FAT_END_OF_FILE) {
+      i = -1;
+    } else if(FAT_FIXED_ROOT(file_num[fd].cluster)) {
+      // the FAT16 root directory can't grow
+      (*rerrno) = ENOSPC;
+      i = -1;
+    } else {
+      // the directory is full, add a cluster to it
+      c = fat_dir_extend(file_num[fd].cluster);
+      if((c == 0) || (c == 0xFFFFFFFF)) {
+        (*rerrno) = (c == 0) ? ENOSPC : EIO;
+        i = -1;
+      } else {
+        fat_set_cluster(fd, c);
+        memset(file_num[fd].buffer, 0, 512);
+        i = 0;
+      }
+    }
+  }
+  if(i >= 0) {
+    (*rerrno) = 0;
+  }
+  return i;
+}
+
+/*
+ * Directory index
+ * 
+ * Optional hash tables of all the entries in the most recently used large directories, built
+ * the first time fat_lookup_path() has to search a directory and kept up to date as entries are
+ * added and deleted.  A lookup reads only the sector(s) whose entries hash the same as the
+ * name, and building the index sets the directory's free slot hint.  A directory with more
+ * entries than fit is marked full and searched the old way.
+ */
+#if GRISTLE_DIR_INDEX_DIRS > 0
+dirindexS dir_index[GRISTLE_DIR_INDEX_DIRS];
+uint32_t dir_index_clock;
+
+uint16_t fat_dir_index_hash(const char *name) {
+  int i;
+  uint32_t h = 2166136261u;
+  
+  for(i=0;i<11;i++) {
+    h = (h ^ (uint8_t)name[i]) * 16777619u;
+  }
+  h = (h >> 16) ^ (h & 0xffff);
+  if(h == 0) {
+    h = 1;
+  }
+  return h;
+}
+
+void fat_dir_index_insert(dirindexS *idx, const char *name, uint32_t sector, uint8_t entry) {
+  uint16_t h;
+  uint32_t i;
+  
+  if(idx->full) {
+    return;
+  }
+  if(idx->used >= GRISTLE_DIR_INDEX_SIZE / 4 * 3) {
+    idx->full = 1;
+    return;
+  }
+  h = fat_dir_index_hash(name);
+  i = h & (GRISTLE_DIR_INDEX_SIZE - 1);
+  while(idx->slots[i].hash) {
+    i = (i + 1) & (GRISTLE_DIR_INDEX_SIZE - 1);
+  }
+  idx->slots[i].hash = h;
+  idx->slots[i].entry_number = entry;
+  idx->slots[i].entry_sector = sector;
+  idx->used++;
+}
+
+/* fat_dir_index_find - the index for a directory if there is one, NULL if not */
+dirindexS *fat_dir_index_find(uint32_t cluster) {
+  int i;
+  
+  for(i=0;i<GRISTLE_DIR_INDEX_DIRS;i++) {
+    if(dir_index[i].cluster == cluster) {
+      dir_index[i].last_used = ++dir_index_clock;
+      return &dir_index[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * fat_dir_index_get - returns the index for a directory, reading the whole directory with the
+ *                     given fd to build it if there isn't one.  Returns NULL if the directory
+ *                     can't be indexed, the fd no longer points into the directory after a build.
+ */
+dirindexS *fat_dir_index_get(int fd, uint32_t cluster) {
+  dirindexS *idx;
+  uint8_t *e;
+  int hinted;
+  int i;
+  
+  if((idx = fat_dir_index_find(cluster)) == NULL) {
+    idx = &dir_index[0];
+    for(i=1;i<GRISTLE_DIR_INDEX_DIRS;i++) {
+      if(dir_index[i].last_used < idx->last_used) {
+        idx = &dir_index[i];
+      }
+    }
+    idx->cluster = 0;
+    memset(idx->slots, 0, sizeof(idx->slots));
+    idx->used = 0;
+    idx->full = 0;
+    hinted = 0;
+    if(fat_select_cluster(fd, cluster)) {
+      return NULL;
+    }
+    while(1) {
+      for(i=0;i<16;i++) {
+        e = file_num[fd].buffer + i * 32;
+        if((!hinted) && ((e[0] == 0) || (e[0] == 0xe5))) {
+          // the whole directory is being read anyway so note where the first free entry is
+          fat_dir_hint_set(cluster, fd, i);
+          hinted = 1;
+        }
+        if(e[0] == 0) {
+          break;
+        }
+        if(e[0] != 0xe5) {
+          fat_dir_index_insert(idx, (char *)e, file_num[fd].sector, i);
+        }
+      }
+      if(i < 16) {
+        break;
+      }
+      if(fat_next_sector(fd) != 0) {
+        break;
+      }
+    }
+    idx->cluster = cluster;
+    idx->last_used = ++dir_index_clock;
+  }
+  if(idx->full) {
+    return NULL;
+  }
+  return idx;
+}
+
+/*
+ * fat_dir_index_lookup - searches an index for a name, leaving its sector in the fd's buffer.
+ *                        Returns the entry number, -1 if the name isn't in the directory or -2 on
+ *                        a read error.
+ */
+int fat_dir_index_lookup(int fd, dirindexS *idx, const char *name) {
+  uint16_t h;
+  uint32_t i;
+  
+  h = fat_dir_index_hash(name);
+  i = h & (GRISTLE_DIR_INDEX_SIZE - 1);
+  file_num[fd].sector = 0;
+  while(idx->slots[i].hash) {
+    if((idx->slots[i].hash == h) && (idx->slots[i].entry_sector)) {
+      if(file_num[fd].sector != idx->slots[i].entry_sector) {
+        file_num[fd].sector = idx->slots[i].entry_sector;
+        if(block_read(file_num[fd].sector, file_num[fd].buffer)) {
+          return -2;
+        }
+      }
+      if(strncmp(name, (char *)(file_num[fd].buffer + idx->slots[i].entry_number * 32), 11) == 0) {
+        return idx->slots[i].entry_number;
+      }
+    }
+    i = (i + 1) & (GRISTLE_DIR_INDEX_SIZE - 1);
+  }
+  return -1;
+}
+
+/* fat_dir_index_remove - forgets a deleted entry, the slot is kept so later names still probe past it */
+void fat_dir_index_remove(uint32_t cluster, const char *name, uint32_t sector, uint8_t entry) {
+  dirindexS *idx;
+  uint16_t h;
+  uint32_t i;
+  
+  if(((idx = fat_dir_index_find(cluster)) == NULL) || (idx->full)) {
+    return;
+  }
+  h = fat_dir_index_hash(name);
+  i = h & (GRISTLE_DIR_INDEX_SIZE - 1);
+  while(idx->slots[i].hash) {
+    if((idx->slots[i].entry_sector == sector) && (idx->slots[i].entry_number == entry)) {
+      idx->slots[i].entry_sector = 0;
+      return;
+    }
+    i = (i + 1) & (GRISTLE_DIR_INDEX_SIZE - 1);
+  }
+}
+
+/* fat_dir_index_drop - throws away the index of a directory that's been removed or changed */
+void fat_dir_index_drop(uint32_t cluster) {
+  dirindexS *idx;
+  
+  if((idx = fat_dir_index_find(cluster))) {
+    idx->cluster = 0;
+    idx->last_used = 0;
+  }
+}
+
+void fat_dir_index_clear() {
+  int i;
+  
+  for(i=0;i<GRISTLE_DIR_INDEX_DIRS;i++) {
+    dir_index[i].cluster = 0;
+    dir_index[i].last_used = 0;
+  }
+}
+#else
+dirindexS *fat_dir_index_find(uint32_t cluster __attribute__((__unused__))) {
+  return NULL;
+}
+
+dirindexS *fat_dir_index_get(int fd __attribute__((__unused__)),
+                             uint32_t cluster __attribute__((__unused__))) {
+  return NULL;
+}
+
+int fat_dir_index_lookup(int fd __attribute__((__unused__)),
+                         dirindexS *idx __attribute__((__unused__)),
+                         const char *name __attribute__((__unused__))) {
+  return -1;
+}
+
+void fat_dir_index_insert(dirindexS *idx __attribute__((__unused__)),
+                          const char *name __attribute__((__unused__)),
+                          uint32_t sector __attribute__((__unused__)),
+                          uint8_t entry __attribute__((__unused__))) {
+}
+
+void fat_dir_index_remove(uint32_t cluster __attribute__((__unused__)),
+                          const char *name __attribute__((__unused__)),
+                          uint32_t sector __attribute__((__unused__)),
+                          uint8_t entry __attribute__((__unused__))) {
+}
+
+void fat_dir_index_drop(uint32_t cluster __attribute__((__unused__))) {
+}
+
+void fat_dir_index_clear() {
+}
+#endif
+
+/* Function to save file meta-info, (size modified date etc.) */
+int fat_flush_fileinfo_locked(int fd, int *rerrno) {
+#ifdef GRISTLE_RO
+    (void)fd;
+    (*rerrno) = 0;
+#else
+  direntS de;
+  dirindexS *idx;
+  int i;
+  uint32_t temp_sectors_left;
+  uint32_t temp_file_sector;
+  uint32_t temp_cluster;
+  uint32_t temp_sector;
+  uint32_t temp_cursor;
+  uint8_t temp_error;
+#ifdef TRACE
+  printf("fat_flush_fileinfo(%d)\n", fd);
+#endif
+  (*rerrno) = 0;
+  
+  if(file_num[fd].full_first_cluster == FAT_ROOT_CLUSTER) {
+    // do nothing to try and update meta info on the root directory
+    return 0;
+  }
+  // non existent file opened for reading, don't update a-time or you'll create an empty file!
+  if((file_num[fd].entry_sector == 0) && (!(file_num[fd].flags & FAT_FLAG_WRITE))) {
+    return 0;
+  }
+  // a new file that's never been given any clusters, an existing entry emptied by O_TRUNC or
+  // fat_close() still has to be written back
+  if((file_num[fd].full_first_cluster == 0) && (file_num[fd].entry_sector == 0)) {
+//     printf("Bad first cluster!\r\n");
+//     printf("  %s\r\n", file_num[fd].filename);
+    return 0;
+  }
+  memcpy(de.filename, file_num[fd].filename, 8);
+  memcpy(de.extension, file_num[fd].extension, 3);
+  de.attributes = file_num[fd].attributes;
+  /* fine resolution = 10ms, only using unix time stamp so save
+   * the unit second, create_time only saves in 2s resolution */
+  de.create_time_fine = (file_num[fd].created & 1) * 100;
+  de.create_time = fat_from_unix_time(file_num[fd].created);
+  de.create_date = fat_from_unix_date(file_num[fd].created);
+  de.access_date = fat_from_unix_date(file_num[fd].accessed);
+  de.high_first_cluster = file_num[fd].full_first_cluster >> 16;
+  de.modified_time = fat_from_unix_time(file_num[fd].modified);
+  de.modified_date = fat_from_unix_date(file_num[fd].modified);
+  de.first_cluster = file_num[fd].full_first_cluster & 0xffff;
+  de.size = file_num[fd].size;
+  
+  /* make sure the buffer has no changes in it and the data is on the disc before the size */
+  if((fat_flush(fd)) || (fat_window_flush(fd))) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+  if(file_num[fd].entry_sector == 0) {
+    /* this is a new file that's never been written to disc */
+    // save the tracking info for this file, we'll need to seek through the parent with
+    // this file descriptor
+    temp_sectors_left = file_num[fd].sectors_left;
+    temp_file_sector = file_num[fd].file_sector;
+    temp_cursor = file_num[fd].cursor;
+    temp_sector = file_num[fd].sector;
+    temp_cluster = file_num[fd].cluster;
+    temp_error = file_num[fd].error;
+    // the parent is walked read only, a full directory is extended by fat_dir_free_slot()
+    file_num[fd].flags &= ~FAT_FLAG_WRITE;
+    
+    // the index is built (if there is one) before the directory is walked to find a free entry
+    idx = fat_dir_index_get(fd, file_num[fd].parent_cluster);
+    i = fat_dir_free_slot(fd, file_num[fd].parent_cluster, rerrno);
+    file_num[fd].flags |= FAT_FLAG_WRITE;
+    if(i < 0) {
+      file_num[fd].sectors_left = temp_sectors_left;
+      file_num[fd].file_sector = temp_file_sector;
+      file_num[fd].cursor = temp_cursor;
+      file_num[fd].sector = temp_sector;
+      file_num[fd].cluster = temp_cluster;
+      file_num[fd].error = temp_error;
+      return -1;
+    }
+    
+    // save the entry_sector and entry_number
+    file_num[fd].entry_sector = file_num[fd].sector;
+    file_num[fd].entry_number = i;
+    if(idx) {
+      fat_dir_index_insert(idx, (char *)de.filename, file_num[fd].sector, i);
+    }
+    fat_dir_hint_set(file_num[fd].parent_cluster, fd, i + 1);
+    fat_dcache_add(file_num[fd].parent_cluster, (char *)de.filename, file_num[fd].entry_sector,
+                   i, file_num[fd].full_first_cluster, file_num[fd].attributes);
+    
+    // restore the file tracking info
+    file_num[fd].sectors_left = temp_sectors_left;
+    file_num[fd].file_sector = temp_file_sector;
+    file_num[fd].cursor = temp_cursor;
+    file_num[fd].sector = temp_sector;
+    file_num[fd].cluster = temp_cluster;
+    file_num[fd].error = temp_error;
+  } else {
+    /* read the directory entry for this file */
+    if(block_read(file_num[fd].entry_sector, file_num[fd].buffer)) {
+      (*rerrno) = EIO;
+      return -1;
+    }
+  }
+  /* copy the new entry over the old */
+  memcpy(&file_num[fd].buffer[file_num[fd].entry_number * 32], &de, 32);
+  /* write the modified directory entry back to disc */
+  if(block_write(file_num[fd].entry_sector, file_num[fd].buffer)) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+  /* fetch the sector that was expected back into the buffer */
+  if(block_read(file_num[fd].sector, file_num[fd].buffer)) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+#endif
+  /* mark the filesystem as consistent now */
+  file_num[fd].flags &= ~FAT_FLAG_FS_DIRTY;
+  file_num[fd].clusters_added = 0;
+  file_num[fd].info_flushed = GRISTLE_TIME;
+  return 0;
+}
+
+int fat_flush_fileinfo(int fd, int *rerrno) {
+  int r;
+  
+  GRISTLE_META_WRLOCK;
+  r = fat_flush_fileinfo_locked(fd, rerrno);
+  GRISTLE_META_UNLOCK;
+  return r;
+}
+
+/*
+ * fat_lookup_path - finds the directory entry for path and loads its details into the fd.
+ * 
+ * Stops at the entry, the caller selects the first cluster if it needs the file's data.  The
+ * root directory has no entry so it comes back with an entry_sector of 0.
+ */
+int fat_lookup_path(int fd, const char *path, int *rerrno) {
+  char dosname[12];
+  char dosname2[13];
+  char isdir;
+  char found;
+  dcacheS *dc;
+  dirindexS *idx;
+  int i;
+  int path_pointer = 0;
+  direntS *de;
+  char local_path[100];
+  char *elements[20];
+  int levels = 0;
+  int depth = 0;
+  
+//   printf("fat_lookup_path(%d, %s)\r\n", fd, path);
+  /* Make sure the file system has all changes flushed before searching it */
+//   for(i=0;i<MAX_OPEN_FILES;i++) {
+//     if(file_num[i].flags & FAT_FLAG_FS_DIRTY) {
+//       fat_flush_fileinfo(i);
+//     }
+//   }
+
+  if(strlen(path) > (sizeof(local_path) - 1)) {
+    *rerrno = ENAMETOOLONG;
+    return -1;
+  }
+//   if(path[0] != '/') {
+//     (*rerrno) = ENAMETOOLONG;
+//     return -1;                                /* bad path, we have no cwd */
+//   }
+  strcpy(local_path, path);
+  
+  if((elements[levels] = strtok(local_path, "/"))) {
+    while(++levels < 20) {
+      if(!(elements[levels] = strtok(NULL, "/"))) {
+        break;
+      }
+    }
+  }
+  
+//   printf("\tSPLIT PATH:\n");
+//   for(i=0;i<levels;i++) {
+//     printf("\t%s\n", elements[i]);
+//   }
+//   printf("\t--------------\n");
+  /* select root directory */
+  file_num[fd].num_extents = 0;
+
+  path_pointer++;
+
+  if(levels == 0) {
+    /* user selected the root directory to open. */
+    file_num[fd].full_first_cluster = FAT_ROOT_CLUSTER;
+    file_num[fd].entry_sector = 0;
+    file_num[fd].entry_number = 0;
+    file_num[fd].file_sector = 0;
+    file_num[fd].attributes = FAT_ATT_SUBDIR;
+    file_num[fd].size = 0;
+    file_num[fd].accessed = 0;
+    file_num[fd].modified = 0;
+    file_num[fd].created = 0;
+    return 0;
+  }
+
+  file_num[fd].parent_cluster = FAT_ROOT_CLUSTER;
+  while(1) {
+    if(depth > levels) {
+//       printf("Serious filesystem error\r\n");
+      *rerrno = EIO;
+      return -1;
+    }
+//     if((r = str_to_fatname(&path[path_pointer], dosname)) < 0) {
+//     if(make_dos_name(dosname, path, &path_pointer)) {
+//     printf("depth = %d, levels = %d\n", depth, levels);
+    if(str_to_fatname(elements[depth], dosname2)) {
+//       printf("didn't make a dos name :(\n");
+//       printf("Path: %s\n", path);
+      (*rerrno) = EIO; // can't be ENOENT or the driver may decide to create it if open for writing
+      return -1;  /* invalid path name */
+    }
+    path_pointer = 0;
+    if(make_dos_name(dosname, dosname2, &path_pointer)) {
+//       printf("step 2 dosname failure.\n");
+      *rerrno = EIO;
+      return -1;
+    }
+//     path_pointer += r;
+//     printf("\"%s\" depth=%d, levels=%d\r\n", dosname, depth, levels);
+    depth ++;
+    found = 0;
+    dc = fat_dcache_find(file_num[fd].parent_cluster, dosname);
+    if(dc) {
+      if(dc->entry_sector == 0) {
+        /* looked for before and it wasn't there */
+        memcpy(file_num[fd].filename, dosname, 8);
+        memcpy(file_num[fd].extension, dosname+8, 3);
+        if(depth < levels) {
+          *rerrno = GRISTLE_BAD_PATH;
+        } else {
+          *rerrno = ENOENT;
+        }
+        return -1;
+      }
+      if(depth < levels) {
+        /* a directory on the way, only its cluster is needed */
+        if(!(dc->attributes & FAT_ATT_SUBDIR)) {
+          (*rerrno) = ENOTDIR;
+          return -1;
+        }
+        file_num[fd].parent_cluster = dc->first_cluster;
+        continue;
+      }
+      /* the end of the path, its entry is read to get the current size and times */
+      if(block_read(dc->entry_sector, file_num[fd].buffer)) {
+        *rerrno = EIO;
+        return -1;
+      }
+      i = dc->entry_number;
+      if(strncmp(dosname, (char *)(file_num[fd].buffer + (i * 32)), 11) == 0) {
+        file_num[fd].sector = dc->entry_sector;
+        found = 1;
+      } else {
+        // shouldn't happen, but don't trust the cache if the entry has moved
+        fat_dcache_drop(file_num[fd].parent_cluster, dosname);
+      }
+    }
+    if(!found) {
+      if((idx = fat_dir_index_get(fd, file_num[fd].parent_cluster))) {
+        i = fat_dir_index_lookup(fd, idx, dosname);
+        if(i == -2) {
+          *rerrno = EIO;
+          return -1;
+        }
+        found = (i >= 0);
+      } else {
+        fat_select_cluster(fd, file_num[fd].parent_cluster);
+        while(1) {
+//         printf("looping [s:%d/%d c:%d]\r\n", file_num[fd].sectors_left, fatfs.sectors_per_cluster, file_num[fd].cluster);
+          i = fat_dir_scan(file_num[fd].buffer, dosname);
+          if((i < 16) && (file_num[fd].buffer[i * 32] != 0)) {
+            found = 1;
+          }
+          if(i == 16) {
+            if(fat_next_sector(fd) != 0) {
+              break;
+            }
+          } else {
+            break;
+          }
+        }
+      }
+      if(!found) {
+        fat_dcache_add(file_num[fd].parent_cluster, dosname, 0, 0, 0, 0);
+        memcpy(file_num[fd].filename, dosname, 8);
+        memcpy(file_num[fd].extension, dosname+8, 3);
+        if(depth < levels) {
+          (*rerrno) = GRISTLE_BAD_PATH;
+        } else {
+          (*rerrno) = ENOENT;
+        }
+        return -1;
+      }
+      de = (direntS *)(file_num[fd].buffer + (i * 32));
+      fat_dcache_add(file_num[fd].parent_cluster, dosname, file_num[fd].sector, i,
+                     fat_dirent_cluster(de), de->attributes);
+    }
+//     printf("got here %d\r\n", i);
+    de = (direntS *)(file_num[fd].buffer + (i * 32));
+//     iprintf("%s\r\n", de->filename);
+    isdir = de->attributes & 0x10;
+    /* if dir, and there are more path elements, select */
+    if(isdir && (depth < levels)) {
+//       depth++;
+      file_num[fd].parent_cluster = fat_dirent_cluster(de);
+    } else if((depth < levels)) {
+      /* path end not reached but this is not a directory */
+      (*rerrno) = ENOTDIR;
+      return -1;
+    } else {
+      /* otherwise, setup the fd */
+      file_num[fd].error = 0;
+      file_num[fd].flags = FAT_FLAG_OPEN;
+      memcpy(file_num[fd].filename, de->filename, 8);
+      memcpy(file_num[fd].extension, de->extension, 3);
+      file_num[fd].attributes = de->attributes;
+      file_num[fd].size = de->size;
+      /* this special case occurs when a subdirectory's .. entry is opened. */
+      file_num[fd].full_first_cluster = fat_dirent_cluster(de);
+
+      file_num[fd].entry_sector = file_num[fd].sector;
+      file_num[fd].entry_number = i;
+      file_num[fd].file_sector = 0;
+      
+      file_num[fd].created = fat_to_unix_date(de->create_date) + fat_to_unix_time(de->create_time) + de->create_time_fine / 100;
+      file_num[fd].modified = fat_to_unix_date(de->modified_date) + fat_to_unix_time(de->modified_time);
+      file_num[fd].accessed = fat_to_unix_date(de->access_date);
+      break;
+    }
+  }
+
+  return 0;
+}
+
+#ifndef GRISTLE_FAT32_ONLY
+int fat_mount_fat16(blockno_t start, blockno_t volume_size) {
+  blockno_t i;
+  boot_sector_fat16 *boot16;
+  
+  if(GRISTLE_SYSLOCK) {
+    fatfs.read_only = block_get_device_read_only();
+    block_read(start, fatfs.sysbuf);
+    
+    boot16 = (boot_sector_fat16 *)fatfs.sysbuf;
+    // now validate all fields and reject the block device if anything fails
+    
+    // could check the volume name is all printable characters
+    
+    // we can only handle sector size equal to the disk block size
+    // for now at least.
+    if(!(boot16->sector_size == 512)) {
+#ifdef FAT_DEBUG
+      printf("Sector size not 512 bytes.\r\n");
+#endif
+      GRISTLE_SYSUNLOCK;
+      return -1;
+    }
+    
+    // cluster size is a number of sectors per cluster.  Must be a
+    // power of two in 8 bits (i.e. 1, 2, 4, 8, 16, 32, 64 or 128)
+    for(i=0;i<8;i++) {
+      if(boot16->cluster_size == (1 << i)) {
+        break;
+      }
+    }
+    if(i == 8) {
+#ifdef FAT_DEBUG
+      printf("Cluster size not power of two.\r\n");
+#endif
+      GRISTLE_SYSUNLOCK;
+      return -1;
+    }
+    
+    // number of reserved sectors must be at least 1, can't be
+    // the size of the partition.
+    if((boot16->reserved_sectors < 1) || (boot16->reserved_sectors >= volume_size)) {
+#ifdef FAT_DEBUG
+      printf("Reserved sector count was not valid: %d\r\n", boot16->reserved_sectors);
+#endif
+      GRISTLE_SYSUNLOCK;
+      return -1;
+    }
+    
+    // number of fats, normally two but must be between 1 and 15
+    if((boot16->num_fats < 1) || (boot16->num_fats >= 15)) {
+#ifdef FAT_DEBUG
+      printf("Invalid number of FATs: %d\r\n", boot16->num_fats);
+#endif
+      GRISTLE_SYSUNLOCK;
+      return -1;
+    }
+    
+    // number of root directory entries
+    if((boot16->root_entries == 0)) {
+#ifdef FAT_DEBUG
+      printf("No root directory entries, looks like a FAT32 partition.\r\n");
+#endif
+      GRISTLE_SYSUNLOCK;
+      return -1;
+    }
+    
+    // number of root directory entries must be an integer multiple of the sector size
+    if((boot16->root_entries) & ((boot16->sector_size / 32) - 1)) {
+#ifdef FAT_DEBUG
+      printf("Root directory will not be an integer number of sectors.\r\n");
+#endif
+      GRISTLE_SYSUNLOCK;
+      return -1;
+    }
+    
+    // total logical sectors (if less than 65535)
+    if(boot16->total_sectors == 0) {
+      if(boot16->big_total_sectors > volume_size) {
+#ifdef FAT_DEBUG
+        printf("Total sectors is larger than the volume.\r\n");
+#endif
+        GRISTLE_SYSUNLOCK;
+        return -1;
+      }
+    } else {
+      if(boot16->total_sectors > volume_size) {
+#ifdef FAT_DEBUG
+        printf("Total sectors is larger than the volume.\r\n");
+#endif
+        GRISTLE_SYSUNLOCK;
+        return -1;
+      }
+    }
+    
+    fatfs.sectors_per_cluster = boot16->cluster_size;
+    fatfs.cluster_shift = __builtin_ctz(boot16->cluster_size);  // checked to be a power of two
+    fatfs.root_len = (boot16->root_entries * 32) / 512;
+    i = start;
+    i += boot16->reserved_sectors;
+    fatfs.active_fat_start = i;
+    fatfs.sectors_per_fat = boot16->sectors_per_fat;
+    i += (boot16->sectors_per_fat * boot16->num_fats);
+    fatfs.root_start = i;
+    i += (boot16->root_entries * 32) / 512;
+    i -= (boot16->cluster_size * 2);
+    fatfs.cluster0 = i;
+    
+    // check the calculated values are within the volume 
+    if(fatfs.root_start > (start + volume_size)) {
+#ifdef FAT_DEBUG
+      printf("Root start is beyond the end of the volume.\r\n");
+#endif
+      GRISTLE_SYSUNLOCK;
+      return -1;
+    }
+    
+    if(boot16->total_sectors == 0) {
+      fatfs.total_sectors = boot16->big_total_sectors;
+    } else {
+      fatfs.total_sectors = boot16->total_sectors;
+    }
+    
+    // validated a FAT16 volume boot record, setup the FAT16 abstraction values
+    fatfs.type = PART_TYPE_FAT16;
+    fatfs.fat_entry_len = 2;
+    fatfs.end_cluster_marker = 0xFFF0;
+    fatfs.part_start = start;
+    fatfs.max_cluster = (start + fatfs.total_sectors - fatfs.cluster0) / fatfs.sectors_per_cluster - 1;
+    if(fatfs.max_cluster > (fatfs.sectors_per_fat * 512 / 2) - 1) {
+      fatfs.max_cluster = (fatfs.sectors_per_fat * 512 / 2) - 1;
+    }
+    fatfs.root_cluster = 1;
+    fatfs.num_fats = boot16->num_fats;
+    fatfs.fat_dirty_first = FAT_NO_DIRTY;
+    fatfs.fat_dirty_last = FAT_NO_DIRTY;
+
+  } else {
+    return -1;
+  }
+  GRISTLE_SYSUNLOCK;
+  return 0;
+}
+
+#endif
+
+#ifndef GRISTLE_FAT16_ONLY
+int fat_mount_fat32(blockno_t start, blockno_t volume_size) {
+  blockno_t i;
+  boot_sector_fat32 *boot32;
+  
+  if(GRISTLE_SYSLOCK) {
+    
+    fatfs.read_only = block_get_device_read_only();
+    block_read(start, fatfs.sysbuf);
+    
+    boot32 = (boot_sector_fat32 *)fatfs.sysbuf;
+    // now validate all fields and reject the block device if anything fails
+    
+    // could check the volume name is all printable characters
+    
+    // we can only handle sector size equal to the disk block size
+    // for now at least.
+    if(!(boot32->sector_size == 512)) {
+  #ifdef FAT_DEBUG
+      printf("Sector size not 512 bytes.\r\n");
+  #endif
+      GRISTLE_SYSUNLOCK;
+      return -1;
+    }
+    
+    // cluster size is a number of sectors per cluster.  Must be a
+    // power of two in 8 bits (i.e. 1, 2, 4, 8, 16, 32, 64 or 128)
+    for(i=0;i<8;i++) {
+      if(boot32->cluster_size == (1 << i)) {
+        break;
+      }
+    }
+    if(i == 8) {
+  #ifdef FAT_DEBUG
+      printf("Cluster size not power of two.\r\n");
+  #endif
+      GRISTLE_SYSUNLOCK;
+      return -1;
+    }
+    
+    // number of reserved sectors must be at least 1, can't be
+    // the size of the partition.
+    if((boot32->reserved_sectors < 1) || (boot32->reserved_sectors >= volume_size)) {
+  #ifdef FAT_DEBUG
+      printf("Reserved sector count was not valid: %d\r\n", boot32->reserved_sectors);
+  #endif
+      GRISTLE_SYSUNLOCK;
+      return -1;
+    }
+    
+    // number of fats, normally two but must be between 1 and 15
+    if((boot32->num_fats < 1) || (boot32->num_fats >= 15)) {
+  #ifdef FAT_DEBUG
+      printf("Invalid number of FATs: %d\r\n", boot32->num_fats);
+  #endif
+      GRISTLE_SYSUNLOCK;
+      return -1;
+    }
+    
+    // number of root directory entries
+    if((boot32->root_entries != 0)) {
+  #ifdef FAT_DEBUG
+      printf("Root directory entries, looks like a FAT16 partition.\r\n");
+  #endif
+      GRISTLE_SYSUNLOCK;
+      return -1;
+    }
+    
+    // number of root directory entries must be an integer multiple of the sector size
+    if((boot32->root_entries) & ((boot32->sector_size / 32) - 1)) {
+  #ifdef FAT_DEBUG
+      printf("Root directory will not be an integer number of sectors.\r\n");
+  #endif
+      GRISTLE_SYSUNLOCK;
+      return -1;
+    }
+    
+    // total logical sectors (if less than 65535)
+    if(boot32->total_sectors == 0) {
+      if(boot32->big_total_sectors > volume_size) {
+  #ifdef FAT_DEBUG
+        printf("Total sectors is larger than the volume.\r\n");
+  #endif
+        GRISTLE_SYSUNLOCK;
+        return -1;
+      }
+    } else {
+      if(boot32->total_sectors > volume_size) {
+  #ifdef FAT_DEBUG
+        printf("Total sectors is larger than the volume.\r\n");
+  #endif
+        GRISTLE_SYSUNLOCK;
+        return -1;
+      }
+    }
+    
+    boot32 = (boot_sector_fat32 *)fatfs.sysbuf;
+    fatfs.sectors_per_cluster = boot32->cluster_size;
+    fatfs.cluster_shift = __builtin_ctz(boot32->cluster_size);  // checked to be a power of two
+    i = start;
+    i += boot32->reserved_sectors;
+    fatfs.active_fat_start = i;
+    fatfs.sectors_per_fat = boot32->sectors_per_fat;
+    i += boot32->sectors_per_fat * boot32->num_fats;
+    i -= boot32->cluster_size * 2;
+    fatfs.cluster0 = i;
+    fatfs.root_cluster = boot32->root_start;
+
+    if(boot32->total_sectors == 0) {
+      fatfs.total_sectors = boot32->big_total_sectors;
+    } else {
+      fatfs.total_sectors = boot32->total_sectors;
+    }
+    
+    // validated a FAT32 volume boot record, setup the FAT32 abstraction values
+    fatfs.type = PART_TYPE_FAT32;
+    fatfs.fat_entry_len = 4;
+    fatfs.end_cluster_marker = 0xFFFFFF0;
+    fatfs.part_start = start;
+    // bit 7 of the flags means only one FAT is in use and they aren't mirrored
+    if(boot32->fat_flags & 0x80) {
+      fatfs.num_fats = 1;
+    } else {
+      fatfs.num_fats = boot32->num_fats;
+    }
+    fatfs.fat_dirty_first = FAT_NO_DIRTY;
+    fatfs.fat_dirty_last = FAT_NO_DIRTY;
+    fatfs.max_cluster = (start + fatfs.total_sectors - fatfs.cluster0) / fatfs.sectors_per_cluster - 1;
+    if(fatfs.max_cluster > (fatfs.sectors_per_fat * 512 / 4) - 1) {
+      fatfs.max_cluster = (fatfs.sectors_per_fat * 512 / 4) - 1;
+    }
+  } else {
+    // failed to get mutex
+    return -1;
+  }
+  GRISTLE_SYSUNLOCK;
+  return 0;
+}
+#endif
+
+/**
+ * callable file access routines
+ */
+
+/**
+ * \brief Attempts to mount a partition starting at the addressed block.
+ * 
+ **/
+int fat_mount_locked(blockno_t part_start, blockno_t volume_size, uint8_t filesystem_hint) {
+  fat_dcache_clear();
+  fat_dir_index_clear();
+  fat_dir_hint_clear();
+  fatfs.writeback_clusters = GRISTLE_WRITEBACK_CLUSTERS;
+  fatfs.writeback_seconds = GRISTLE_WRITEBACK_SECONDS;
+  fatfs.reserve_clusters = GRISTLE_RESERVE_CLUSTERS;
+#if defined(GRISTLE_FAT16_ONLY)
+  (void)filesystem_hint;
+  if(fat_mount_fat16(part_start, volume_size) == 0) {
+    return 0;
+  }
+#elif defined(GRISTLE_FAT32_ONLY)
+  (void)filesystem_hint;
+  if(fat_mount_fat32(part_start, volume_size) == 0) {
+    return 0;
+  }
+#else
+  if(filesystem_hint == PART_TYPE_FAT16) {
+    // try FAT16 first
+    if(fat_mount_fat16(part_start, volume_size) == 0) {
+      return 0;
+    } else {
+      // try FAT32 as a fallback
+      if(fat_mount_fat32(part_start, volume_size) == 0) {
+        return 0;
+      }
+    }
+  } else {
+    if(fat_mount_fat32(part_start, volume_size) == 0) {
+      return 0;
+    } else {
+      if(fat_mount_fat16(part_start, volume_size) == 0) {
+        return 0;
+      }
+    }
+  }
+#endif
+  return -1;            // no FAT type working
+}
+
+int fat_mount(blockno_t part_start, blockno_t volume_size, uint8_t filesystem_hint) {
+  int r;
+  
+  GRISTLE_META_WRLOCK;
+  r = fat_mount_locked(part_start, volume_size, filesystem_hint);
+  GRISTLE_META_UNLOCK;
+  return r;
+}
+
+int fat_open_fd(int8_t fd, const char *name, int flags, int mode, int *rerrno) {
+  int i;
+  
+  file_num[fd].clusters_added = 0;
+  file_num[fd].info_flushed = GRISTLE_TIME;
+  file_num[fd].reserve_from = 0;
+  file_num[fd].window_size = (GRISTLE_BUFFER_SECTORS < fatfs.sectors_per_cluster) ?
+                            GRISTLE_BUFFER_SECTORS : fatfs.sectors_per_cluster;
+  fat_window_drop(fd);
+  
+//   printf("Lookup path\n");
+  i = fat_lookup_path(fd, name, rerrno);
+  if(i == 0) {
+    fat_extent_start(fd, file_num[fd].full_first_cluster);
+    fat_select_cluster(fd, file_num[fd].full_first_cluster);
+  }
+  if((flags & O_RDWR)) {
+    file_num[fd].flags |= (FAT_FLAG_READ | FAT_FLAG_WRITE);
+  } else {
+    if((flags & O_WRONLY) == 0) {
+      file_num[fd].flags |= FAT_FLAG_READ;
+    } else {
+      file_num[fd].flags |= FAT_FLAG_WRITE;
+    }
+  }
+  
+  if(flags & O_APPEND) {
+    file_num[fd].flags |= FAT_FLAG_APPEND;
+  }
+  if((i == -1) && ((*rerrno) == ENOENT)) {
+    /* file doesn't exist */
+    if((flags & (O_CREAT)) == 0) {
+      /* tried to open a non-existent file with no create */
+      file_num[fd].flags = 0;
+      (*rerrno) = ENOENT;
+      return -1;
+    } else {
+      /* opening a new file for writing */
+      /* only create files in directories that aren't read only */
+      if(fatfs.read_only) {
+        file_num[fd].flags = 0;
+        (*rerrno) = EROFS;
+        return -1;
+      }
+      /* create an empty file structure ready for use */
+      file_num[fd].sector = 0;
+      file_num[fd].cluster = 0;
+      file_num[fd].sectors_left = 0;
+      file_num[fd].cursor = 0;
+      file_num[fd].error = 0;
+      if(mode & S_IWUSR) {
+        file_num[fd].attributes = FAT_ATT_ARC;
+      } else {
+        file_num[fd].attributes = FAT_ATT_ARC | FAT_ATT_RO;
+      }
+      file_num[fd].size = 0;
+      file_num[fd].full_first_cluster = 0;
+      file_num[fd].entry_sector = 0;
+      file_num[fd].entry_number = 0;
+      file_num[fd].file_sector = 0;
+      file_num[fd].num_extents = 0;
+      file_num[fd].created = GRISTLE_TIME;
+      file_num[fd].modified = 0;
+      file_num[fd].accessed = 0;
+      
+      memset(file_num[fd].buffer, 0, 512);
+      
+      // need to make sure we don't set the file system as dirty until we've actually
+      // written to the file.
+      //file_num[fd].flags |= FAT_FLAG_FS_DIRTY;
+      (*rerrno) = 0;    /* file not found but we're aloud to create it so success */
+      return fd;
+    }
+  } else if((i == -1) && ((*rerrno) == GRISTLE_BAD_PATH)) {
+      /* if a parent folder of the requested file does not exist we can't create the file
+       * so a different response is given from the lookup path, but the POSIX standard
+       * still requires ENOENT returned. */
+      file_num[fd].flags = 0;
+      (*rerrno) = ENOENT;
+      return -1;
+  } else if(i == 0) {
+    /* file does exist */
+    if((flags & O_CREAT) && (flags & O_EXCL)) {
+      /* tried to force creation of an existing file */
+      file_num[fd].flags = 0;
+      (*rerrno) = EEXIST;
+      return -1;
+    } else {
+      if((flags & (O_WRONLY | O_RDWR)) == 0) {
+        /* read existing file */
+        file_num[fd].file_sector = 0;
+        return fd;
+      } else {
+        /* file opened for write access, check permissions */
+        if(fatfs.read_only) {
+          /* requested write on read only filesystem */
+          file_num[fd].flags = 0;
+          (*rerrno) = EROFS;
+          return -1;
+        }
+        if(file_num[fd].attributes & FAT_ATT_RO) {
+          /* The file is read-only refuse permission */
+          file_num[fd].flags = 0;
+          (*rerrno) = EACCES;
+          return -1;
+        }
+        if(file_num[fd].attributes & FAT_ATT_SUBDIR) {
+          /* Tried to open a directory for writing */
+          /* Magic handshake */
+          if((*rerrno) == FAT_INTERNAL_CALL) {
+            file_num[fd].file_sector = 0;
+            return fd;
+          } else {
+            file_num[fd].flags = 0;
+            (*rerrno) = EISDIR;
+            return -1;
+          }
+        }
+        if(flags & O_TRUNC) {
+          /* Need to truncate the file to zero length */
+          fat_free_clusters(file_num[fd].full_first_cluster);
+          file_num[fd].size = 0;
+          file_num[fd].full_first_cluster = 0;
+          file_num[fd].sector = 0;
+          file_num[fd].cluster = 0;
+          file_num[fd].sectors_left = 0;
+          file_num[fd].file_sector = 0;
+          file_num[fd].num_extents = 0;
+          file_num[fd].created = GRISTLE_TIME;
+          file_num[fd].modified = GRISTLE_TIME;
+          file_num[fd].flags |= FAT_FLAG_FS_DIRTY;
+        }
+        file_num[fd].file_sector = 0;
+        return fd;
+      }
+    }
+  } else {
+    file_num[fd].flags = 0;
+    return -1;
+  }
+}
+
+int fat_open_locked(const char *name, int flags, int mode, int *rerrno) {
+  int8_t fd;
+  int r;
+  
+//   printf("fat_open(%s, %x)\n", name, flags);
+  fd = fat_get_next_file();
+  if(fd < 0) {
+    (*rerrno) = ENFILE;
+    return -1;   /* too many open files */
+  }
+  if(fat_buffer_pin(fd, rerrno)) {
+    file_num[fd].flags = 0;
+    file_num[fd].in_use = 0;
+    return -1;
+  }
+  r = fat_open_fd(fd, name, flags, mode, rerrno);
+  // a failed open has left the file closed, so this gives its buffer back
+  fat_buffer_unpin(fd);
+  if(r < 0) {
+    file_num[fd].in_use = 0;
+  }
+  return r;
+}
+
+int fat_open(const char *name, int flags, int mode, int *rerrno) {
+  int r;
+  
+  GRISTLE_META_WRLOCK;
+  r = fat_open_locked(name, flags, mode, rerrno);
+  GRISTLE_META_UNLOCK;
+  return r;
+}
+
+int fat_close_locked(int fd, int *rerrno) {
+  (*rerrno) = 0;
+  if(fd >= MAX_OPEN_FILES) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(!(file_num[fd].flags & FAT_FLAG_OPEN)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(file_num[fd].flags & FAT_FLAG_DIRTY) {
+    if(fat_flush(fd)) {
+      (*rerrno) = EIO;
       return -1;
     }
-    
-    // total logical sectors (if less than 65535)
-    if(boot16->total_sectors == 0) {
-      if(boot16->big_total_sectors > volume_size) {
-#ifdef FAT_DEBUG
-        printf("Total sectors is larger than the volume.\r\n");
-#endif
-        GRISTLE_SYSUNLOCK;
-        return -1;
-      }
-    } else {
-      if(boot16->total_sectors > volume_size) {
-#ifdef FAT_DEBUG
-        printf("Total sectors is larger than the volume.\r\n");
-#endif
-        GRISTLE_SYSUNLOCK;
-        return -1;
+  }
+  if(fat_window_flush(fd)) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+  /* give back any clusters reserved for the file that it didn't grow into */
+  if(fat_release_reserve(fd)) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+  if(file_num[fd].flags & FAT_FLAG_FS_DIRTY) {
+    if(fat_flush_fileinfo(fd, rerrno)) {
+      if(file_num[fd].entry_sector == 0) {
+        // a new file that couldn't be given a directory entry, nothing refers to its clusters
+        fat_free_clusters(file_num[fd].full_first_cluster);
+        file_num[fd].flags = 0;
+        fat_mirror_fats();
       }
-    }
-    
-    fatfs.sectors_per_cluster = boot16->cluster_size;
-    fatfs.root_len = (boot16->root_entries * 32) / 512;
-    i = start;
-    i += boot16->reserved_sectors;
-    fatfs.active_fat_start = i;
-    fatfs.sectors_per_fat = boot16->sectors_per_fat;
-    i += (boot16->sectors_per_fat * boot16->num_fats);
-    fatfs.root_start = i;
-    i += (boot16->root_entries * 32) / 512;
-    i -= (boot16->cluster_size * 2);
-    fatfs.cluster0 = i;
-    
-    // check the calculated values are within the volume 
-    if(fatfs.root_start > (start + volume_size)) {
-#ifdef FAT_DEBUG
-      printf("Root start is beyond the end of the volume.\r\n");
-#endif
-      GRISTLE_SYSUNLOCK;
       return -1;
     }
-    
-    if(boot16->total_sectors == 0) {
-      fatfs.total_sectors = boot16->big_total_sectors;
-    } else {
-      fatfs.total_sectors = boot16->total_sectors;
-    }
-    
-    // validated a FAT16 volume boot record, setup the FAT16 abstraction values
-    fatfs.type = PART_TYPE_FAT16;
-    fatfs.fat_entry_len = 2;
-    fatfs.end_cluster_marker = 0xFFF0;
-    fatfs.part_start = start;
-    fatfs.root_cluster = 1;
+  }
+  file_num[fd].flags = 0;
+  if(fat_mirror_fats()) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+  return 0;
+}
 
-  } else {
+int fat_close(int fd, int *rerrno) {
+  int r;
+  int closed;
+  
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(fat_fd_lock(fd, rerrno)) {
+    return -1;
+  }
+  r = fat_close_locked(fd, rerrno);
+  closed = !(file_num[fd].flags & FAT_FLAG_OPEN);
+  fat_fd_unlock(fd);
+  // the slot can only be handed out again once its buffers have been unpinned
+  if(closed) {
+    GRISTLE_META_WRLOCK;
+    file_num[fd].in_use = 0;
+    GRISTLE_META_UNLOCK;
+  }
+  return r;
+}
+
+void fat_set_writeback(uint32_t clusters, uint32_t seconds) {
+  fatfs.writeback_clusters = clusters;
+  fatfs.writeback_seconds = seconds;
+}
+
+void fat_set_reserve(uint32_t clusters) {
+  fatfs.reserve_clusters = clusters;
+}
+
+int fat_set_buffer_locked(int fd, uint32_t size, int *rerrno) {
+  (*rerrno) = 0;
+  if(!(file_num[fd].flags & FAT_FLAG_OPEN)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(size < 512) {
+    (*rerrno) = EINVAL;
+    return -1;
+  }
+  size = size / 512;
+  if(size > fatfs.sectors_per_cluster) {
+    size = fatfs.sectors_per_cluster;
+  }
+  if(size > GRISTLE_BUFFER_SECTORS) {
+    size = GRISTLE_BUFFER_SECTORS;
+  }
+  if((fat_flush(fd)) || (fat_window_flush(fd))) {
+    (*rerrno) = EIO;
     return -1;
   }
+  // the window is borrowed again at the new size when it's next used
+  if(!GRISTLE_SYSLOCK) {
+    (*rerrno) = EBUSY;
+    return -1;
+  }
+  fat_pool_release(fd, 1);
   GRISTLE_SYSUNLOCK;
+  file_num[fd].window_size = size;
   return 0;
 }
 
-int fat_mount_fat32(blockno_t start, blockno_t volume_size) {
-  blockno_t i;
-  boot_sector_fat32 *boot32;
+int fat_set_buffer(int fd, uint32_t size, int *rerrno) {
+  int r;
   
-  if(GRISTLE_SYSLOCK) {
-    
-    fatfs.read_only = block_get_device_read_only();
-    block_read(start, fatfs.sysbuf);
-    
-    boot32 = (boot_sector_fat32 *)fatfs.sysbuf;
-    // now validate all fields and reject the block device if anything fails
-    
-    // could check the volume name is all printable characters
-    
-    // we can only handle sector size equal to the disk block size
-    // for now at least.
-    if(!(boot32->sector_size == 512)) {
-  #ifdef FAT_DEBUG
-      printf("Sector size not 512 bytes.\r\n");
-  #endif
-      GRISTLE_SYSUNLOCK;
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(fat_fd_lock(fd, rerrno)) {
+    return -1;
+  }
+  r = fat_set_buffer_locked(fd, size, rerrno);
+  fat_fd_unlock(fd);
+  return r;
+}
+
+int fat_fsync_locked(int fd, int *rerrno) {
+  (*rerrno) = 0;
+  if(fd >= MAX_OPEN_FILES) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(!(file_num[fd].flags & FAT_FLAG_OPEN)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if((fat_flush(fd)) || (fat_window_flush(fd))) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+  if(file_num[fd].flags & FAT_FLAG_FS_DIRTY) {
+    if(fat_flush_fileinfo(fd, rerrno)) {
       return -1;
     }
-    
-    // cluster size is a number of sectors per cluster.  Must be a
-    // power of two in 8 bits (i.e. 1, 2, 4, 8, 16, 32, 64 or 128)
-    for(i=0;i<8;i++) {
-      if(boot32->cluster_size == (1 << i)) {
-        break;
+  }
+  if(fat_mirror_fats()) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+int fat_fsync(int fd, int *rerrno) {
+  int r;
+  
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(fat_fd_lock(fd, rerrno)) {
+    return -1;
+  }
+  r = fat_fsync_locked(fd, rerrno);
+  fat_fd_unlock(fd);
+  return r;
+}
+
+int fat_sync(int *rerrno) {
+  int i;
+  int fd_errno;
+  
+  (*rerrno) = 0;
+  for(i=0;i<MAX_OPEN_FILES;i++) {
+    if(fat_fd_lock(i, &fd_errno)) {
+      if(fd_errno != EBADF) {
+        (*rerrno) = fd_errno;
       }
+      continue;
     }
-    if(i == 8) {
-  #ifdef FAT_DEBUG
-      printf("Cluster size not power of two.\r\n");
-  #endif
-      GRISTLE_SYSUNLOCK;
-      return -1;
-    }
-    
-    // number of reserved sectors must be at least 1, can't be
-    // the size of the partition.
-    if((boot32->reserved_sectors < 1) || (boot32->reserved_sectors >= volume_size)) {
-  #ifdef FAT_DEBUG
-      printf("Reserved sector count was not valid: %d\r\n", boot32->reserved_sectors);
-  #endif
-      GRISTLE_SYSUNLOCK;
-      return -1;
-    }
-    
-    // number of fats, normally two but must be between 1 and 15
-    if((boot32->num_fats < 1) || (boot32->num_fats >= 15)) {
-  #ifdef FAT_DEBUG
-      printf("Invalid number of FATs: %d\r\n", boot32->num_fats);
-  #endif
-      GRISTLE_SYSUNLOCK;
-      return -1;
-    }
-    
-    // number of root directory entries
-    if((boot32->root_entries != 0)) {
-  #ifdef FAT_DEBUG
-      printf("Root directory entries, looks like a FAT16 partition.\r\n");
-  #endif
-      GRISTLE_SYSUNLOCK;
-      return -1;
+    if((fat_flush(i)) || (fat_window_flush(i))) {
+      (*rerrno) = EIO;
     }
-    
-    // number of root directory entries must be an integer multiple of the sector size
-    if((boot32->root_entries) & ((boot32->sector_size / 32) - 1)) {
-  #ifdef FAT_DEBUG
-      printf("Root directory will not be an integer number of sectors.\r\n");
-  #endif
-      GRISTLE_SYSUNLOCK;
-      return -1;
+    if(file_num[i].flags & FAT_FLAG_FS_DIRTY) {
+      if(fat_flush_fileinfo(i, &fd_errno)) {
+        (*rerrno) = fd_errno;
+      }
     }
-    
-    // total logical sectors (if less than 65535)
-    if(boot32->total_sectors == 0) {
-      if(boot32->big_total_sectors > volume_size) {
-  #ifdef FAT_DEBUG
-        printf("Total sectors is larger than the volume.\r\n");
-  #endif
-        GRISTLE_SYSUNLOCK;
-        return -1;
+    fat_fd_unlock(i);
+  }
+  if(fat_mirror_fats()) {
+    (*rerrno) = EIO;
+  }
+  return (*rerrno) ? -1 : 0;
+}
+
+int fat_umount(int *rerrno) {
+  int i;
+  int close_errno;
+  
+  fat_sync(rerrno);
+  for(i=0;i<MAX_OPEN_FILES;i++) {
+    GRISTLE_FD_LOCK(i);
+    if(file_num[i].flags & FAT_FLAG_OPEN) {
+      if(fat_close(i, &close_errno)) {
+        (*rerrno) = close_errno;
       }
-    } else {
-      if(boot32->total_sectors > volume_size) {
-  #ifdef FAT_DEBUG
-        printf("Total sectors is larger than the volume.\r\n");
-  #endif
+    }
+    GRISTLE_FD_UNLOCK(i);
+  }
+  return (*rerrno) ? -1 : 0;
+}
+
+int fat_statfs(fatstatS *st, int *rerrno) {
+  blockno_t i;
+  uint32_t first;
+  uint32_t end;
+  uint32_t per = 512 >> FAT_ENTRY_SHIFT;
+  
+  (*rerrno) = 0;
+  st->cluster_size = fatfs.sectors_per_cluster * 512;
+  st->clusters = fatfs.max_cluster - 1;
+  st->free_clusters = 0;
+  if(GRISTLE_SYSLOCK) {
+    for(i=0;i<=fatfs.max_cluster / per;i++) {
+      if(block_read(fatfs.active_fat_start + i, fatfs.sysbuf)) {
         GRISTLE_SYSUNLOCK;
+        (*rerrno) = EIO;
         return -1;
       }
-    }
-    
-    boot32 = (boot_sector_fat32 *)fatfs.sysbuf;
-    fatfs.sectors_per_cluster = boot32->cluster_size;
-    i = start;
-    i += boot32->reserved_sectors;
-    fatfs.active_fat_start = i;
-    fatfs.sectors_per_fat = boot32->sectors_per_fat;
-    i += boot32->sectors_per_fat * boot32->num_fats;
-    i -= boot32->cluster_size * 2;
-    fatfs.cluster0 = i;
-    fatfs.root_cluster = boot32->root_start;
-
-    if(boot32->total_sectors == 0) {
-      fatfs.total_sectors = boot32->big_total_sectors;
-    } else {
-      fatfs.total_sectors = boot32->total_sectors;
-    }
-    
-    // validated a FAT32 volume boot record, setup the FAT32 abstraction values
-    fatfs.type = PART_TYPE_FAT32;
-    fatfs.fat_entry_len = 4;
-    fatfs.end_cluster_marker = 0xFFFFFF0;
-    fatfs.part_start = start;
+      // clusters 0 and 1 are reserved and the last FAT sector may run past the end of the disc
+      first = (i == 0) ? 2 : 0;
+      end = (i == fatfs.max_cluster / per) ? (fatfs.max_cluster % per) + 1 : per;
+      st->free_clusters += fat_sector_count_free(fatfs.sysbuf, first, end);
+    }
+    GRISTLE_SYSUNLOCK;
   } else {
-    // failed to get mutex
+    (*rerrno) = EBUSY;
     return -1;
   }
-  GRISTLE_SYSUNLOCK;
   return 0;
 }
 
-/**
- * callable file access routines
- */
-
-/**
- * \brief Attempts to mount a partition starting at the addressed block.
+/*
+ * fat_read_span - copies count bytes from the current position of a file, the caller has checked
+ *                 they are inside the file.  Returns the number copied, fewer if a read failed.
  * 
- **/
-int fat_mount(blockno_t part_start, blockno_t volume_size, uint8_t filesystem_hint) {
-  if(filesystem_hint == PART_TYPE_FAT16) {
-    // try FAT16 first
-    if(fat_mount_fat16(part_start, volume_size) == 0) {
-      return 0;
-    } else {
-      // try FAT32 as a fallback
-      if(fat_mount_fat32(part_start, volume_size) == 0) {
-        return 0;
+ * The rest of the current sector is copied first, then any whole sectors straight into the
+ * caller's buffer and finally the start of the last sector via the file buffer.
+ */
+uint32_t fat_read_span(int fd, uint8_t *bt, uint32_t count) {
+  uint32_t i=0;
+  uint32_t n;
+  
+  while(i < count) {
+    if(file_num[fd].cursor == 512) {
+      if(count - i >= 512) {
+        n = fat_read_sectors(fd, bt, (count - i) / 512);
+        if(n == 0) {
+          break;
+        }
+        bt += n * 512;
+        i += n * 512;
+        continue;
       }
-    }
-  } else {
-    if(fat_mount_fat32(part_start, volume_size) == 0) {
-      return 0;
-    } else {
-      if(fat_mount_fat16(part_start, volume_size) == 0) {
-        return 0;
+      if(fat_next_data_sector(fd)) {
+        break;
       }
     }
+    n = 512 - file_num[fd].cursor;
+    if(n > count - i) {
+      n = count - i;
+    }
+    memcpy(bt, file_num[fd].buffer + file_num[fd].cursor, n);
+    file_num[fd].cursor += n;
+    bt += n;
+    i += n;
   }
-  return -1;            // no FAT type working
+  return i;
 }
 
-int fat_open(const char *name, int flags, int mode, int *rerrno) {
-  int i;
-  int8_t fd;
+/*
+ * fat_iov_total - adds up the lengths of an iovec array, -1 if the total doesn't fit the int that
+ *                 fat_readv() and fat_writev() return.
+ */
+int32_t fat_iov_total(const struct iovec *iov, int iovcnt) {
+  uint32_t total = 0;
+  int k;
   
-//   printf("fat_open(%s, %x)\n", name, flags);
-  fd = fat_get_next_file();
-  if(fd < 0) {
-    (*rerrno) = ENFILE;
-    return -1;   /* too many open files */
+  if(iovcnt < 0) {
+    return -1;
+  }
+  for(k=0;k<iovcnt;k++) {
+    if(iov[k].iov_len > 0x7FFFFFFF - total) {
+      return -1;
+    }
+    total += iov[k].iov_len;
   }
+  return total;
+}
 
-//   printf("Lookup path\n");
-  i = fat_lookup_path(fd, name, rerrno);
-  if((flags & O_RDWR)) {
-    file_num[fd].flags |= (FAT_FLAG_READ | FAT_FLAG_WRITE);
-  } else {
-    if((flags & O_WRONLY) == 0) {
-      file_num[fd].flags |= FAT_FLAG_READ;
-    } else {
-      file_num[fd].flags |= FAT_FLAG_WRITE;
+int fat_read_locked(int fd, void *buffer, size_t count, int *rerrno) {
+  uint32_t i;
+  uint32_t pos;
+  /* make sure this is an open file and it can be read */
+  (*rerrno) = 0;
+  if(fd >= MAX_OPEN_FILES) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if((~file_num[fd].flags) & (FAT_FLAG_OPEN | FAT_FLAG_READ)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  
+  if(!(file_num[fd].attributes & FAT_ATT_SUBDIR)) {
+    // only check length on regular files, directories don't have a length
+    pos = file_num[fd].cursor + file_num[fd].file_sector * 512;
+    if(pos >= file_num[fd].size) {
+      count = 0;    /* end of file */
+    } else if(count > file_num[fd].size - pos) {
+      count = file_num[fd].size - pos;
     }
   }
   
-  if(flags & O_APPEND) {
-    file_num[fd].flags |= FAT_FLAG_APPEND;
+  i = fat_read_span(fd, (uint8_t *)buffer, count);
+  if(i > 0) {
+    fat_update_atime(fd);
   }
-  if((i == -1) && ((*rerrno) == ENOENT)) {
-    /* file doesn't exist */
-    if((flags & (O_CREAT)) == 0) {
-      /* tried to open a non-existent file with no create */
-      file_num[fd].flags = 0;
-      (*rerrno) = ENOENT;
-      return -1;
-    } else {
-      /* opening a new file for writing */
-      /* only create files in directories that aren't read only */
-      if(fatfs.read_only) {
-        file_num[fd].flags = 0;
-        (*rerrno) = EROFS;
-        return -1;
-      }
-      /* create an empty file structure ready for use */
-      file_num[fd].sector = 0;
-      file_num[fd].cluster = 0;
-      file_num[fd].sectors_left = 0;
-      file_num[fd].cursor = 0;
-      file_num[fd].error = 0;
-      if(mode & S_IWUSR) {
-        file_num[fd].attributes = FAT_ATT_ARC;
-      } else {
-        file_num[fd].attributes = FAT_ATT_ARC | FAT_ATT_RO;
-      }
-      file_num[fd].size = 0;
-      file_num[fd].full_first_cluster = 0;
-      file_num[fd].entry_sector = 0;
-      file_num[fd].entry_number = 0;
-      file_num[fd].file_sector = 0;
-      file_num[fd].created = GRISTLE_TIME;
-      file_num[fd].modified = 0;
-      file_num[fd].accessed = 0;
-      
-      memset(file_num[fd].buffer, 0, 512);
-      
-      // need to make sure we don't set the file system as dirty until we've actually
-      // written to the file.
-      //file_num[fd].flags |= FAT_FLAG_FS_DIRTY;
-      (*rerrno) = 0;    /* file not found but we're aloud to create it so success */
-      return fd;
-    }
-  } else if((i == -1) && ((*rerrno) == GRISTLE_BAD_PATH)) {
-      /* if a parent folder of the requested file does not exist we can't create the file
-       * so a different response is given from the lookup path, but the POSIX standard
-       * still requires ENOENT returned. */
-      file_num[fd].flags = 0;
-      (*rerrno) = ENOENT;
-      return -1;
-  } else if(i == 0) {
-    /* file does exist */
-    if((flags & O_CREAT) && (flags & O_EXCL)) {
-      /* tried to force creation of an existing file */
-      file_num[fd].flags = 0;
-      (*rerrno) = EEXIST;
-      return -1;
-    } else {
-      if((flags & (O_WRONLY | O_RDWR)) == 0) {
-        /* read existing file */
-        file_num[fd].file_sector = 0;
-        return fd;
-      } else {
-        /* file opened for write access, check permissions */
-        if(fatfs.read_only) {
-          /* requested write on read only filesystem */
-          file_num[fd].flags = 0;
-          (*rerrno) = EROFS;
-          return -1;
-        }
-        if(file_num[fd].attributes & FAT_ATT_RO) {
-          /* The file is read-only refuse permission */
-          file_num[fd].flags = 0;
-          (*rerrno) = EACCES;
-          return -1;
-        }
-        if(file_num[fd].attributes & FAT_ATT_SUBDIR) {
-          /* Tried to open a directory for writing */
-          /* Magic handshake */
-          if((*rerrno) == FAT_INTERNAL_CALL) {
-            file_num[fd].file_sector = 0;
-            return fd;
-          } else {
-            file_num[fd].flags = 0;
-            (*rerrno) = EISDIR;
-            return -1;
-          }
-        }
-        if(flags & O_TRUNC) {
-          /* Need to truncate the file to zero length */
-          fat_free_clusters(file_num[fd].full_first_cluster);
-          file_num[fd].size = 0;
-          file_num[fd].full_first_cluster = 0;
-          file_num[fd].sector = 0;
-          file_num[fd].cluster = 0;
-          file_num[fd].sectors_left = 0;
-          file_num[fd].file_sector = 0;
-          file_num[fd].created = GRISTLE_TIME;
-          file_num[fd].modified = GRISTLE_TIME;
-          file_num[fd].flags |= FAT_FLAG_FS_DIRTY;
-        }
-        file_num[fd].file_sector = 0;
-        return fd;
-      }
-    }
-  } else {
-    file_num[fd].flags = 0;
+  return i;
+}
+
+int fat_read(int fd, void *buffer, size_t count, int *rerrno) {
+  int r;
+  
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
     return -1;
   }
+  if(fat_fd_lock(fd, rerrno)) {
+    return -1;
+  }
+  if(file_num[fd].attributes & FAT_ATT_SUBDIR) {
+    GRISTLE_META_RDLOCK;
+    r = fat_read_locked(fd, buffer, count, rerrno);
+    GRISTLE_META_UNLOCK;
+  } else {
+    r = fat_read_locked(fd, buffer, count, rerrno);
+  }
+  fat_fd_unlock(fd);
+  return r;
 }
 
-int fat_close(int fd, int *rerrno) {
+/*
+ * fat_readv_locked - fills each buffer of iov in turn as one span of the file, the end of file
+ *                    check and the atime update are done once for the whole call.
+ */
+int fat_readv_locked(int fd, const struct iovec *iov, int iovcnt, int *rerrno) {
+  uint32_t i=0;
+  uint32_t n;
+  uint32_t r;
+  uint32_t pos;
+  int32_t count;
+  int k;
+  
   (*rerrno) = 0;
   if(fd >= MAX_OPEN_FILES) {
     (*rerrno) = EBADF;
     return -1;
   }
-  if(!(file_num[fd].flags & FAT_FLAG_OPEN)) {
+  if((~file_num[fd].flags) & (FAT_FLAG_OPEN | FAT_FLAG_READ)) {
     (*rerrno) = EBADF;
     return -1;
   }
-  if(file_num[fd].flags & FAT_FLAG_DIRTY) {
-    if(fat_flush(fd)) {
-      (*rerrno) = EIO;
-      return -1;
+  if((count = fat_iov_total(iov, iovcnt)) < 0) {
+    (*rerrno) = EINVAL;
+    return -1;
+  }
+  
+  if(!(file_num[fd].attributes & FAT_ATT_SUBDIR)) {
+    pos = file_num[fd].cursor + file_num[fd].file_sector * 512;
+    if(pos >= file_num[fd].size) {
+      count = 0;    /* end of file */
+    } else if((uint32_t)count > file_num[fd].size - pos) {
+      count = file_num[fd].size - pos;
+    }
+  }
+  
+  for(k=0;(k<iovcnt) && (i < (uint32_t)count);k++) {
+    n = iov[k].iov_len;
+    if(n > (uint32_t)count - i) {
+      n = (uint32_t)count - i;
+    }
+    r = fat_read_span(fd, (uint8_t *)iov[k].iov_base, n);
+    i += r;
+    if(r != n) {
+      break;
+    }
+  }
+  if(i > 0) {
+    fat_update_atime(fd);
+  }
+  return i;
+}
+
+int fat_readv(int fd, const struct iovec *iov, int iovcnt, int *rerrno) {
+  int r;
+  
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(fat_fd_lock(fd, rerrno)) {
+    return -1;
+  }
+  if(file_num[fd].attributes & FAT_ATT_SUBDIR) {
+    GRISTLE_META_RDLOCK;
+    r = fat_readv_locked(fd, iov, iovcnt, rerrno);
+    GRISTLE_META_UNLOCK;
+  } else {
+    r = fat_readv_locked(fd, iov, iovcnt, rerrno);
+  }
+  fat_fd_unlock(fd);
+  return r;
+}
+
+/*
+ * fat_write_span - copies count bytes into a file at its current position, without touching the
+ *                  size or times.  Returns 0 or -1 if a sector couldn't be read or written.
+ * 
+ * The rest of the current sector is filled first, then whole sectors are written straight from
+ * the caller's buffer and finally any remainder is put in the file buffer.
+ */
+int fat_write_span(int fd, const uint8_t *bt, uint32_t count) {
+  uint32_t i=0;
+  uint32_t n;
+  
+  while(i < count) {
+    if(file_num[fd].cursor == 512) {
+      if(count - i >= 512) {
+        n = fat_write_sectors(fd, bt, (count - i) / 512);
+        if(n == 0) {
+          return -1;
+        }
+        bt += n * 512;
+        i += n * 512;
+        continue;
+      }
+      if((!(file_num[fd].attributes & FAT_ATT_SUBDIR)) &&
+         ((file_num[fd].file_sector + 1) * 512 >= file_num[fd].size)) {
+        /* the next sector is past the end of the file so there's nothing in it worth reading */
+        if(fat_step_sector(fd)) {
+          return -1;
+        }
+        memset(file_num[fd].buffer, 0, 512);
+      } else if(fat_next_data_sector(fd)) {
+        return -1;
+      }
+    }
+    n = 512 - file_num[fd].cursor;
+    if(n > count - i) {
+      n = count - i;
+    }
+    memcpy(file_num[fd].buffer + file_num[fd].cursor, bt, n);
+    file_num[fd].cursor += n;
+    file_num[fd].flags |= FAT_FLAG_DIRTY;
+    bt += n;
+    i += n;
+  }
+  return 0;
+}
+
+/*
+ * fat_write_done - brings the size, reservation and modified time of a file up to date after
+ *                  count bytes have been written.  Returns 0 or -1 if the directory entry had to
+ *                  be written and couldn't be, with the error in rerrno.
+ */
+int fat_write_done(int fd, uint32_t count, int *rerrno) {
+  uint32_t pos;
+  
+  if(!(file_num[fd].attributes & FAT_ATT_SUBDIR)) {
+    pos = file_num[fd].cursor + file_num[fd].file_sector * 512;
+    if(pos > file_num[fd].size) {
+      file_num[fd].size = pos;
     }
+    fat_reserve_taken(fd);
   }
-  if(file_num[fd].flags & FAT_FLAG_FS_DIRTY) {
-    if(fat_flush_fileinfo(fd)) {
-      (*rerrno) = EIO;
-      return -1;
+  if(count > 0) {
+    fat_update_mtime(fd);
+    if((file_num[fd].entry_sector == 0) && (file_num[fd].full_first_cluster != 0)) {
+      // the data is on the disc but fat_flush() couldn't give the file a directory entry
+      return fat_flush_fileinfo(fd, rerrno);
+    }
+    if(((fatfs.writeback_seconds) || (file_num[fd].reserve_from)) && (fat_writeback_due(fd))) {
+      return fat_flush_fileinfo(fd, rerrno);
     }
   }
-  file_num[fd].flags = 0;
   return 0;
 }
 
-int fat_read(int fd, void *buffer, size_t count, int *rerrno) {
-  uint32_t i=0;
-  uint8_t *bt = (uint8_t *)buffer;
-  /* make sure this is an open file and it can be read */
+int fat_write_locked(int fd, const void *buffer, size_t count, int *rerrno) {
   (*rerrno) = 0;
   if(fd >= MAX_OPEN_FILES) {
     (*rerrno) = EBADF;
     return -1;
   }
-  if((~file_num[fd].flags) & (FAT_FLAG_OPEN | FAT_FLAG_READ)) {
+  if((~file_num[fd].flags) & (FAT_FLAG_OPEN | FAT_FLAG_WRITE)) {
     (*rerrno) = EBADF;
     return -1;
   }
-  
-  /* copy some bytes to the buffer requested */
-  while(i < count) {
-    if(!(file_num[fd].attributes & FAT_ATT_SUBDIR)) {
-      // only check length on regular files, directories don't have a length
-      if(((file_num[fd].cursor + file_num[fd].file_sector * 512)) >= file_num[fd].size) {
-        break;   /* end of file */
-      }
-    }
-    if(file_num[fd].cursor == 512) {
-      if(fat_next_sector(fd)) {
-        break;
-      }
-    }
-    *bt++ = *(uint8_t *)(file_num[fd].buffer + file_num[fd].cursor);
-    file_num[fd].cursor++;
-    i++;
+  if(file_num[fd].flags & FAT_FLAG_APPEND) {
+    fat_lseek(fd, 0, SEEK_END, rerrno);
   }
-  if(i > 0) {
-    fat_update_atime(fd);
+  if(fat_write_span(fd, (const uint8_t *)buffer, count)) {
+    (*rerrno) = EIO;
+    return -1;
   }
-  return i;
+  if(fat_write_done(fd, count, rerrno)) {
+    return -1;
+  }
+  return count;
 }
 
 int fat_write(int fd, const void *buffer, size_t count, int *rerrno) {
-  uint32_t i=0;
-  uint8_t *bt = (uint8_t *)buffer;
+  int r;
+  
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(fat_fd_lock(fd, rerrno)) {
+    return -1;
+  }
+  if(file_num[fd].attributes & FAT_ATT_SUBDIR) {
+    GRISTLE_META_WRLOCK;
+    r = fat_write_locked(fd, buffer, count, rerrno);
+    GRISTLE_META_UNLOCK;
+  } else {
+    r = fat_write_locked(fd, buffer, count, rerrno);
+  }
+  fat_fd_unlock(fd);
+  return r;
+}
+
+/*
+ * fat_writev_locked - writes each buffer of iov in turn as one span of the file.  Small pieces
+ *                     collect in the file's sector buffer so a header and its payload go to the
+ *                     disc together, and the size, mtime and writeback checks are done once at
+ *                     the end.
+ */
+int fat_writev_locked(int fd, const struct iovec *iov, int iovcnt, int *rerrno) {
+  int32_t count;
+  int k;
+  
   (*rerrno) = 0;
   if(fd >= MAX_OPEN_FILES) {
     (*rerrno) = EBADF;
@@ -1458,43 +4388,48 @@ int fat_write(int fd, const void *buffer, size_t count, int *rerrno) {
     (*rerrno) = EBADF;
     return -1;
   }
+  if((count = fat_iov_total(iov, iovcnt)) < 0) {
+    (*rerrno) = EINVAL;
+    return -1;
+  }
   if(file_num[fd].flags & FAT_FLAG_APPEND) {
     fat_lseek(fd, 0, SEEK_END, rerrno);
   }
-  while(i < count) {
-    if(file_num[fd].cursor == 512) {
-      if(fat_next_sector(fd)) {
-        (*rerrno) = EIO;
-        return -1;
-      }
-    }
-    if(!(file_num[fd].attributes & FAT_ATT_SUBDIR)) {
-      if(((file_num[fd].cursor + file_num[fd].file_sector * 512)) == file_num[fd].size) {
-        file_num[fd].size++;
-        file_num[fd].flags |= FAT_FLAG_FS_DIRTY;
-      }
+  for(k=0;k<iovcnt;k++) {
+    if(fat_write_span(fd, (const uint8_t *)iov[k].iov_base, iov[k].iov_len)) {
+      (*rerrno) = EIO;
+      return -1;
     }
-    file_num[fd].buffer[file_num[fd].cursor] = *bt++;
-    file_num[fd].cursor++;
-    file_num[fd].flags |= FAT_FLAG_DIRTY;
-    i++;
   }
-  if(i > 0) {
-    fat_update_mtime(fd);
+  if(fat_write_done(fd, count, rerrno)) {
+    return -1;
   }
-  return i;
+  return count;
 }
 
-int fat_fstat(int fd, struct stat *st, int *rerrno) {
-  (*rerrno) = 0;
-  if(fd >= MAX_OPEN_FILES) {
+int fat_writev(int fd, const struct iovec *iov, int iovcnt, int *rerrno) {
+  int r;
+  
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
     (*rerrno) = EBADF;
     return -1;
   }
-  if(!(file_num[fd].flags & FAT_FLAG_OPEN)) {
-    (*rerrno) = EBADF;
+  if(fat_fd_lock(fd, rerrno)) {
     return -1;
   }
+  if(file_num[fd].attributes & FAT_ATT_SUBDIR) {
+    GRISTLE_META_WRLOCK;
+    r = fat_writev_locked(fd, iov, iovcnt, rerrno);
+    GRISTLE_META_UNLOCK;
+  } else {
+    r = fat_writev_locked(fd, iov, iovcnt, rerrno);
+  }
+  fat_fd_unlock(fd);
+  return r;
+}
+
+/* fat_fill_stat - fills in a stat structure from the details loaded into an fd */
+void fat_fill_stat(int fd, struct stat *st) {
   st->st_dev = 0;
   st->st_ino = 0;
   if(file_num[fd].attributes & FAT_ATT_SUBDIR) {
@@ -1513,14 +4448,81 @@ int fat_fstat(int fd, struct stat *st, int *rerrno) {
   st->st_ctime = file_num[fd].created;
   st->st_blksize = 512;
   st->st_blocks = 1;  /* number of blocks allocated for this object */
+}
+
+int fat_fstat_locked(int fd, struct stat *st, int *rerrno) {
+  (*rerrno) = 0;
+  if(fd >= MAX_OPEN_FILES) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(!(file_num[fd].flags & FAT_FLAG_OPEN)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  fat_fill_stat(fd, st);
   return 0; 
 }
 
-int fat_lseek(int fd, int ptr, int dir, int *rerrno) {
+int fat_fstat(int fd, struct stat *st, int *rerrno) {
+  int r;
+  
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  GRISTLE_FD_LOCK(fd);
+  r = fat_fstat_locked(fd, st, rerrno);
+  GRISTLE_FD_UNLOCK(fd);
+  return r;
+}
+
+/*
+ * fat_stat_lookup - resolves a path into FAT_LOOKUP_FD for fat_stat(), fat_unlink() and
+ *                   fat_rmdir(), only the directory entry is read.
+ */
+int fat_stat_lookup(const char *path, int *rerrno) {
+  file_num[FAT_LOOKUP_FD].flags = FAT_FLAG_OPEN;
+  file_num[FAT_LOOKUP_FD].error = 0;
+  if(fat_lookup_path(FAT_LOOKUP_FD, path, rerrno)) {
+    file_num[FAT_LOOKUP_FD].flags = 0;
+    if((*rerrno) == GRISTLE_BAD_PATH) {
+      (*rerrno) = ENOENT;
+    }
+    return -1;
+  }
+  (*rerrno) = 0;
+  return 0;
+}
+
+int fat_stat_locked(const char *path, struct stat *st, int *rerrno) {
+  if(fat_stat_lookup(path, rerrno)) {
+    return -1;
+  }
+  fat_fill_stat(FAT_LOOKUP_FD, st);
+  file_num[FAT_LOOKUP_FD].flags = 0;
+  return 0;
+}
+
+int fat_stat(const char *path, struct stat *st, int *rerrno) {
+  int r;
+  
+  // the lookup fills in the directory cache so needs the write lock
+  GRISTLE_META_WRLOCK;
+  if(fat_buffer_pin(FAT_LOOKUP_FD, rerrno)) {
+    r = -1;
+  } else {
+    r = fat_stat_locked(path, st, rerrno);
+    fat_buffer_unpin(FAT_LOOKUP_FD);
+  }
+  GRISTLE_META_UNLOCK;
+  return r;
+}
+
+int fat_lseek_locked(int fd, int ptr, int dir, int *rerrno) {
   unsigned int new_pos;
   unsigned int old_pos;
   int new_sec;
-  int i;
   int file_cluster;
   (*rerrno) = 0;
 
@@ -1552,19 +4554,25 @@ int fat_lseek(int fd, int ptr, int dir, int *rerrno) {
 //     iprintf("seek beyond file.\r\n");
     return ptr-1; /* tried to seek outside a file */
   }
-  // bodge to deal with case where the cursor has just rolled off the sector but we haven't used
-  // the next sector so it isn't loaded yet
+  // the cursor has just rolled off the sector but the next one isn't loaded yet, the position
+  // is taken as the end of the sector just finished rather than stepping on, which at the end of
+  // the chain would allocate a cluster the file doesn't need.  Whole sectors may have gone
+  // straight to or from the caller's buffer so that sector isn't necessarily in the buffer, case
+  // 1 reloads it before the cursor is moved back into it.
   // has to be done after new_pos is calculated in case it is dependent on the current position
   if(file_num[fd].cursor == 512) {
-    fat_next_sector(fd);
+    old_pos--;
   }
   // optimisation cases
   if((old_pos/512) == (new_pos/512)) {
     // case 1: seeking within a disk block
 //     printf("Case 1\n");
+    if((file_num[fd].cursor == 512) && (fat_window_read(fd, 0))) {
+      return ptr - 1;
+    }
     file_num[fd].cursor = new_pos & 0x1ff;
     return new_pos;
-  } else if((new_pos / (fatfs.sectors_per_cluster * 512)) == (old_pos / (fatfs.sectors_per_cluster * 512))) {
+  } else if((new_pos >> (fatfs.cluster_shift + 9)) == (old_pos >> (fatfs.cluster_shift + 9))) {
     // case 2: seeking within the cluster, just need to hop forward/back some sectors
 //     printf("%d sector: %d, cursor %d, file_sector: %d, first_sector: %d, sec/clus: %d\n", fd, file_num[fd].sector, file_num[fd].cursor, file_num[fd].file_sector, file_num[fd].full_first_cluster * fatfs.sectors_per_cluster + fatfs.cluster0, fatfs.sectors_per_cluster);
 //     printf("Case 2\n");
@@ -1573,62 +4581,287 @@ int fat_lseek(int fd, int ptr, int dir, int *rerrno) {
     file_num[fd].sectors_left = file_num[fd].sectors_left - (new_pos/512) + (old_pos/512);
     file_num[fd].cursor = new_pos & 0x1ff;
 //     printf("%d sector: %d, cursor %d, file_sector: %d, first_sector: %d, sec/clus: %d\n", fd, file_num[fd].sector, file_num[fd].cursor, file_num[fd].file_sector, file_num[fd].full_first_cluster * fatfs.sectors_per_cluster + fatfs.cluster0, fatfs.sectors_per_cluster);
-    if(block_read(file_num[fd].sector, file_num[fd].buffer)) {
+    if(fat_window_read(fd, 0)) {
 //       iprintf("Bad block read.\r\n");
       return ptr - 1;
     }
     return new_pos;
   }
   // otherwise we need to seek the cluster chain
-  file_cluster = new_pos / (fatfs.sectors_per_cluster * 512);
-  
-  file_num[fd].cluster = file_num[fd].full_first_cluster;
-  i = 0;
-  // walk the FAT cluster chain until we get to the right one
-  while(i<file_cluster) {
-    file_num[fd].cluster = fat_next_cluster(fd, rerrno);
-    i++;
+  file_cluster = new_pos >> (fatfs.cluster_shift + 9);
+  if((new_pos > 0) && (new_pos == file_num[fd].size) && (!(file_num[fd].attributes & FAT_ATT_SUBDIR)) &&
+     ((new_pos & ((512 << fatfs.cluster_shift) - 1)) == 0)) {
+    // the end of a file that fills its last cluster, the cluster after it doesn't exist so the
+    // fd is left at the end of the last sector, the same as a cursor that has just rolled off it
+    if(fat_seek_cluster(fd, file_cluster - 1, rerrno)) {
+      return ptr-1;
+    }
+    file_num[fd].file_sector = new_pos / 512 - 1;
+    file_num[fd].cursor = 512;
+    file_num[fd].sector = FAT_CLUSTER_SECTOR(file_num[fd].cluster) + fatfs.sectors_per_cluster - 1;
+    file_num[fd].sectors_left = 0;
+    return new_pos;
+  }
+
+  if(fat_seek_cluster(fd, file_cluster, rerrno)) {
+    return ptr-1;
   }
   file_num[fd].file_sector = new_pos / 512;
   file_num[fd].cursor = new_pos & 0x1ff;
-  new_sec = new_pos - file_cluster * fatfs.sectors_per_cluster * 512;
-  new_sec = new_sec / 512;
-  file_num[fd].sector = file_num[fd].cluster * fatfs.sectors_per_cluster + fatfs.cluster0 + new_sec;
+  new_sec = (new_pos >> 9) - (file_cluster << fatfs.cluster_shift);
+  file_num[fd].sector = FAT_CLUSTER_SECTOR(file_num[fd].cluster) + new_sec;
   file_num[fd].sectors_left = fatfs.sectors_per_cluster - new_sec - 1;
-  if(block_read(file_num[fd].sector, file_num[fd].buffer)) {
+  if(fat_window_read(fd, 0)) {
     return ptr-1;
 //     iprintf("Bad block read 2.\r\n");
   }
-  return new_pos;
+  return new_pos;
+}
+
+int fat_lseek(int fd, int ptr, int dir, int *rerrno) {
+  int r;
+  
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(fat_fd_lock(fd, rerrno)) {
+    return -1;
+  }
+  r = fat_lseek_locked(fd, ptr, dir, rerrno);
+  fat_fd_unlock(fd);
+  return r;
+}
+
+/*
+ * fat_pio_locked - fat_pread() and fat_pwrite() with the fd locked.  The offset is found with
+ * fat_lseek_locked() so it comes from the extent map or the seek checkpoints where it can.
+ * Afterwards the file is put back where it was by restoring the fields that describe its position
+ * rather than seeking, which needs no chain lookup and works at the end of the chain where a seek
+ * of a file open for writing would add a cluster.
+ */
+int fat_pio_locked(int fd, void *buffer, size_t count, int64_t offset, int write, int *rerrno) {
+  uint32_t sector;
+  uint32_t cluster;
+  uint8_t sectors_left;
+  uint16_t cursor;
+  uint32_t file_sector;
+  int r;
+  
+  (*rerrno) = 0;
+  if((~file_num[fd].flags) & (FAT_FLAG_OPEN | (write ? FAT_FLAG_WRITE : FAT_FLAG_READ))) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(file_num[fd].attributes & FAT_ATT_SUBDIR) {
+    (*rerrno) = EISDIR;
+    return -1;
+  }
+  if(offset < 0) {
+    (*rerrno) = EINVAL;
+    return -1;
+  }
+  if(write) {
+    // FAT can't hold a file of 4GB or more
+    if((uint64_t)offset + count > 0xFFFFFFFF) {
+      (*rerrno) = EFBIG;
+      return -1;
+    }
+  } else if((uint64_t)offset >= file_num[fd].size) {
+    return 0;
+  }
+  if(count == 0) {
+    return 0;
+  }
+  
+  sector = file_num[fd].sector;
+  cluster = file_num[fd].cluster;
+  sectors_left = file_num[fd].sectors_left;
+  cursor = file_num[fd].cursor;
+  file_sector = file_num[fd].file_sector;
+  
+#ifndef GRISTLE_RO
+  // a gap between the end of the file and the offset reads as zeros
+  if(((uint64_t)offset > file_num[fd].size) &&
+     (fat_fallocate_locked(fd, 0, file_num[fd].size, offset - file_num[fd].size, rerrno))) {
+    return -1;
+  }
+#endif
+  if((uint32_t)fat_lseek_locked(fd, offset, SEEK_SET, rerrno) != (uint32_t)offset) {
+    if(!(*rerrno)) {
+      (*rerrno) = EIO;
+    }
+    r = -1;
+  } else if(write) {
+    r = fat_write_locked(fd, buffer, count, rerrno);
+  } else {
+    r = fat_read_locked(fd, buffer, count, rerrno);
+  }
+  
+  if(fat_flush(fd)) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+  if(sector == 0) {
+    // the file had no clusters when the call started, it may have now so seek to its start
+    fat_lseek_locked(fd, cursor, SEEK_SET, rerrno);
+  } else {
+    file_num[fd].sector = sector;
+    file_num[fd].cluster = cluster;
+    file_num[fd].sectors_left = sectors_left;
+    file_num[fd].cursor = cursor;
+    file_num[fd].file_sector = file_sector;
+    // when the cursor is at the end of a sector the next access moves on before using the buffer
+    if((cursor < 512) && (fat_window_read(fd, 0))) {
+      (*rerrno) = EIO;
+      return -1;
+    }
+  }
+  return r;
+}
+
+int fat_pread(int fd, void *buffer, size_t count, int64_t offset, int *rerrno) {
+  int r;
+  
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(fat_fd_lock(fd, rerrno)) {
+    return -1;
+  }
+  r = fat_pio_locked(fd, buffer, count, offset, 0, rerrno);
+  fat_fd_unlock(fd);
+  return r;
+}
+
+int fat_pwrite(int fd, const void *buffer, size_t count, int64_t offset, int *rerrno) {
+  int r;
+  
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(fat_fd_lock(fd, rerrno)) {
+    return -1;
+  }
+  r = fat_pio_locked(fd, (void *)buffer, count, offset, 1, rerrno);
+  fat_fd_unlock(fd);
+  return r;
+}
+
+int fat_get_next_dirent_locked(int fd, struct dirent *out_de, int *rerrno) {
+  direntS de;
+  
+  while(1) {
+    if(fat_read(fd, &de, sizeof(direntS), rerrno) < (int)sizeof(direntS)) {
+      // either an error or end of the directory
+//       printf("end of directory, read less than %d bytes.\n", sizeof(direntS));
+      return -1;
+    }
+    if(de.filename[0] == 0) {
+      // end of the directory
+//       printf("End of directory, first byte = 0\n");
+      *rerrno = 0;
+      return -1;
+    }
+    if(!((de.attributes == 0xf) || (de.attributes & FAT_ATT_VOL) || (de.filename[0] == (char)0xe5))) {
+      // not an LFN, volume label or deleted entry
+      fatname_to_str(out_de->d_name, de.filename);
+      
+      if(FAT_TYPE == PART_TYPE_FAT16) {
+        out_de->d_ino = de.first_cluster;
+      } else {
+        out_de->d_ino = de.first_cluster + (de.high_first_cluster << 16);
+      }
+      return 0;
+    }
+  }
+}
+
+int fat_get_next_dirent(int fd, struct dirent *out_de, int *rerrno) {
+  int r;
+  
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(fat_fd_lock(fd, rerrno)) {
+    return -1;
+  }
+  GRISTLE_META_RDLOCK;
+  r = fat_get_next_dirent_locked(fd, out_de, rerrno);
+  GRISTLE_META_UNLOCK;
+  fat_fd_unlock(fd);
+  return r;
+}
+
+int fat_getdents_plus_locked(int fd, direntplusS *buf, int n, int *rerrno) {
+  direntS *de;
+  int count = 0;
+  
+  (*rerrno) = 0;
+  if((~file_num[fd].flags) & (FAT_FLAG_OPEN | FAT_FLAG_READ)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(!(file_num[fd].attributes & FAT_ATT_SUBDIR)) {
+    (*rerrno) = ENOTDIR;
+    return -1;
+  }
+  while(count < n) {
+    if(file_num[fd].cursor == 512) {
+      file_num[fd].error = 0;
+      if(fat_next_sector(fd)) {
+        if(file_num[fd].error != FAT_END_OF_FILE) {
+          (*rerrno) = EIO;
+          return -1;
+        }
+        // a directory that fills its last cluster has no end marker
+        file_num[fd].cursor = 512;
+        break;
+      }
+    }
+    de = (direntS *)&file_num[fd].buffer[file_num[fd].cursor];
+    if(de->filename[0] == 0) {
+      // end of the directory, stay on the marker so later calls find it again
+      break;
+    }
+    file_num[fd].cursor += sizeof(direntS);
+    if((de->attributes == 0xf) || (de->attributes & FAT_ATT_VOL) || (de->filename[0] == (char)0xe5)) {
+      continue;
+    }
+    fatname_to_str(buf[count].name, de->filename);
+    buf[count].attributes = de->attributes;
+    buf[count].size = de->size;
+    buf[count].first_cluster = de->first_cluster;
+    if(FAT_TYPE == PART_TYPE_FAT32) {
+      buf[count].first_cluster += de->high_first_cluster << 16;
+    }
+    buf[count].created = fat_to_unix_date(de->create_date) + fat_to_unix_time(de->create_time) +
+                         de->create_time_fine / 100;
+    buf[count].modified = fat_to_unix_date(de->modified_date) + fat_to_unix_time(de->modified_time);
+    buf[count].accessed = fat_to_unix_date(de->access_date);
+    count++;
+  }
+  return count;
 }
 
-int fat_get_next_dirent(int fd, struct dirent *out_de, int *rerrno) {
-  direntS de;
+int fat_getdents_plus(int fd, direntplusS *buf, int n, int *rerrno) {
+  int r;
   
-  while(1) {
-    if(fat_read(fd, &de, sizeof(direntS), rerrno) < (int)sizeof(direntS)) {
-      // either an error or end of the directory
-//       printf("end of directory, read less than %d bytes.\n", sizeof(direntS));
-      return -1;
-    }
-    if(de.filename[0] == 0) {
-      // end of the directory
-//       printf("End of directory, first byte = 0\n");
-      *rerrno = 0;
-      return -1;
-    }
-    if(!((de.attributes == 0xf) || (de.attributes & FAT_ATT_VOL) || (de.filename[0] == (char)0xe5))) {
-      // not an LFN, volume label or deleted entry
-      fatname_to_str(out_de->d_name, de.filename);
-      
-      if(fatfs.type == PART_TYPE_FAT16) {
-        out_de->d_ino = de.first_cluster;
-      } else {
-        out_de->d_ino = de.first_cluster + (de.high_first_cluster << 16);
-      }
-      return 0;
-    }
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(fat_fd_lock(fd, rerrno)) {
+    return -1;
   }
+  GRISTLE_META_RDLOCK;
+  r = fat_getdents_plus_locked(fd, buf, n, rerrno);
+  GRISTLE_META_UNLOCK;
+  fat_fd_unlock(fd);
+  return r;
 }
 
 /*************************************************************************************************/
@@ -1652,6 +4885,28 @@ int fat_mkdir(const char *path __attribute__((__unused__)), int mode __attribute
     return -1;
 }
 
+int fat_rename(const char *oldpath __attribute__((__unused__)),
+               const char *newpath __attribute__((__unused__)), int *rerrno) {
+    *rerrno = EROFS;
+    return -1;
+}
+
+int fat_fallocate(int fd __attribute__((__unused__)), int mode __attribute__((__unused__)),
+                  uint32_t offset __attribute__((__unused__)),
+                  uint32_t len __attribute__((__unused__)), int *rerrno) {
+    *rerrno = EROFS;
+    return -1;
+}
+
+int fat_copy_file_range(int fd_in __attribute__((__unused__)),
+                        uint32_t off_in __attribute__((__unused__)),
+                        int fd_out __attribute__((__unused__)),
+                        uint32_t off_out __attribute__((__unused__)),
+                        uint32_t len __attribute__((__unused__)), int *rerrno) {
+    *rerrno = EROFS;
+    return -1;
+}
+
 #else
 
 /**
@@ -1660,7 +4915,21 @@ int fat_mkdir(const char *path __attribute__((__unused__)), int mode __attribute
  * Can be used to remove any entry, does no checking for empty directories etc.
  * Should be called on files by unlink() and on empty directories by rmdir()
  **/
-int fat_delete(int fd, int *rerrno __attribute__((__unused__))) {
+int fat_delete_locked(int fd) {
+    char name[11];
+    
+    memcpy(name, file_num[fd].filename, 8);
+    memcpy(name + 8, file_num[fd].extension, 3);
+    fat_dcache_drop(file_num[fd].parent_cluster, name);
+    fat_dir_index_remove(file_num[fd].parent_cluster, name, file_num[fd].entry_sector,
+                         file_num[fd].entry_number);
+    fat_dir_hint_freed(file_num[fd].parent_cluster, file_num[fd].entry_sector,
+                       file_num[fd].entry_number);
+    if(file_num[fd].attributes & FAT_ATT_SUBDIR) {
+      fat_dcache_drop_dir(file_num[fd].full_first_cluster);
+      fat_dir_index_drop(file_num[fd].full_first_cluster);
+      fat_dir_hint_drop(file_num[fd].full_first_cluster);
+    }
     // remove the directory entry
     // in fat this just means setting the first character of the filename to 0xe5
     block_read(file_num[fd].entry_sector, file_num[fd].buffer);
@@ -1673,249 +4942,867 @@ int fat_delete(int fd, int *rerrno __attribute__((__unused__))) {
     return 0;
 }
 
-int fat_unlink(const char *path, int *rerrno) {
-  int fd;
-  struct stat st;
-  // check the file isn't open
+int fat_delete(int fd, int *rerrno) {
+  int r;
+  
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(fat_fd_lock(fd, rerrno)) {
+    return -1;
+  }
+  GRISTLE_META_WRLOCK;
+  r = fat_delete_locked(fd);
+  GRISTLE_META_UNLOCK;
+  fat_fd_unlock(fd);
+  return r;
+}
+
+int fat_unlink_locked(const char *path, int *rerrno) {
+  // find the entry, without opening the file
+  if(fat_stat_lookup(path, rerrno)) {
+    return -1;
+  }
+  
+  if(file_num[FAT_LOOKUP_FD].attributes & FAT_ATT_SUBDIR) {
+      // implementation does not support unlink() on directories, use rmdir instead.
+      // unlink does not free blocks used by files in child directories so creates a "memory leak"
+      // on disk when used on directories.  POSIX standard says in this case we should return
+      // EPERM as errno
+      file_num[FAT_LOOKUP_FD].flags = 0;
+      (*rerrno) = EPERM;
+      return -1;
+  }
+  
+  fat_delete_locked(FAT_LOOKUP_FD);
+  
+  file_num[FAT_LOOKUP_FD].flags = 0;
+  if(fat_mirror_fats()) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+int fat_unlink(const char *path, int *rerrno) {
+  int r;
+  
+  GRISTLE_META_WRLOCK;
+  if(fat_buffer_pin(FAT_LOOKUP_FD, rerrno)) {
+    r = -1;
+  } else {
+    r = fat_unlink_locked(path, rerrno);
+    fat_buffer_unpin(FAT_LOOKUP_FD);
+  }
+  GRISTLE_META_UNLOCK;
+  return r;
+}
+
+/*
+ * fat_dir_empty - checks a directory looked up into fd has nothing in it but . and .., reading
+ *                 it with the fd.  Returns 1 if it's empty, 0 if not or -1 on error.
+ */
+int fat_dir_empty(int fd, int *rerrno) {
+  direntplusS de;
+  int r;
+  
+  fat_extent_start(fd, file_num[fd].full_first_cluster);
+  if(fat_select_cluster(fd, file_num[fd].full_first_cluster)) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+  file_num[fd].flags |= FAT_FLAG_READ;
+  while((r = fat_getdents_plus_locked(fd, &de, 1, rerrno)) > 0) {
+    if(!((strcmp(de.name, ".") == 0) || (strcmp(de.name, "..") == 0))) {
+      return 0;
+    }
+  }
+  if(r < 0) {
+    return -1;
+  }
+  return 1;
+}
+
+int fat_rmdir_locked(const char *path, int *rerrno) {
+  int fd = FAT_LOOKUP_FD;
+  int r;
+  
+  // same as unlink() but needs to check that the directory is empty first
+  if(fat_stat_lookup(path, rerrno)) {
+    return -1;
+  }
+  if(!(file_num[fd].attributes & FAT_ATT_SUBDIR)) {
+    file_num[fd].flags = 0;
+    (*rerrno) = ENOTDIR;
+    return -1;
+  }
+  if(file_num[fd].entry_sector == 0) {
+    // the root directory has no entry to remove
+    file_num[fd].flags = 0;
+    (*rerrno) = EBUSY;
+    return -1;
+  }
+  
+  if((r = fat_dir_empty(fd, rerrno)) != 1) {
+    file_num[fd].flags = 0;
+    if(r == 0) {
+      (*rerrno) = ENOTEMPTY;
+    }
+    return -1;
+  }
+  
+  // no entries found, delete it
+  fat_delete_locked(fd);
+  
+  file_num[fd].flags = 0;
+  if(fat_mirror_fats()) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+int fat_rmdir(const char *path, int *rerrno) {
+  int r;
+  
+  GRISTLE_META_WRLOCK;
+  if(fat_buffer_pin(FAT_LOOKUP_FD, rerrno)) {
+    r = -1;
+  } else {
+    r = fat_rmdir_locked(path, rerrno);
+    fat_buffer_unpin(FAT_LOOKUP_FD);
+  }
+  GRISTLE_META_UNLOCK;
+  return r;
+}
+
+int fat_mkdir_locked(const char *path, int *rerrno) {
+  direntS d;
+  direntS *de;
+  dirindexS *idx;
+  uint32_t cluster;
+  uint32_t parent_cluster;
+  blockno_t sector;
+  int slot;
+  char local_path[MAX_PATH_LEN];
+  char *filename;
+  char dosname[13];
+  char *ptr;
+  int i;
+  
+  // split the path into parent and new directory names
+  if(strlen(path)+1 > MAX_PATH_LEN) {
+    *rerrno = ENAMETOOLONG;
+    return -1;
+  }
+  
+  if(path[0] != '/') {
+    *rerrno = ENAMETOOLONG;
+    return -1;
+  }
+  
+  strcpy(local_path, path);
+  // can't work with a trailing slash even though this is a directory
+  if(local_path[strlen(local_path)-1] == '/') {
+    local_path[strlen(local_path)-1] = 0;
+  }
+  filename = local_path;
+  while((ptr = strstr(filename, "/"))) {
+    filename = ptr + 1;
+  }
+  *(filename - 1) = 0;
+  
+  // allocate a cluster for the new directory
+  cluster = fat_get_free_cluster();
+  if((cluster == 0xFFFFFFFF) || (cluster == 0)) {
+    // not a valid cluster number, can't find one, disc full?
+    *rerrno = ENOSPC;
+    return -1;
+  }
+  
+  if(str_to_fatname(filename, dosname)) {
+    fat_free_clusters(cluster);
+    *rerrno = ENAMETOOLONG;
+//     printf("filename exit\r\n");
+    return -1;
+  }
+  
+  // find the parent directory, without opening it
+  if(fat_stat_lookup((strcmp(local_path, "") == 0) ? "/" : local_path, rerrno)) {
+    fat_free_clusters(cluster);
+    return -1;
+  }
+  if(!(file_num[FAT_LOOKUP_FD].attributes & FAT_ATT_SUBDIR)) {
+    file_num[FAT_LOOKUP_FD].flags = 0;
+    fat_free_clusters(cluster);
+    *rerrno = ENOTDIR;
+    return -1;
+  }
+  parent_cluster = file_num[FAT_LOOKUP_FD].full_first_cluster;
+  
+  // the new directory entry
+  for(i=0;i<8;i++) {
+    if((i < 8) && (i < (int)strlen(dosname))) {
+      d.filename[i] = dosname[i];
+    } else {
+      d.filename[i] = ' ';
+    }
+  }
+  for(i=0;i<3;i++) {
+      d.extension[i] = ' ';
+  }
+  d.attributes = FAT_ATT_SUBDIR | FAT_ATT_ARC;
+  d.reserved = 0x00;
+  d.create_time_fine = (GRISTLE_TIME & 1) * 100;
+  d.create_time = fat_from_unix_time(GRISTLE_TIME);
+  d.create_date = fat_from_unix_date(GRISTLE_TIME);
+  d.access_date = fat_from_unix_date(GRISTLE_TIME);
+  d.high_first_cluster = cluster >> 16;
+  d.modified_time = fat_from_unix_time(GRISTLE_TIME);
+  d.modified_date = fat_from_unix_date(GRISTLE_TIME);
+  d.first_cluster = cluster & 0xffff;
+  d.size = 0;           // directory entries have zero length according to the standard
+  
+  // clear the new directory's cluster and start it with . and .. before anything points to it
+  sector = FAT_CLUSTER_SECTOR(cluster);
+  if(fat_zero_range(sector, fatfs.sectors_per_cluster)) {
+    file_num[FAT_LOOKUP_FD].flags = 0;
+    fat_free_clusters(cluster);
+    *rerrno = EIO;
+    return -1;
+  }
+  memset(file_num[FAT_LOOKUP_FD].buffer, 0, 512);
+  de = (direntS *)file_num[FAT_LOOKUP_FD].buffer;
+  de[0] = d;
+  memcpy(de[0].filename, ".       ", 8);
+  de[1] = d;
+  memcpy(de[1].filename, "..      ", 8);
+  // a parent that's the root directory is given as cluster 0
+  if(parent_cluster == FAT_ROOT_CLUSTER) {
+    de[1].high_first_cluster = 0;
+    de[1].first_cluster = 0;
+  } else {
+    de[1].high_first_cluster = parent_cluster >> 16;
+    de[1].first_cluster = parent_cluster & 0xffff;
+  }
+  if(block_write(sector, file_num[FAT_LOOKUP_FD].buffer)) {
+    file_num[FAT_LOOKUP_FD].flags = 0;
+    fat_free_clusters(cluster);
+    *rerrno = EIO;
+    return -1;
+  }
+  
+  // the first free entry, the directory grows if it's full
+  if((slot = fat_dir_free_slot(FAT_LOOKUP_FD, parent_cluster, rerrno)) < 0) {
+    file_num[FAT_LOOKUP_FD].flags = 0;
+    fat_free_clusters(cluster);
+    return -1;
+  }
+  
+  // a lookup may have cached the name as not existing, and the cluster may have been a directory
+  fat_dcache_drop(parent_cluster, (char *)d.filename);
+  fat_dcache_drop_dir(cluster);
+  fat_dir_index_drop(cluster);
+  fat_dir_hint_drop(cluster);
+  
+//   printf("write new folder\n");
+  memcpy(&file_num[FAT_LOOKUP_FD].buffer[slot * 32], &d, sizeof(d));
+  if(block_write(file_num[FAT_LOOKUP_FD].sector, file_num[FAT_LOOKUP_FD].buffer)) {
+//     printf("write exit\r\n");
+    file_num[FAT_LOOKUP_FD].flags = 0;
+    *rerrno = EIO;
+    return -1;
+  }
+  if((idx = fat_dir_index_find(parent_cluster))) {
+    fat_dir_index_insert(idx, (char *)d.filename, file_num[FAT_LOOKUP_FD].sector, slot);
+  }
+  fat_dir_hint_set(parent_cluster, FAT_LOOKUP_FD, slot + 1);
+  file_num[FAT_LOOKUP_FD].flags = 0;
+  
+  if(fat_mirror_fats()) {
+    *rerrno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+int fat_mkdir(const char *path, int mode __attribute__((__unused__)), int *rerrno) {
+  int r;
+  
+  GRISTLE_META_WRLOCK;
+  if(fat_buffer_pin(FAT_LOOKUP_FD, rerrno)) {
+    r = -1;
+  } else {
+    r = fat_mkdir_locked(path, rerrno);
+    fat_buffer_unpin(FAT_LOOKUP_FD);
+  }
+  GRISTLE_META_UNLOCK;
+  return r;
+}
+
+/*
+ * fat_dir_inside - whether directory dir is the directory starting at cluster or somewhere below
+ *                  it, found by following the .. entries up to the root.  Returns 1 if it is, 0 if
+ *                  not or -1 on error.
+ */
+int fat_dir_inside(int fd, uint32_t dir, uint32_t cluster) {
+  direntS *de;
+  
+  while(dir != FAT_ROOT_CLUSTER) {
+    if(dir == cluster) {
+      return 1;
+    }
+    if(block_read(FAT_CLUSTER_SECTOR(dir), file_num[fd].buffer)) {
+      return -1;
+    }
+    de = (direntS *)file_num[fd].buffer;
+    if(memcmp(de[1].filename, "..      ", 8) != 0) {
+      // not a directory after all, don't go wandering round the disc
+      return -1;
+    }
+    dir = fat_dirent_cluster(&de[1]);
+  }
+  return 0;
+}
+
+/* fat_entry_open - whether any open file descriptor belongs to the entry at sector/entry */
+int fat_entry_open(uint32_t sector, uint8_t entry) {
+  int i;
+  
+  for(i=0;i<MAX_OPEN_FILES;i++) {
+    if((file_num[i].in_use) && (file_num[i].entry_sector == sector) &&
+       (file_num[i].entry_number == entry)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * fat_rename_fds - moves any open file descriptors for the entry at sector/entry on to where it
+ *                  is now, otherwise closing them would write the entry back in its old place.
+ */
+void fat_rename_fds(uint32_t sector, uint8_t entry, uint32_t new_sector, uint8_t new_entry,
+                    uint32_t parent_cluster, const char *name) {
+  int i;
+  
+  for(i=0;i<MAX_OPEN_FILES;i++) {
+    if((file_num[i].in_use) && (file_num[i].entry_sector == sector) &&
+       (file_num[i].entry_number == entry)) {
+      file_num[i].entry_sector = new_sector;
+      file_num[i].entry_number = new_entry;
+      file_num[i].parent_cluster = parent_cluster;
+      memcpy(file_num[i].filename, name, 8);
+      memcpy(file_num[i].extension, name + 8, 3);
+    }
+  }
+}
+
+int fat_rename_locked(const char *oldpath, const char *newpath, int *rerrno) {
+  int fd = FAT_LOOKUP_FD;
+  direntS src;
+  direntS *de;
+  dirindexS *idx;
+  char old_name[11];
+  char new_name[11];
+  uint32_t old_parent;
+  uint32_t old_sector;
+  uint8_t old_entry;
+  uint32_t new_parent;
+  uint32_t new_sector;
+  uint8_t new_entry;
+  uint32_t target_cluster = 0;
+  uint8_t target_attributes = 0;
+  int slot;
+  int r;
   
-  // find the file
-  fd = fat_open(path, O_RDONLY, 0777, rerrno);
-  if(fd < 0) {
+  // the entry being moved
+  if(fat_stat_lookup(oldpath, rerrno)) {
+    return -1;
+  }
+  if(file_num[fd].entry_sector == 0) {
+    // the root directory has no entry to move
+    file_num[fd].flags = 0;
+    (*rerrno) = EBUSY;
+    return -1;
+  }
+  old_sector = file_num[fd].entry_sector;
+  old_entry = file_num[fd].entry_number;
+  old_parent = file_num[fd].parent_cluster;
+  memcpy(&src, &file_num[fd].buffer[old_entry * 32], sizeof(src));
+  memcpy(old_name, src.filename, 11);
+  if(old_name[0] == '.') {
+    file_num[fd].flags = 0;
+    (*rerrno) = EINVAL;
     return -1;
   }
-//   printf("fd.entry_sector = %d\n", file_num[fd].entry_sector);
-//   printf("fd.entry_number = %d\n", file_num[fd].entry_number);
   
-  if(fat_fstat(fd, &st, rerrno)) {
+  // where it's going, a name that doesn't exist yet still leaves its parent and dos name in the fd
+  file_num[fd].flags = FAT_FLAG_OPEN;
+  file_num[fd].error = 0;
+  if(fat_lookup_path(fd, newpath, rerrno) == 0) {
+    if(file_num[fd].entry_sector == 0) {
+      file_num[fd].flags = 0;
+      (*rerrno) = EBUSY;
+      return -1;
+    }
+    if((file_num[fd].entry_sector == old_sector) && (file_num[fd].entry_number == old_entry)) {
+      // both names are the same entry, nothing to do
+      file_num[fd].flags = 0;
+      return 0;
+    }
+    // an existing entry is replaced, as long as it's the same kind and not in use
+    de = (direntS *)&file_num[fd].buffer[file_num[fd].entry_number * 32];
+    target_cluster = de->first_cluster;
+    if(FAT_TYPE != PART_TYPE_FAT16) {
+      target_cluster += de->high_first_cluster << 16;
+    }
+    target_attributes = de->attributes;
+    (*rerrno) = 0;
+    if(file_num[fd].filename[0] == '.') {
+      (*rerrno) = EINVAL;
+    } else if((src.attributes & FAT_ATT_SUBDIR) && (!(target_attributes & FAT_ATT_SUBDIR))) {
+      (*rerrno) = ENOTDIR;
+    } else if((!(src.attributes & FAT_ATT_SUBDIR)) && (target_attributes & FAT_ATT_SUBDIR)) {
+      (*rerrno) = EISDIR;
+    } else if(fat_entry_open(file_num[fd].entry_sector, file_num[fd].entry_number)) {
+      (*rerrno) = EBUSY;
+    } else if((target_attributes & FAT_ATT_SUBDIR) && ((r = fat_dir_empty(fd, rerrno)) != 1)) {
+      if(r == 0) {
+        (*rerrno) = ENOTEMPTY;
+      }
+    }
+    if(*rerrno) {
+      file_num[fd].flags = 0;
       return -1;
+    }
+  } else if((*rerrno) != ENOENT) {
+    file_num[fd].flags = 0;
+    if((*rerrno) == GRISTLE_BAD_PATH) {
+      (*rerrno) = ENOENT;
+    }
+    return -1;
+  } else {
+    file_num[fd].entry_sector = 0;
   }
-  
-  if(st.st_mode & S_IFDIR) {
-      // implementation does not support unlink() on directories, use rmdir instead.
-      // unlink does not free blocks used by files in child directories so creates a "memory leak"
-      // on disk when used on directories.  POSIX standard says in this case we should return
-      // EPERM as errno
-      file_num[fd].flags = FAT_FLAG_OPEN;   // make sure atime isn't affected
-      fat_close(fd, rerrno);
-      (*rerrno) = EPERM;
+  (*rerrno) = 0;
+  new_parent = file_num[fd].parent_cluster;
+  new_sector = file_num[fd].entry_sector;
+  new_entry = file_num[fd].entry_number;
+  memcpy(new_name, file_num[fd].filename, 8);
+  memcpy(new_name + 8, file_num[fd].extension, 3);
+  if(new_name[0] == '.') {
+    file_num[fd].flags = 0;
+    (*rerrno) = EINVAL;
+    return -1;
+  }
+  // a directory can't be moved inside itself
+  if((src.attributes & FAT_ATT_SUBDIR) && (new_parent != old_parent)) {
+    if((r = fat_dir_inside(fd, new_parent, fat_dirent_cluster(&src))) != 0) {
+      file_num[fd].flags = 0;
+      (*rerrno) = (r < 0) ? EIO : EINVAL;
       return -1;
+    }
   }
   
-  fat_delete(fd, rerrno);
-  
-  fat_close(fd, rerrno);
-  return 0;
-}
-
-int fat_rmdir(const char *path, int *rerrno) {
-  struct dirent de;
-  int f_dir;
-  int i;
+  memcpy(src.filename, new_name, 8);
+  memcpy(src.extension, new_name + 8, 3);
+  if(new_sector == 0) {
+    if(new_parent == old_parent) {
+      // a new name in the same directory, the entry stays where it is
+      new_sector = old_sector;
+      new_entry = old_entry;
+      if(block_read(new_sector, file_num[fd].buffer)) {
+        file_num[fd].flags = 0;
+        (*rerrno) = EIO;
+        return -1;
+      }
+    } else {
+      // the first free entry in the new directory, it grows if it's full
+      if((slot = fat_dir_free_slot(fd, new_parent, rerrno)) < 0) {
+        file_num[fd].flags = 0;
+        return -1;
+      }
+      new_sector = file_num[fd].sector;
+      new_entry = slot;
+      fat_dir_hint_set(new_parent, fd, slot + 1);
+    }
+    if((idx = fat_dir_index_find(new_parent))) {
+      fat_dir_index_insert(idx, new_name, new_sector, new_entry);
+    }
+  } else if(block_read(new_sector, file_num[fd].buffer)) {
+    file_num[fd].flags = 0;
+    (*rerrno) = EIO;
+    return -1;
+  }
   
-  // same as unlink() but needs to check that the directory is empty first
-  if((f_dir = fat_open(path, O_RDONLY, 0777, rerrno)) == -1) {
+  // the new entry goes in first, a crash part way leaves two names for the data rather than none
+  memcpy(&file_num[fd].buffer[new_entry * 32], &src, sizeof(src));
+  if(block_write(new_sector, file_num[fd].buffer)) {
+    file_num[fd].flags = 0;
+    (*rerrno) = EIO;
     return -1;
   }
+  fat_dcache_drop(old_parent, old_name);
+  fat_dir_index_remove(old_parent, old_name, old_sector, old_entry);
+  fat_dcache_add(new_parent, new_name, new_sector, new_entry, fat_dirent_cluster(&src),
+                 src.attributes);
+  if((new_sector != old_sector) || (new_entry != old_entry)) {
+    fat_dir_hint_freed(old_parent, old_sector, old_entry);
+    if(block_read(old_sector, file_num[fd].buffer)) {
+      file_num[fd].flags = 0;
+      (*rerrno) = EIO;
+      return -1;
+    }
+    file_num[fd].buffer[old_entry * 32] = 0xe5;
+    if(block_write(old_sector, file_num[fd].buffer)) {
+      file_num[fd].flags = 0;
+      (*rerrno) = EIO;
+      return -1;
+    }
+  }
+  fat_rename_fds(old_sector, old_entry, new_sector, new_entry, new_parent, new_name);
   
-  while(!(fat_get_next_dirent(f_dir, &de, rerrno))) {
-    if(!((strcmp(de.d_name, ".") == 0) || (strcmp(de.d_name, "..") == 0))) {
-      printf("Found an entry :( %s [", de.d_name);
-      for(i=0;i<8;i++) {
-        printf("%02X ", *(uint8_t *)&de.d_name[i]);
-      }
-      printf("] (name[0] == 0xE5: %d) %c %02X\n", de.d_name[0] == (char)0xE5, de.d_name[0], de.d_name[0]);
-      fat_close(f_dir, rerrno);
-      *rerrno = ENOTEMPTY;
+  // a directory that's changed parent has to have its .. entry pointed at the new one
+  if((src.attributes & FAT_ATT_SUBDIR) && (new_parent != old_parent)) {
+    fat_dcache_drop(fat_dirent_cluster(&src), "..         ");
+    new_sector = FAT_CLUSTER_SECTOR(fat_dirent_cluster(&src));
+    if(block_read(new_sector, file_num[fd].buffer)) {
+      file_num[fd].flags = 0;
+      (*rerrno) = EIO;
+      return -1;
+    }
+    de = (direntS *)file_num[fd].buffer;
+    if(new_parent == FAT_ROOT_CLUSTER) {
+      de[1].high_first_cluster = 0;
+      de[1].first_cluster = 0;
+    } else {
+      de[1].high_first_cluster = new_parent >> 16;
+      de[1].first_cluster = new_parent & 0xffff;
+    }
+    if(block_write(new_sector, file_num[fd].buffer)) {
+      file_num[fd].flags = 0;
+      (*rerrno) = EIO;
       return -1;
     }
   }
+  file_num[fd].flags = 0;
   
-  fat_delete(f_dir, rerrno);
+  // last of all the data of a replaced entry is freed
+  if(target_attributes & FAT_ATT_SUBDIR) {
+    fat_dcache_drop_dir(target_cluster);
+    fat_dir_index_drop(target_cluster);
+    fat_dir_hint_drop(target_cluster);
+  }
+  if(target_cluster >= 2) {
+    fat_free_clusters(target_cluster);
+    if(fat_mirror_fats()) {
+      (*rerrno) = EIO;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int fat_rename(const char *oldpath, const char *newpath, int *rerrno) {
+  int r;
   
-  if(fat_close(f_dir, rerrno)) {
-    return -1;
+  GRISTLE_META_WRLOCK;
+  if(fat_buffer_pin(FAT_LOOKUP_FD, rerrno)) {
+    r = -1;
+  } else {
+    r = fat_rename_locked(oldpath, newpath, rerrno);
+    fat_buffer_unpin(FAT_LOOKUP_FD);
   }
-  // no entries found, delete it
-  return 0;//fat_unlink(path, rerrno);
+  GRISTLE_META_UNLOCK;
+  return r;
 }
 
-int fat_mkdir(const char *path, int mode __attribute__((__unused__)), int *rerrno) {
-  direntS d;
-  uint32_t cluster;
-  uint32_t parent_cluster;
-  int f_dir;
-  char local_path[MAX_PATH_LEN];
-  char *filename;
-  char dosname[13];
-  char *ptr;
-  int i;
-  int int_call = FAT_INTERNAL_CALL;
+int fat_fallocate_locked(int fd, int mode, uint32_t offset, uint32_t len, int *rerrno) {
+  uint32_t cluster_size = fatfs.sectors_per_cluster * 512;
+  uint32_t clusters;
+  uint32_t last;
+  uint32_t next;
+  uint32_t first;
+  uint32_t pos;
+  uint32_t n;
+  blockno_t current_block = MAX_BLOCK;
+  int dirty = 0;
+  uint8_t *e;
+  extentS *ext;
   
-  // split the path into parent and new directory names
-  if(strlen(path)+1 > MAX_PATH_LEN) {
-    *rerrno = ENAMETOOLONG;
+  (*rerrno) = 0;
+  if(fd >= MAX_OPEN_FILES) {
+    (*rerrno) = EBADF;
     return -1;
   }
-  
-  if(path[0] != '/') {
-    *rerrno = ENAMETOOLONG;
+  if((~file_num[fd].flags) & (FAT_FLAG_OPEN | FAT_FLAG_WRITE)) {
+    (*rerrno) = EBADF;
     return -1;
   }
-  
-  strcpy(local_path, path);
-  // can't work with a trailing slash even though this is a directory
-  if(local_path[strlen(local_path)-1] == '/') {
-    local_path[strlen(local_path)-1] = 0;
+  if(file_num[fd].attributes & FAT_ATT_SUBDIR) {
+    (*rerrno) = EISDIR;
+    return -1;
   }
-  filename = local_path;
-  while((ptr = strstr(filename, "/"))) {
-    filename = ptr + 1;
+  if((len == 0) || (offset + len < offset) || (mode & ~FAT_FALLOC_KEEP_SIZE)) {
+    (*rerrno) = EINVAL;
+    return -1;
   }
-  *(filename - 1) = 0;
-  
-  // allocate a cluster for the new directory
-  cluster = fat_get_free_cluster();
-  if((cluster == 0xFFFFFFF) || (cluster == 0)) {
-    // not a valid cluster number, can't find one, disc full?
-    *rerrno = ENOSPC;
+  /* get any data waiting in the buffer onto the disc, this gives a new file its first cluster */
+  if(fat_flush(fd)) {
+    (*rerrno) = EIO;
     return -1;
   }
   
-  // open the parent directory
-  if(strcmp(local_path, "") == 0) {
-    f_dir = fat_open("/", O_RDWR, 0777, &int_call);
-  } else {
-    f_dir = fat_open(local_path, O_RDWR, 0777, &int_call);
+  /* find the end of the existing chain, the extent map gives a head start */
+  clusters = 0;
+  last = 0;
+  if(file_num[fd].full_first_cluster != 0) {
+    if(file_num[fd].num_extents == 0) {
+      fat_extent_start(fd, file_num[fd].full_first_cluster);
+    }
+    ext = &file_num[fd].extents[file_num[fd].num_extents - 1];
+    clusters = ext->file_cluster + ext->length;
+    last = ext->disk_cluster + ext->length - 1;
+    /* linking new clusters after anything but the real end would cut off the rest of the chain */
+    if(!GRISTLE_SYSLOCK) {
+      (*rerrno) = EBUSY;
+      return -1;
+    }
+    while(1) {
+      if((e = fat_fat_entry(last, &current_block, &dirty)) == NULL) {
+        GRISTLE_SYSUNLOCK;
+        (*rerrno) = EIO;
+        return -1;
+      }
+      next = fat_entry_value(e);
+      if((next < 2) || (next >= FAT_END_CLUSTER)) {
+        break;
+      }
+      fat_extent_add(fd, last, next);
+      last = next;
+      clusters++;
+    }
+    GRISTLE_SYSUNLOCK;
   }
-  if(f_dir < 0) {
-    *rerrno = int_call;
-    fat_free_clusters(cluster);
-    return -1;
+  
+  n = (offset + len + cluster_size - 1) / cluster_size;
+  if((mode & FAT_FALLOC_KEEP_SIZE) && (file_num[fd].reserve_from == 0)) {
+    /* clusters past the end of the file are treated like a reservation, kept while it's open and
+     * freed by fat_close() if the file hasn't grown into them, other drivers and fsck would take
+     * a chain longer than the file for damage */
+    file_num[fd].reserve_from = (file_num[fd].size + cluster_size - 1) / cluster_size;
+    if(file_num[fd].reserve_from == 0) {
+      file_num[fd].reserve_from = 1;
+    }
+  }
+  if(n > clusters) {
+    first = fat_alloc_chain(last, n - clusters);
+    if(first == 0) {
+      (*rerrno) = ENOSPC;
+      return -1;
+    } else if(first == 0xFFFFFFFF) {
+      (*rerrno) = EIO;
+      return -1;
+    }
+    /* the new clusters are all known so record them in the extent map now */
+    if(last == 0) {
+      // the file had no clusters at all, point it at the new chain
+      file_num[fd].full_first_cluster = first;
+      fat_extent_start(fd, first);
+      fat_set_cluster(fd, first);
+      file_num[fd].file_sector = 0;
+      file_num[fd].flags |= FAT_FLAG_FS_DIRTY;
+      last = first;
+      clusters++;
+    }
+    if(!GRISTLE_SYSLOCK) {
+      (*rerrno) = EBUSY;
+      return -1;
+    }
+    current_block = MAX_BLOCK;
+    dirty = 0;
+    while(clusters < n) {
+      if((e = fat_fat_entry(last, &current_block, &dirty)) == NULL) {
+        GRISTLE_SYSUNLOCK;
+        (*rerrno) = EIO;
+        return -1;
+      }
+      next = fat_entry_value(e);
+      fat_extent_add(fd, last, next);
+      last = next;
+      clusters++;
+    }
+    GRISTLE_SYSUNLOCK;
   }
-//   printf("mkdir, int_call = %d\r\n", int_call);
-  parent_cluster = file_num[f_dir].full_first_cluster;
-//   printf("parent_cluster = %d\n", parent_cluster);
   
-  // seek to the end of the directory
-  do {
-    if(fat_read(f_dir, &d, sizeof(d), rerrno) < (int)sizeof(d)) {
-      fat_close(f_dir, rerrno);
-      fat_free_clusters(cluster);
-//       printf("read1 exit\r\n");
+  if((!(mode & FAT_FALLOC_KEEP_SIZE)) && (offset + len > file_num[fd].size)) {
+    /* grow the file by writing zeros into the new space, no allocation needed now */
+    pos = file_num[fd].file_sector * 512 + file_num[fd].cursor;
+    if(fat_lseek_locked(fd, 0, SEEK_END, rerrno) != (int)file_num[fd].size) {
+      (*rerrno) = EIO;
       return -1;
     }
-  } while(d.filename[0] != 0);
+    while(file_num[fd].size < offset + len) {
+      n = offset + len - file_num[fd].size;
+      if((file_num[fd].cursor == 512) && (n >= 512)) {
+        /* whole sectors are cleared straight on the disc, a contiguous run at a time */
+        if((n = fat_zero_sectors(fd, n / 512)) == 0) {
+          (*rerrno) = EIO;
+          return -1;
+        }
+        file_num[fd].size += n * 512;
+        fat_update_mtime(fd);
+        continue;
+      }
+      /* the rest of the sector the file ends in goes through the buffer */
+      if((file_num[fd].cursor < 512) && (n > 512 - (uint32_t)file_num[fd].cursor)) {
+        n = 512 - file_num[fd].cursor;
+      }
+      if(fat_write_locked(fd, fat_zero_buf, n, rerrno) != (int)n) {
+        return -1;
+      }
+    }
+    fat_lseek_locked(fd, pos, SEEK_SET, rerrno);
+  }
+  return 0;
+}
+
+int fat_fallocate(int fd, int mode, uint32_t offset, uint32_t len, int *rerrno) {
+  int r;
   
-  // just read the first empty directory entry so we need to seek back to overwrite it
-  if(fat_lseek(f_dir, -32, SEEK_CUR, rerrno) == -33) {
-    fat_close(f_dir, rerrno);
-    fat_free_clusters(cluster);
-//     printf("lseek exit\r\n");
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(fat_fd_lock(fd, rerrno)) {
     return -1;
   }
+  r = fat_fallocate_locked(fd, mode, offset, len, rerrno);
+  fat_fd_unlock(fd);
+  return r;
+}
+
+/*
+ * fat_copy_file_range_locked - copies with both fds locked.  The data goes a cluster at a time
+ * through sectors borrowed from the pool, or through a buffer on the stack GRISTLE_COPY_SECTORS
+ * long when the pool can't spare more than that.  Once the two offsets are at the start of a
+ * sector fat_read() and fat_write() move it as whole runs of sectors straight to and from the
+ * disc.
+ */
+int fat_copy_file_range_locked(int fd_in, uint32_t off_in, int fd_out, uint32_t off_out,
+                               uint32_t len, int *rerrno) {
+  uint8_t stack_buf[GRISTLE_COPY_SECTORS * 512];
+  uint8_t *buf;
+  uint32_t sectors;
+  uint32_t pos_in;
+  uint32_t pos_out;
+  uint32_t done = 0;
+  uint32_t n;
+  int r;
   
-  if(str_to_fatname(filename, dosname)) {
-    fat_free_clusters(cluster);
-    fat_close(f_dir, rerrno);
-    *rerrno = ENAMETOOLONG;
-//     printf("filename exit\r\n");
+  (*rerrno) = 0;
+  if((fd_in >= MAX_OPEN_FILES) || (fd_out >= MAX_OPEN_FILES) ||
+     ((~file_num[fd_in].flags) & (FAT_FLAG_OPEN | FAT_FLAG_READ)) ||
+     ((~file_num[fd_out].flags) & (FAT_FLAG_OPEN | FAT_FLAG_WRITE)) ||
+     (file_num[fd_out].flags & FAT_FLAG_APPEND)) {
+    (*rerrno) = EBADF;
     return -1;
   }
-  // write a new directory entry
-  for(i=0;i<8;i++) {
-    if((i < 8) && (i < (int)strlen(dosname))) {
-      d.filename[i] = dosname[i];
-    } else {
-      d.filename[i] = ' ';
-    }
+  if((file_num[fd_in].attributes | file_num[fd_out].attributes) & FAT_ATT_SUBDIR) {
+    (*rerrno) = EISDIR;
+    return -1;
   }
-  for(i=0;i<3;i++) {
-      d.extension[i] = ' ';
+  // the two fds would each have their own idea of the size and the current sector
+  if((fd_in == fd_out) || ((file_num[fd_in].entry_sector) &&
+     (file_num[fd_in].entry_sector == file_num[fd_out].entry_sector) &&
+     (file_num[fd_in].entry_number == file_num[fd_out].entry_number))) {
+    (*rerrno) = EINVAL;
+    return -1;
   }
-  d.attributes = FAT_ATT_SUBDIR | FAT_ATT_ARC;
-  d.reserved = 0x00;
-  d.create_time_fine = (GRISTLE_TIME & 1) * 100;
-  d.create_time = fat_from_unix_time(GRISTLE_TIME);
-  d.create_date = fat_from_unix_date(GRISTLE_TIME);
-  d.access_date = fat_from_unix_date(GRISTLE_TIME);
-  d.high_first_cluster = cluster >> 16;
-  d.modified_time = fat_from_unix_time(GRISTLE_TIME);
-  d.modified_date = fat_from_unix_date(GRISTLE_TIME);
-  d.first_cluster = cluster & 0xffff;
-  d.size = 0;
-  
-//   printf("write new folder\n");
-  if(fat_write(f_dir, &d, sizeof(d), rerrno) == -1) {
-//     printf("write exit\r\n");
+  if(off_in >= file_num[fd_in].size) {
+    return 0;
+  }
+  if(len > file_num[fd_in].size - off_in) {
+    len = file_num[fd_in].size - off_in;
+  }
+  if(len == 0) {
+    return 0;
+  }
+  if(off_out + len < off_out) {
+    (*rerrno) = EFBIG;
     return -1;
   }
   
-  memset(&d, 0, sizeof(d));
-  
-//   printf("here\n");
-  if(fat_write(f_dir, &d, sizeof(d), rerrno) == -1) {
-//     printf("write 2 exit\r\n");
+  /* a gap before off_out is filled with zeros, then the whole destination range is allocated
+   * in one go so the copy doesn't stop to look for free clusters */
+  if((off_out > file_num[fd_out].size) &&
+     (fat_fallocate_locked(fd_out, 0, file_num[fd_out].size, off_out - file_num[fd_out].size,
+                           rerrno))) {
     return -1;
   }
-  
-  if(fat_close(f_dir, rerrno)) {
-//     printf("close exit\r\n");
+  if(fat_fallocate_locked(fd_out, FAT_FALLOC_KEEP_SIZE, off_out, len, rerrno)) {
     return -1;
   }
   
-  // create . and .. entries in the new directory cluster and an end of directory entry
-  if((f_dir = fat_open(path, O_RDWR, 0777, &int_call)) == -1) {
-    *rerrno = int_call;
-//     printf("open exit\r\n");
+  pos_in = file_num[fd_in].file_sector * 512 + file_num[fd_in].cursor;
+  pos_out = file_num[fd_out].file_sector * 512 + file_num[fd_out].cursor;
+  if((fat_lseek_locked(fd_in, off_in, SEEK_SET, rerrno) != (int)off_in) ||
+     (fat_lseek_locked(fd_out, off_out, SEEK_SET, rerrno) != (int)off_out)) {
+    (*rerrno) = EIO;
     return -1;
   }
-  
-  d.filename[0] = '.';
-  for(i=1;i<8;i++) {
-    d.filename[i] = ' ';
+  /* a cluster is the most a single transfer can move, too much to put on the stack */
+  if((buf = fat_pool_lend(GRISTLE_COPY_SECTORS + 1, &sectors)) == NULL) {
+    buf = stack_buf;
+    sectors = GRISTLE_COPY_SECTORS;
   }
-  for(i=0;i<3;i++) {
-    d.extension[i] = ' ';
+  while(done < len) {
+    // the first piece takes the source to the start of a sector
+    n = 512 - ((off_in + done) & 511) + (sectors - 1) * 512;
+    if(n > len - done) {
+      n = len - done;
+    }
+    if((r = fat_read_locked(fd_in, buf, n, rerrno)) <= 0) {
+      break;
+    }
+    if(fat_write_locked(fd_out, buf, r, rerrno) != r) {
+      break;
+    }
+    done += r;
   }
-  d.attributes = FAT_ATT_SUBDIR | FAT_ATT_ARC;
-  d.reserved = 0x00;
-  d.create_time_fine = (GRISTLE_TIME & 1) * 100;
-  d.create_time = fat_from_unix_time(GRISTLE_TIME);
-  d.create_date = fat_from_unix_date(GRISTLE_TIME);
-  d.access_date = fat_from_unix_date(GRISTLE_TIME);
-  d.high_first_cluster = cluster >> 16;
-  d.modified_time = fat_from_unix_time(GRISTLE_TIME);
-  d.modified_date = fat_from_unix_date(GRISTLE_TIME);
-  d.first_cluster = cluster & 0xffff;
-  d.size = 0;           // directory entries have zero length according to the standard
-  
-  if((fat_write(f_dir, &d, sizeof(direntS), rerrno)) == -1) {
-//     printf("write 3 exit\r\n");
+  if(buf != stack_buf) {
+    fat_pool_give_back(buf, sectors);
+  }
+  fat_lseek_locked(fd_in, pos_in, SEEK_SET, &r);
+  fat_lseek_locked(fd_out, pos_out, SEEK_SET, &r);
+  if((done == 0) && (*rerrno)) {
     return -1;
   }
+  return done;
+}
+
+int fat_copy_file_range(int fd_in, uint32_t off_in, int fd_out, uint32_t off_out, uint32_t len,
+                        int *rerrno) {
+  int r;
   
-  d.filename[1] = '.';
-  d.high_first_cluster = parent_cluster >> 16;
-  d.first_cluster = parent_cluster & 0xffff;
-  
-  if((fat_write(f_dir, &d, sizeof(direntS), rerrno)) == -1) {
-//     printf("write 4 exit\r\n");
+  if((fd_in < 0) || (fd_in >= MAX_OPEN_FILES) || (fd_out < 0) || (fd_out >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
     return -1;
   }
-  
-  memset(&d, 0, sizeof(direntS));
-  
-  for(i=0;i<(int)((block_get_block_size() * fatfs.sectors_per_cluster) / sizeof(direntS)) - 2;i++) {
-    if((fat_write(f_dir, &d, sizeof(direntS), rerrno)) == -1) {
-//       printf("write 5 exit\r\n");
-      return -1;
-    }
+  // the fd locks are always taken lowest first so two copies the opposite way can't deadlock
+  if(fat_fd_lock((fd_in < fd_out) ? fd_in : fd_out, rerrno)) {
+    return -1;
   }
-  if(fat_close(f_dir, rerrno)) {
-//     printf("close 2 exit\r\n");
+  if(fat_fd_lock((fd_in < fd_out) ? fd_out : fd_in, rerrno)) {
+    fat_fd_unlock((fd_in < fd_out) ? fd_in : fd_out);
     return -1;
   }
-  
-  return 0;
+  r = fat_copy_file_range_locked(fd_in, off_in, fd_out, off_out, len, rerrno);
+  fat_fd_unlock((fd_in < fd_out) ? fd_out : fd_in);
+  fat_fd_unlock((fd_in < fd_out) ? fd_in : fd_out);
+  return r;
 }
+
 #endif /* ifdef GRISTLE_RO */
@@ -31,14 +31,38 @@
 
 #include <stdint.h>
 #include <sys/stat.h>
+#include "uio.h"
 #include <time.h>
 #include "block.h"
 #include "dirent.h"
+/* the sizes below set the layout of FileS and dirindexS, every file using them has to see the
+ * same configuration as gristle.c */
+#include "config.h"
 
 #define GRISTLE_BAD_PATH 255
 
 #define MAX_OPEN_FILES 4
 #define MAX_PATH_LEN 256
+#define MAX_FILE_EXTENTS 8
+
+/* hashed directory index, GRISTLE_DIR_INDEX_DIRS directories of up to 3/4 of
+ * GRISTLE_DIR_INDEX_SIZE (a power of 2) entries each, 0 directories disables it */
+#ifndef GRISTLE_DIR_INDEX_DIRS
+#define GRISTLE_DIR_INDEX_DIRS 0
+#endif
+#ifndef GRISTLE_DIR_INDEX_SIZE
+#define GRISTLE_DIR_INDEX_SIZE 1024
+#endif
+
+/* seek checkpoints, each open file remembers the disk cluster at every 2^k-th cluster of the file
+ * in GRISTLE_CHECKPOINTS slots, k starting at GRISTLE_CHECKPOINT_SHIFT and going up as the file
+ * outgrows them.  0 slots disables them */
+#ifndef GRISTLE_CHECKPOINTS
+#define GRISTLE_CHECKPOINTS 16
+#endif
+#ifndef GRISTLE_CHECKPOINT_SHIFT
+#define GRISTLE_CHECKPOINT_SHIFT 4
+#endif
 
 #define FAT_ERROR_CLUSTER 1
 #define FAT_END_OF_FILE 2
@@ -57,15 +81,23 @@ struct fat_info {
   uint8_t   fat_entry_len;
   uint32_t  end_cluster_marker;
   uint8_t   sectors_per_cluster;
+  uint8_t   cluster_shift;      // log2 of sectors_per_cluster
   uint32_t  cluster0;
   uint32_t  active_fat_start;
   uint32_t  sectors_per_fat;
+  uint8_t   num_fats;           // number of copies of the FAT kept in step
+  uint32_t  fat_dirty_first;    // range of active FAT sectors not yet copied to the others
+  uint32_t  fat_dirty_last;
+  uint32_t  writeback_clusters; // metadata writeback policy, see fat_set_writeback()
+  uint32_t  writeback_seconds;
+  uint32_t  reserve_clusters;   // clusters reserved ahead of a growing file, see fat_set_reserve()
   uint32_t  root_len;
   uint32_t  root_start;
   uint32_t  root_cluster;
   uint8_t   type;               // type of filesystem (FAT16 or FAT32)
   blockno_t part_start;         // start of partition containing filesystem
   uint32_t  total_sectors;
+  uint32_t  max_cluster;        // highest cluster number that exists in the data area
   uint8_t   sysbuf[512];
 };
 
@@ -144,9 +176,22 @@ typedef struct {
   uint32_t  size;
 } __attribute__((__packed__)) direntS;
 
+/**
+ * \brief A run of clusters that are consecutive both in the file and on the disk.
+ *
+ * Each open file keeps a short list of these, built up as the cluster chain is followed, so that
+ * a seek can find the disk cluster for any file offset already visited without reading the FAT.
+ **/
+typedef struct {
+  uint32_t  file_cluster;       // index of the first cluster of the run within the file
+  uint32_t  disk_cluster;       // cluster number of the first cluster of the run on disk
+  uint32_t  length;             // number of clusters in the run
+} extentS;
+
 typedef struct {
   uint8_t   flags;
-  uint8_t   buffer[512];
+  uint8_t   in_use;             // slot taken by fat_open() until fat_close() gives it back
+  uint8_t   *buffer;            // the current sector, from the buffer pool, NULL while it has none
   uint32_t  sector;
   uint32_t  cluster;
   uint8_t   sectors_left;
@@ -164,8 +209,93 @@ typedef struct {
   time_t    created;
   time_t    modified;
   time_t    accessed;
+  uint8_t   num_extents;
+  extentS   extents[MAX_FILE_EXTENTS];
+  uint32_t  clusters_added;     // clusters added since the directory entry was last written
+  time_t    info_flushed;       // when the directory entry was last written
+  uint32_t  reserve_from;       // clusters in use before the reserved ones start, 0 if none
+  uint8_t   window_size;        // sectors the file's buffer window can hold, see fat_set_buffer()
+  uint8_t   window_len;         // sectors in the window now, starting at window_sector
+  uint8_t   window_dirty;       // the whole window has to be written back
+  uint32_t  window_sector;
+  uint32_t  window_gen;         // data write count when the window was read
+  uint8_t   *window;            // window_size sectors of the buffer pool, NULL until it's used
+  uint8_t   pins;               // calls using the file, its buffers aren't taken while there are any
+  uint32_t  buffer_used;        // LRU stamp, when the file was last pinned
+  uint32_t  chain_index;        // the last cluster of the file's chain passed through and its
+  uint32_t  chain_cluster;      // index within the file, so links after it can be checkpointed
+  uint8_t   checkpoint_shift;   // checkpoints are every 2^checkpoint_shift clusters
+  // disk cluster of file cluster (i + 1) << checkpoint_shift in slot i, 0 if not known yet
+  uint32_t  checkpoints[GRISTLE_CHECKPOINTS ? GRISTLE_CHECKPOINTS : 1];
 } FileS;
 
+/**
+ * \brief An entry in the cache of names looked up in directories, see fat_lookup_path().
+ **/
+typedef struct {
+  uint32_t  parent_cluster;     // first cluster of the directory holding the name
+  char      name[11];           // the name in directory entry format
+  uint8_t   attributes;
+  uint8_t   entry_number;       // position of the entry within its sector
+  uint32_t  entry_sector;       // sector holding the entry, 0 if the name doesn't exist
+  uint32_t  first_cluster;
+  uint32_t  last_used;          // LRU stamp, 0 marks an unused slot
+} dcacheS;
+
+/**
+ * \brief Where to start looking for a free entry in a directory, see fat_dir_free_slot().
+ **/
+typedef struct {
+  uint32_t  cluster;            // first cluster of the directory
+  uint32_t  sector;             // no entry before this one in the directory is free
+  uint32_t  sector_cluster;     // cluster holding sector
+  uint8_t   sectors_left;       // sectors after it in the cluster
+  uint8_t   entry;              // entry within sector, 16 means the start of the following sector
+  uint32_t  last_used;          // LRU stamp, 0 marks an unused slot
+} dirhintS;
+
+/**
+ * \brief A directory entry and its details as returned by fat_getdents_plus().
+ **/
+typedef struct {
+  char      name[13];           // 8.3 name as a string
+  uint8_t   attributes;
+  uint32_t  size;
+  uint32_t  first_cluster;
+  time_t    created;
+  time_t    modified;
+  time_t    accessed;           // midnight of the last access date
+} direntplusS;
+
+/**
+ * \brief Volume usage returned by fat_statfs().
+ **/
+typedef struct {
+  uint32_t  cluster_size;       // bytes per cluster
+  uint32_t  clusters;           // clusters in the data area
+  uint32_t  free_clusters;
+} fatstatS;
+
+/**
+ * \brief One slot in a directory index hash table.
+ **/
+typedef struct {
+  uint16_t  hash;               // hash of the entry name, 0 marks an empty slot
+  uint8_t   entry_number;
+  uint32_t  entry_sector;       // 0 once the entry has been deleted
+} dirslotS;
+
+/**
+ * \brief Hash index of every entry in one directory.
+ **/
+typedef struct {
+  uint32_t  cluster;            // first cluster of the directory, 0 if the index is unused
+  uint32_t  last_used;
+  uint16_t  used;               // slots taken including deleted entries
+  uint8_t   full;               // directory has too many entries to index
+  dirslotS  slots[GRISTLE_DIR_INDEX_SIZE];
+} dirindexS;
+
 // flag values for FileS
 #define FAT_FLAG_OPEN 1
 #define FAT_FLAG_READ 2
@@ -176,6 +306,9 @@ typedef struct {
 
 #define FAT_INTERNAL_CALL 4242
 
+// mode flags for fat_fallocate()
+#define FAT_FALLOC_KEEP_SIZE 1
+
 // int sdfat_lookup_path(int, const char *);
 // int sdfat_next_sector(int fd);
 
@@ -201,14 +334,290 @@ int fat_mount(blockno_t start, blockno_t volume_size, uint8_t part_type_hint);
 int fat_open(const char *name, int flags, int mode, int *rerrno);
 
 int fat_close(int fd, int *rerrno);
+
+/**
+ * \brief Write the data and directory entry of one file to the volume
+ * 
+ * \param fd is the number of an open file
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns 0 on success or -1 on error.
+ **/
+int fat_fsync(int fd, int *rerrno);
+
+/**
+ * \brief Set how often the directory entry of a growing file is brought up to date
+ * 
+ * Writing the directory entry costs a read and write of the directory sector plus a re-read of
+ * the data sector, by default it is done every time a cluster is added to a file.  With this the
+ * entry is instead rewritten when the given number of clusters have been added since it was last
+ * written, or when the given number of seconds have passed (checked as the file is written to),
+ * whichever comes first.  Setting either to zero turns that trigger off, setting both to zero
+ * means entries are only written by fat_close(), fat_fsync() and fat_sync().
+ * 
+ * This sets the durability window: data written to the clusters is on the volume but if power is
+ * lost before the entry is next written the file keeps its old size (and the clusters added since
+ * stay allocated until a disc check frees them).  The size on the volume can therefore lag by up
+ * to the given number of clusters or seconds.  A brand new file gets its directory entry as soon as its first
+ * cluster is written whatever the policy.  The defaults can be changed at compile time with
+ * GRISTLE_WRITEBACK_CLUSTERS and GRISTLE_WRITEBACK_SECONDS and are reapplied by fat_mount().
+ * 
+ * \param clusters is the number of clusters to add between updates, 0 for no limit
+ * \param seconds is the longest time between updates of a file being written, 0 for no limit
+ **/
+void fat_set_writeback(uint32_t clusters, uint32_t seconds);
+
+/**
+ * \brief Set how many clusters are reserved ahead of a file as it grows
+ * 
+ * Normally a file being written takes one free cluster at a time from the start of the FAT, so
+ * files written at the same time (e.g. by different threads) interleave cluster by cluster and
+ * every new cluster means a trip through the allocator.  With a reservation set, each time a file
+ * needs a new cluster it takes the given number more straight after it, in one contiguous run
+ * where there is one, and links them onto its chain.  The file then grows into them without
+ * touching the FAT or waiting for other writers.  Whatever is left of the reservation is freed
+ * when the file is closed.
+ * 
+ * Until then the reserved clusters are allocated on the volume, so if power is lost they stay on
+ * the end of the file's chain past its size until a disc check frees them.  Directories never get
+ * a reservation.  The default is set at compile time with GRISTLE_RESERVE_CLUSTERS (0, off) and
+ * is reapplied by fat_mount().
+ * 
+ * \param clusters is the number of extra clusters to reserve, 0 to allocate one at a time
+ **/
+void fat_set_reserve(uint32_t clusters);
+
+/**
+ * \brief Set the buffer size of an open file
+ * 
+ * Each open file normally moves through the volume a sector at a time, so reading or writing it
+ * in small pieces costs one block_read() or block_write() per 512 bytes.  A larger buffer is
+ * filled with a single block_read_multi() of as many sectors as are contiguous on the disc from
+ * the current one (without going past the end of the file), and sectors written sequentially are
+ * collected in it and written back together with block_write_multi().  Transfers of whole sectors
+ * already go straight to the caller's buffer and don't use it.
+ * 
+ * The buffer is written back whenever the file's directory entry is, and by fat_fsync(),
+ * fat_sync() and fat_close(), so the size on the volume never covers data that isn't there.
+ * Reading a file through one descriptor while writing it through another isn't coherent beyond
+ * the buffer, as with the single sector buffer.  Buffers can be up to GRISTLE_BUFFER_SECTORS
+ * sectors (1 by default, which leaves every file a single sector), and that is also the size
+ * each file starts with when it is opened.  The sectors are borrowed from the pool shared by all
+ * the files (GRISTLE_POOL_SECTORS) when the buffer is first used, and a file that can't have
+ * them, or has them taken back by a busier file, carries on a sector at a time.
+ * 
+ * \param fd is the number of an open file
+ * \param size is the buffer size in bytes, rounded down to whole sectors and limited to one
+ * cluster and the size of the pool
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns 0 on success or -1 on error.
+ **/
+int fat_set_buffer(int fd, uint32_t size, int *rerrno);
+
+/**
+ * \brief Write all outstanding changes to the volume
+ * 
+ * Flushes the buffers and directory entries of every open file and copies any changes to the
+ * active FAT to the backup FATs.  The backup FATs are only updated here, by fat_close() and by
+ * fat_umount() so that consistency with tools on other systems costs one batched pass.
+ * 
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns 0 on success or -1 on error.
+ **/
+int fat_sync(int *rerrno);
+
+/**
+ * \brief Close any open files and bring the volume up to date before it is removed
+ * 
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns 0 on success or -1 on error.
+ **/
+int fat_umount(int *rerrno);
+
+/**
+ * \brief Count the free space on the mounted volume
+ * 
+ * Scans the whole active FAT, so the cost grows with the size of the volume.
+ * 
+ * \param st the sizes are written here, all in clusters of st->cluster_size bytes
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns 0 on success or -1 on error.
+ **/
+int fat_statfs(fatstatS *st, int *rerrno);
 int fat_read(int, void *, size_t, int *);
 int fat_write(int, const void *, size_t, int *);
+
+/**
+ * \brief Read into several buffers as one call
+ * 
+ * Fills the iovcnt buffers described by iov in order from the current position, as a fat_read()
+ * of their total length would, but the end of file check and the access time update are done
+ * once for the lot.
+ * 
+ * \param fd is the number of a file opened for reading
+ * \param iov is an array of iovcnt buffers
+ * \param iovcnt is the number of buffers
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns the number of bytes read or -1 on error.
+ **/
+int fat_readv(int fd, const struct iovec *iov, int iovcnt, int *rerrno);
+
+/**
+ * \brief Write several buffers as one call
+ * 
+ * Writes the iovcnt buffers described by iov one after another at the current position.  Pieces
+ * smaller than a sector share the file's sector buffer, so for example a record header and its
+ * payload usually reach the disc in one sector write, and the file size, modified time and
+ * metadata writeback are only updated once.
+ * 
+ * \param fd is the number of a file opened for writing
+ * \param iov is an array of iovcnt buffers
+ * \param iovcnt is the number of buffers
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns the number of bytes written or -1 on error.
+ **/
+int fat_writev(int fd, const struct iovec *iov, int iovcnt, int *rerrno);
 int fat_fstat(int, struct stat *, int *);
+
+/**
+ * \brief Get the details of a file or directory by name
+ * 
+ * Fills in st from the file's directory entry, without opening the file, so it doesn't use up one
+ * of the #MAX_OPEN_FILES file descriptors or read any of the file's data.
+ * 
+ * \param path is the full path of the file or directory
+ * \param st is where the details are written
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns 0 on success or -1 on error.
+ **/
+int fat_stat(const char *path, struct stat *st, int *rerrno);
 int fat_lseek(int, int, int, int *);
+
+/**
+ * \brief Read from a given offset in a file without moving its position
+ * 
+ * The same as a fat_lseek() to offset followed by fat_read(), except that the file's current
+ * position is left where it was, so threads sharing a descriptor don't have to agree on it.  Calls
+ * on the same descriptor still take turns, threads that want to read one file in parallel should
+ * each open it.
+ * 
+ * \param fd is the number of a file opened for reading
+ * \param buffer is where the data is written
+ * \param count is the most bytes to read
+ * \param offset is where to start reading in the file
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns the number of bytes read, 0 if offset is at or after the end of the file, or -1 on
+ * error.
+ **/
+int fat_pread(int fd, void *buffer, size_t count, int64_t offset, int *rerrno);
+
+/**
+ * \brief Write at a given offset in a file without moving its position
+ * 
+ * The write counterpart of fat_pread().  Writing past the end of the file fills the gap with zeros
+ * first, as fat_fallocate() does.  As with fat_write() a file opened with O_APPEND has the data
+ * added to the end whatever offset is given.
+ * 
+ * \param fd is the number of a file opened for writing
+ * \param buffer is the data to write
+ * \param count is the number of bytes to write
+ * \param offset is where to start writing in the file
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns the number of bytes written or -1 on error.
+ **/
+int fat_pwrite(int fd, const void *buffer, size_t count, int64_t offset, int *rerrno);
 int fat_get_next_dirent(int, struct dirent *, int *rerrno);
 
+/**
+ * \brief Read several entries of an open directory at once, with their details
+ * 
+ * Works through the entries a sector at a time straight out of the directory's buffer, so a
+ * listing with sizes and times doesn't need each file to be opened and stat'd.  Long file name
+ * parts, volume labels and deleted entries are skipped as with fat_get_next_dirent(), and the
+ * two calls carry on from the same position in the directory.
+ * 
+ * \param fd is the number of a directory opened for reading
+ * \param buf is where the entries are written
+ * \param n is the most entries to return
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns the number of entries written to buf, 0 at the end of the directory or -1 on error.
+ **/
+int fat_getdents_plus(int fd, direntplusS *buf, int n, int *rerrno);
+
 int fat_unlink(const char *path, int *rerrno);
 int fat_rmdir(const char *path, int *rerrno);
 int fat_mkdir(const char *path, int mode, int *rerrno);
 
+/**
+ * \brief Rename or move a file or directory within the volume
+ * 
+ * Only the directory entry moves, the data stays where it is, so the time taken doesn't depend on
+ * the size of the file.  A directory moved to a new parent has its .. entry updated.  An existing
+ * file at newpath is replaced, as is an existing empty directory if oldpath is a directory.  File
+ * descriptors open on oldpath carry on working and refer to newpath.
+ * 
+ * \param oldpath is the full path of the file or directory to rename
+ * \param newpath is its new full path, the directory it's in must already exist
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno, EBUSY if newpath is open or either path is the root, EINVAL if a directory would be
+ * moved inside itself
+ * \returns 0 on success or -1 on error.
+ **/
+int fat_rename(const char *oldpath, const char *newpath, int *rerrno);
+
+/**
+ * \brief Reserve disk space for part of a file in advance
+ * 
+ * Makes sure clusters are allocated for the byte range offset to offset + len of an open file.
+ * Any new clusters are taken as one contiguous run of free clusters where one exists and are
+ * linked onto the end of the file's chain, so later writes into the range need no allocation
+ * work.  Unless #FAT_FALLOC_KEEP_SIZE is given in mode a file shorter than offset + len is
+ * extended to that size and the new part reads as zeros.  Clusters that #FAT_FALLOC_KEEP_SIZE
+ * puts past the end of the file only last while it is open, fat_close() frees any the file
+ * hasn't been written into.
+ * 
+ * \param fd is the number of a file opened for writing
+ * \param mode is 0 or #FAT_FALLOC_KEEP_SIZE to leave the file size unchanged, any other bit gives
+ * EINVAL
+ * \param offset is the start of the range in bytes
+ * \param len is the length of the range in bytes
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns 0 on success or -1 on error.
+ **/
+int fat_fallocate(int fd, int mode, uint32_t offset, uint32_t len, int *rerrno);
+
+/**
+ * \brief Copy part of one file into another without going through the caller
+ * 
+ * The whole destination range is allocated first, as with fat_fallocate(), then the data is
+ * moved a cluster at a time through sectors borrowed from the buffer pool, or through a buffer
+ * of GRISTLE_COPY_SECTORS sectors (4 by default) on the stack if the pool is short.  When off_in
+ * and off_out are the same distance into a sector every transfer after the first is of whole
+ * sectors straight between the two files' clusters.  A destination shorter than off_out is
+ * first extended with zeros.  Neither file's current position is changed.
+ * 
+ * \param fd_in is the number of a file opened for reading
+ * \param off_in is where the copy starts in fd_in
+ * \param fd_out is the number of a different file opened for writing, not in append mode
+ * \param off_out is where the copy goes in fd_out
+ * \param len is the most bytes to copy, the copy stops at the end of fd_in
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns the number of bytes copied, 0 if off_in is at or after the end of fd_in, or -1 on
+ * error.
+ **/
+int fat_copy_file_range(int fd_in, uint32_t off_in, int fd_out, uint32_t off_out, uint32_t len,
+                        int *rerrno);
+
 #endif /* ifndef GRISTLE_H */
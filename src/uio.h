@@ -0,0 +1,26 @@
+/* uio.h - struct iovec for fat_readv(), fat_writev(), ext2_readv() and ext2_writev()
+ *
+ * Taken from the C library's sys/uio.h where it has one.  Toolchains without it, or builds that
+ * define GRISTLE_NO_SYS_UIO, get the POSIX definition here instead. */
+
+#ifndef GRISTLE_UIO_H
+#define GRISTLE_UIO_H
+
+#include <stddef.h>
+
+#if !defined(GRISTLE_NO_SYS_UIO) && defined(__has_include)
+#if !__has_include(<sys/uio.h>)
+#define GRISTLE_NO_SYS_UIO
+#endif
+#endif
+
+#ifdef GRISTLE_NO_SYS_UIO
+struct iovec {
+  void *iov_base;	/* start of the buffer */
+  size_t iov_len;	/* length of the buffer in bytes */
+};
+#else
+#include <sys/uio.h>
+#endif
+
+#endif
@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2012-2013, Nathan Dumont
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of 
+ *    conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of 
+ *    conditions and the following disclaimer in the documentation and/or other materials 
+ *    provided with the distribution.
+ * 3. Neither the name of the author nor the names of any contributors may be used to endorse or
+ *    promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * This file is part of the Gristle FAT16/32 compatible filesystem driver.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include "../src/gristle.h"
+#include "../src/block.h"
+#include "../src/block_drivers/block_pc.h"
+#include "../src/partition.h"
+
+/**************************************************************
+ * Throughput benchmarks using the PC block driver.
+ * 
+ * The image is held in RAM by block_pc so these numbers show
+ * the CPU cost of the filesystem layer rather than the medium.
+ * Run on a blank FAT16 or FAT32 image of at least 32MB:
+ * 
+ *   ./bench_gristle blank.img
+ *************************************************************/
+
+extern struct fat_info fatfs;
+
+#define BENCH_FILE_SIZE (16 * 1024 * 1024)
+#define BENCH_CHUNK_MAX (64 * 1024)
+#define BENCH_DIR_FILES 400
+#define BENCH_DIR_OPENS 20000
+#define BENCH_STATFS_RUNS 200
+#define BENCH_SEEKS 2000
+
+static uint8_t chunk[BENCH_CHUNK_MAX];
+
+double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_report(const char *what, size_t chunk_size, double bytes, double seconds) {
+  printf("%-32s %6u byte chunks %9.1f MB/s\n", what, (unsigned int)chunk_size,
+         bytes / (1024.0 * 1024.0) / seconds);
+}
+
+/* writes the benchmark file from scratch with each chunk size in turn */
+int bench_write(const char *name) {
+  const size_t sizes[] = {32, 512, 4096, BENCH_CHUNK_MAX};
+  unsigned int i;
+  uint32_t j;
+  int fd;
+  int rerrno;
+  double start;
+  
+  memset(chunk, 0x5A, BENCH_CHUNK_MAX);
+  for(i=0;i<sizeof(sizes) / sizeof(sizes[0]);i++) {
+    if((fd = fat_open(name, O_WRONLY | O_CREAT | O_TRUNC, 0777, &rerrno)) < 0) {
+      printf("Couldn't create %s (%d) %s\n", name, rerrno, strerror(rerrno));
+      return -1;
+    }
+    start = bench_now();
+    for(j=0;j<BENCH_FILE_SIZE;j+=sizes[i]) {
+      if(fat_write(fd, chunk, sizes[i], &rerrno) != (int)sizes[i]) {
+        printf("Write to %s failed (%d) %s\n", name, rerrno, strerror(rerrno));
+        fat_close(fd, &rerrno);
+        return -1;
+      }
+    }
+    if(fat_close(fd, &rerrno)) {
+      printf("Close of %s failed (%d) %s\n", name, rerrno, strerror(rerrno));
+      return -1;
+    }
+    bench_report("fat_write + fat_close", sizes[i], BENCH_FILE_SIZE, bench_now() - start);
+  }
+  
+  /* directory entry only written at close instead of once per cluster */
+  fat_set_writeback(0, 0);
+  if((fd = fat_open(name, O_WRONLY | O_CREAT | O_TRUNC, 0777, &rerrno)) < 0) {
+    printf("Couldn't create %s (%d) %s\n", name, rerrno, strerror(rerrno));
+    return -1;
+  }
+  start = bench_now();
+  for(j=0;j<BENCH_FILE_SIZE;j+=4096) {
+    if(fat_write(fd, chunk, 4096, &rerrno) != 4096) {
+      printf("Write to %s failed (%d) %s\n", name, rerrno, strerror(rerrno));
+      fat_close(fd, &rerrno);
+      return -1;
+    }
+  }
+  fat_close(fd, &rerrno);
+  bench_report("fat_write, entry at close only", 4096, BENCH_FILE_SIZE, bench_now() - start);
+  fat_set_writeback(1, 0);
+  
+  /* same again but with the whole file reserved up front */
+  if((fd = fat_open(name, O_WRONLY | O_CREAT | O_TRUNC, 0777, &rerrno)) < 0) {
+    printf("Couldn't create %s (%d) %s\n", name, rerrno, strerror(rerrno));
+    return -1;
+  }
+  start = bench_now();
+  if(fat_fallocate(fd, FAT_FALLOC_KEEP_SIZE, 0, BENCH_FILE_SIZE, &rerrno)) {
+    printf("fat_fallocate on %s failed (%d) %s\n", name, rerrno, strerror(rerrno));
+    fat_close(fd, &rerrno);
+    return -1;
+  }
+  for(j=0;j<BENCH_FILE_SIZE;j+=4096) {
+    if(fat_write(fd, chunk, 4096, &rerrno) != 4096) {
+      printf("Write to %s failed (%d) %s\n", name, rerrno, strerror(rerrno));
+      fat_close(fd, &rerrno);
+      return -1;
+    }
+  }
+  fat_close(fd, &rerrno);
+  bench_report("fat_fallocate + fat_write", 4096, BENCH_FILE_SIZE, bench_now() - start);
+  return 0;
+}
+
+void bench_read(const char *name) {
+  const size_t sizes[] = {1, 32, 512, 4096, BENCH_CHUNK_MAX};
+  unsigned int i;
+  int fd;
+  int rerrno;
+  int r;
+  double start;
+  double total;
+  
+  for(i=0;i<sizeof(sizes) / sizeof(sizes[0]);i++) {
+    if((fd = fat_open(name, O_RDONLY, 0777, &rerrno)) < 0) {
+      printf("Couldn't open %s (%d) %s\n", name, rerrno, strerror(rerrno));
+      return;
+    }
+    total = 0;
+    start = bench_now();
+    while((r = fat_read(fd, chunk, sizes[i], &rerrno)) > 0) {
+      total += r;
+    }
+    bench_report("fat_read", sizes[i], total, bench_now() - start);
+    fat_close(fd, &rerrno);
+  }
+}
+
+/* small reads and writes with a one sector file buffer and then a whole cluster one */
+void bench_buffer(const char *name) {
+  const char *what[] = {"fat_write, sector buffer", "fat_write, cluster buffer",
+                        "fat_read, sector buffer", "fat_read, cluster buffer"};
+  uint32_t size[] = {512, fatfs.sectors_per_cluster * 512};
+  unsigned int i;
+  uint32_t j;
+  int fd;
+  int rerrno;
+  int r;
+  double start;
+  double total;
+  
+  for(i=0;i<4;i++) {
+    if(i < 2) {
+      fd = fat_open(name, O_WRONLY | O_CREAT | O_TRUNC, 0777, &rerrno);
+    } else {
+      fd = fat_open(name, O_RDONLY, 0777, &rerrno);
+    }
+    if(fd < 0) {
+      printf("Couldn't open %s (%d) %s\n", name, rerrno, strerror(rerrno));
+      return;
+    }
+    fat_set_buffer(fd, size[i & 1], &rerrno);
+    total = 0;
+    start = bench_now();
+    if(i < 2) {
+      for(j=0;j<BENCH_FILE_SIZE / 4;j+=32) {
+        if((r = fat_write(fd, chunk, 32, &rerrno)) != 32) {
+          printf("Write to %s failed (%d) %s\n", name, rerrno, strerror(rerrno));
+          break;
+        }
+        total += r;
+      }
+    } else {
+      while((r = fat_read(fd, chunk, 32, &rerrno)) > 0) {
+        total += r;
+      }
+    }
+    fat_close(fd, &rerrno);
+    bench_report(what[i], 32, total, bench_now() - start);
+  }
+}
+
+/*
+ * opens every file in a big directory in a scattered order, only the FAT16 root can hold this
+ * many entries in one directory at the moment
+ */
+void bench_lookup() {
+  char name[16];
+  uint32_t i;
+  uint32_t k;
+  int fd;
+  int rerrno;
+  double start;
+  
+  if(fatfs.type != PART_TYPE_FAT16) {
+    printf("%-32s skipped, needs a FAT16 image\n", "fat_open in a big directory");
+    return;
+  }
+  for(i=0;i<BENCH_DIR_FILES;i++) {
+    sprintf(name, "/L%u.DAT", (unsigned int)i);
+    if((fd = fat_open(name, O_WRONLY | O_CREAT | O_TRUNC, 0777, &rerrno)) < 0) {
+      printf("Couldn't create %s (%d) %s\n", name, rerrno, strerror(rerrno));
+      return;
+    }
+    fat_write(fd, name, 1, &rerrno);
+    fat_close(fd, &rerrno);
+  }
+  start = bench_now();
+  for(k=0;k<BENCH_DIR_OPENS;k++) {
+    sprintf(name, "/L%u.DAT", (unsigned int)((k * 7919) % BENCH_DIR_FILES));
+    if((fd = fat_open(name, O_RDONLY, 0777, &rerrno)) < 0) {
+      printf("Couldn't open %s (%d) %s\n", name, rerrno, strerror(rerrno));
+      return;
+    }
+    fat_close(fd, &rerrno);
+  }
+  printf("%-32s %6u entries      %9.0f opens/s\n", "fat_open in a big directory",
+         (unsigned int)BENCH_DIR_FILES, BENCH_DIR_OPENS / (bench_now() - start));
+  
+  /* names that aren't there, each one is a search of the whole directory */
+  start = bench_now();
+  for(k=0;k<BENCH_DIR_OPENS;k++) {
+    sprintf(name, "/M%u.DAT", (unsigned int)k);
+    if((fd = fat_open(name, O_RDONLY, 0777, &rerrno)) >= 0) {
+      fat_close(fd, &rerrno);
+    }
+  }
+  printf("%-32s %6u entries      %9.0f opens/s\n", "fat_open miss in a big directory",
+         (unsigned int)BENCH_DIR_FILES, BENCH_DIR_OPENS / (bench_now() - start));
+}
+
+/*
+ * two files written a cluster at a time in turn so every cluster of each is its own extent,
+ * then 1 byte reads at scattered and at falling positions in one of them
+ */
+void bench_seek(const char *name, const char *other) {
+  uint32_t csize = fatfs.sectors_per_cluster * 512;
+  uint32_t size = BENCH_FILE_SIZE / 2;
+  uint32_t j;
+  uint32_t k;
+  int fd;
+  int fd2;
+  int rerrno;
+  double start;
+  
+  fd = fat_open(name, O_WRONLY | O_CREAT | O_TRUNC, 0777, &rerrno);
+  fd2 = fat_open(other, O_WRONLY | O_CREAT | O_TRUNC, 0777, &rerrno);
+  if((fd < 0) || (fd2 < 0)) {
+    printf("Couldn't create %s and %s (%d) %s\n", name, other, rerrno, strerror(rerrno));
+    return;
+  }
+  for(j=0;j<size;j+=csize) {
+    if((fat_write(fd, chunk, csize, &rerrno) != (int)csize) ||
+       (fat_write(fd2, chunk, csize, &rerrno) != (int)csize)) {
+      printf("Write to %s failed (%d) %s\n", name, rerrno, strerror(rerrno));
+      break;
+    }
+  }
+  fat_close(fd2, &rerrno);
+  fat_close(fd, &rerrno);
+  
+  if((fd = fat_open(name, O_RDONLY, 0777, &rerrno)) < 0) {
+    printf("Couldn't open %s (%d) %s\n", name, rerrno, strerror(rerrno));
+    return;
+  }
+  start = bench_now();
+  for(k=0;k<BENCH_SEEKS;k++) {
+    fat_lseek(fd, (k * 2654435761u) % size, SEEK_SET, &rerrno);
+    fat_read(fd, chunk, 1, &rerrno);
+  }
+  printf("%-32s %6u clusters     %9.0f seeks/s\n", "fat_lseek, fragmented, scattered",
+         (unsigned int)(size / csize), BENCH_SEEKS / (bench_now() - start));
+  
+  start = bench_now();
+  for(k=0;k<BENCH_SEEKS;k++) {
+    fat_lseek(fd, size - 1 - (k * (size / BENCH_SEEKS)), SEEK_SET, &rerrno);
+    fat_read(fd, chunk, 1, &rerrno);
+  }
+  printf("%-32s %6u clusters     %9.0f seeks/s\n", "fat_lseek, fragmented, backwards",
+         (unsigned int)(size / csize), BENCH_SEEKS / (bench_now() - start));
+  fat_close(fd, &rerrno);
+}
+
+/* counting free clusters reads the whole FAT, reported as FAT bytes scanned per second */
+void bench_statfs() {
+  fatstatS st;
+  int rerrno;
+  int k;
+  double start;
+  
+  start = bench_now();
+  for(k=0;k<BENCH_STATFS_RUNS;k++) {
+    if(fat_statfs(&st, &rerrno)) {
+      printf("fat_statfs failed (%d) %s\n", rerrno, strerror(rerrno));
+      return;
+    }
+  }
+  bench_report("fat_statfs (FAT scan)", 512,
+               (double)BENCH_STATFS_RUNS * (fatfs.max_cluster + 1) * fatfs.fat_entry_len,
+               bench_now() - start);
+}
+
+/* the best any read path could do, memcpy of the whole file area out of the RAM image */
+void bench_raw_read() {
+  uint32_t i;
+  double start;
+  
+  start = bench_now();
+  for(i=0;i<BENCH_FILE_SIZE;i+=BENCH_CHUNK_MAX) {
+    block_read_multi(fatfs.cluster0 + i / 512, BENCH_CHUNK_MAX / 512, chunk);
+  }
+  bench_report("block_read_multi (ceiling)", BENCH_CHUNK_MAX, BENCH_FILE_SIZE, bench_now() - start);
+}
+
+int main(int argc, char *argv[]) {
+  if(argc < 2) {
+    printf("Please specify a blank disk image to work on.\n");
+    exit(-2);
+  }
+  
+  block_pc_set_image_name(argv[1]);
+  if(block_init()) {
+    printf("Couldn't load the image.\n");
+    exit(-2);
+  }
+  if(fat_mount(0, block_get_volume_size(), PART_TYPE_FAT32)) {
+    printf("Mount failed\n");
+    exit(-2);
+  }
+  
+  if(bench_write("/BENCH.BIN")) {
+    exit(-1);
+  }
+  bench_raw_read();
+  bench_read("/BENCH.BIN");
+  bench_buffer("/BUFFER.BIN");
+  bench_lookup();
+  bench_seek("/SEEK.BIN", "/SEEK2.BIN");
+  bench_statfs();
+  
+  block_halt();
+  exit(0);
+}
@@ -14,6 +14,8 @@ int main(int argc, char *argv[]) {
     int i;
     int r;
     struct partition *part_list;
+    fatstatS st;
+    int rerrno;
     blockno_t image_size = 0;
     
     if(argc < 2) {
@@ -60,6 +62,7 @@ int main(int argc, char *argv[]) {
         printf("cluster0: %d\n", fatfs.cluster0);
         printf("active_fat_start: %d blocks (0x%x bytes)\n", fatfs.active_fat_start, fatfs.active_fat_start * block_get_block_size());
         printf("sectors_per_fat: %d\n", fatfs.sectors_per_fat);
+        printf("num_fats: %d\n", fatfs.num_fats);
         printf("root_len: %d\n", fatfs.root_len);
         printf("root_cluster: %d\n", fatfs.root_cluster);
         if(fatfs.type == 0x0b) {
@@ -71,6 +74,9 @@ int main(int argc, char *argv[]) {
         }
         printf("part_start: %d blocks (0x%x bytes)\n", fatfs.part_start, fatfs.part_start * block_get_block_size());
         printf("total_sectors: %d\n", fatfs.total_sectors);
+        if(fat_statfs(&st, &rerrno) == 0) {
+            printf("free_clusters: %u of %u\n", st.free_clusters, st.clusters);
+        }
     }
     block_halt();
   
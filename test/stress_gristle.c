@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2012-2013, Nathan Dumont
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of
+ *    conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of
+ *    conditions and the following disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ * 3. Neither the name of the author nor the names of any contributors may be used to endorse or
+ *    promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * This file is part of the Gristle FAT16/32 compatible filesystem driver.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "../src/gristle.h"
+#include "../src/block.h"
+#include "../src/block_drivers/block_pc.h"
+#include "../src/partition.h"
+
+/**************************************************************
+ * Multi-threaded stress test and benchmark, needs gristle.c
+ * built with GRISTLE_PTHREADS.
+ *
+ * First each thread reads its own file to show how reads of
+ * different files scale with the number of threads, then
+ * writers append to new files while readers keep opening and
+ * reading the others, first allocating a cluster at a time then
+ * with a reservation per file (see fat_set_reserve()).  Everything read is checked against the
+ * pattern it was written with.  Run on a blank FAT16 or FAT32
+ * image of at least 32MB:
+ *
+ *   ./stress_gristle blank.img
+ *************************************************************/
+
+#define STRESS_THREADS MAX_OPEN_FILES
+#define STRESS_FILE_SIZE (4 * 1024 * 1024)
+#define STRESS_READ_ROUNDS 8
+#define STRESS_CHUNK 4096
+#define STRESS_WRITE_SIZE (2 * 1024 * 1024)
+#define STRESS_MIXED_ROUNDS 20
+#define STRESS_RESERVE 32
+
+typedef struct {
+  int id;
+  int errors;
+  double bytes;
+} stress_arg;
+
+int writers_running;   // set while the writers run, the readers poll it with __atomic_load_n()
+
+uint8_t stress_pattern(uint32_t pos, int seed) {
+  return (uint8_t)((pos * 7) + (pos >> 12) + seed * 31);
+}
+
+double stress_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* writes a file of the given size in STRESS_CHUNK pieces, returns the number of errors */
+int stress_write_file(const char *name, uint32_t size, int seed) {
+  uint8_t buf[STRESS_CHUNK];
+  uint32_t pos;
+  uint32_t i;
+  int fd;
+  int rerrno;
+
+  if((fd = fat_open(name, O_WRONLY | O_CREAT | O_TRUNC, 0777, &rerrno)) < 0) {
+    printf("Couldn't create %s (%d) %s\n", name, rerrno, strerror(rerrno));
+    return 1;
+  }
+  for(pos=0;pos<size;pos+=STRESS_CHUNK) {
+    for(i=0;i<STRESS_CHUNK;i++) {
+      buf[i] = stress_pattern(pos + i, seed);
+    }
+    if(fat_write(fd, buf, STRESS_CHUNK, &rerrno) != STRESS_CHUNK) {
+      printf("Write to %s failed (%d) %s\n", name, rerrno, strerror(rerrno));
+      fat_close(fd, &rerrno);
+      return 1;
+    }
+  }
+  if(fat_close(fd, &rerrno)) {
+    printf("Close of %s failed (%d) %s\n", name, rerrno, strerror(rerrno));
+    return 1;
+  }
+  return 0;
+}
+
+/* reads a whole file checking every byte, returns the number of bytes read or -1 on error */
+double stress_read_file(const char *name, uint32_t size, int seed) {
+  uint8_t buf[STRESS_CHUNK];
+  uint32_t pos = 0;
+  int r;
+  int i;
+  int fd;
+  int rerrno;
+
+  if((fd = fat_open(name, O_RDONLY, 0777, &rerrno)) < 0) {
+    printf("Couldn't open %s (%d) %s\n", name, rerrno, strerror(rerrno));
+    return -1;
+  }
+  while((r = fat_read(fd, buf, STRESS_CHUNK, &rerrno)) > 0) {
+    for(i=0;i<r;i++) {
+      if(buf[i] != stress_pattern(pos + i, seed)) {
+        printf("%s corrupt at %u\n", name, (unsigned int)(pos + i));
+        fat_close(fd, &rerrno);
+        return -1;
+      }
+    }
+    pos += r;
+  }
+  fat_close(fd, &rerrno);
+  if(pos != size) {
+    printf("%s read %u bytes, expected %u\n", name, (unsigned int)pos, (unsigned int)size);
+    return -1;
+  }
+  return pos;
+}
+
+void *stress_reader(void *p) {
+  stress_arg *a = (stress_arg *)p;
+  char name[16];
+  double r;
+  int i;
+
+  sprintf(name, "/R%d.BIN", a->id);
+  for(i=0;i<STRESS_READ_ROUNDS;i++) {
+    if((r = stress_read_file(name, STRESS_FILE_SIZE, a->id)) < 0) {
+      a->errors++;
+      break;
+    }
+    a->bytes += r;
+  }
+  return NULL;
+}
+
+void *stress_mixed_reader(void *p) {
+  stress_arg *a = (stress_arg *)p;
+  char name[16];
+  double r;
+
+  sprintf(name, "/R%d.BIN", a->id);
+  while(__atomic_load_n(&writers_running, __ATOMIC_ACQUIRE)) {
+    if((r = stress_read_file(name, STRESS_FILE_SIZE, a->id)) < 0) {
+      a->errors++;
+      break;
+    }
+    a->bytes += r;
+  }
+  return NULL;
+}
+
+void *stress_writer(void *p) {
+  stress_arg *a = (stress_arg *)p;
+  char name[16];
+  int i;
+
+  sprintf(name, "/W%d.BIN", a->id);
+  for(i=0;i<STRESS_MIXED_ROUNDS;i++) {
+    if(stress_write_file(name, STRESS_WRITE_SIZE, a->id + 100)) {
+      a->errors++;
+      break;
+    }
+    a->bytes += STRESS_WRITE_SIZE;
+  }
+  return NULL;
+}
+
+/* readers on threads 0 to n - 1, each with its own file */
+int stress_read_scaling(int n) {
+  pthread_t threads[STRESS_THREADS];
+  stress_arg args[STRESS_THREADS];
+  double start;
+  double total = 0;
+  int errors = 0;
+  int i;
+
+  start = stress_now();
+  for(i=0;i<n;i++) {
+    args[i].id = i;
+    args[i].errors = 0;
+    args[i].bytes = 0;
+    pthread_create(&threads[i], NULL, stress_reader, &args[i]);
+  }
+  for(i=0;i<n;i++) {
+    pthread_join(threads[i], NULL);
+    total += args[i].bytes;
+    errors += args[i].errors;
+  }
+  printf("%d reader thread(s)                 %9.1f MB/s\n", n,
+         total / (1024.0 * 1024.0) / (stress_now() - start));
+  return errors;
+}
+
+/* half the threads write new files while the others keep reading theirs */
+int stress_mixed(uint32_t reserve) {
+  pthread_t threads[STRESS_THREADS];
+  stress_arg args[STRESS_THREADS];
+  double start;
+  double elapsed;
+  double read_total = 0;
+  double write_total = 0;
+  int errors = 0;
+  int i;
+
+  fat_set_reserve(reserve);
+  __atomic_store_n(&writers_running, 1, __ATOMIC_RELEASE);
+  start = stress_now();
+  for(i=0;i<STRESS_THREADS;i++) {
+    args[i].id = i;
+    args[i].errors = 0;
+    args[i].bytes = 0;
+    pthread_create(&threads[i], NULL, (i & 1) ? stress_mixed_reader : stress_writer, &args[i]);
+  }
+  for(i=0;i<STRESS_THREADS;i+=2) {
+    pthread_join(threads[i], NULL);
+  }
+  __atomic_store_n(&writers_running, 0, __ATOMIC_RELEASE);
+  for(i=1;i<STRESS_THREADS;i+=2) {
+    pthread_join(threads[i], NULL);
+  }
+  elapsed = stress_now() - start;
+  for(i=0;i<STRESS_THREADS;i++) {
+    if(i & 1) {
+      read_total += args[i].bytes;
+    } else {
+      write_total += args[i].bytes;
+    }
+    errors += args[i].errors;
+  }
+  printf("mixed, reserve %2u: writers %9.1f MB/s, readers %9.1f MB/s\n", (unsigned int)reserve,
+         write_total / (1024.0 * 1024.0) / elapsed, read_total / (1024.0 * 1024.0) / elapsed);
+
+  /* everything the writers left behind must read back intact */
+  for(i=0;i<STRESS_THREADS;i+=2) {
+    char name[16];
+    sprintf(name, "/W%d.BIN", i);
+    if(stress_read_file(name, STRESS_WRITE_SIZE, i + 100) < 0) {
+      errors++;
+    }
+  }
+  return errors;
+}
+
+int main(int argc, char *argv[]) {
+  char name[16];
+  int errors = 0;
+  int rerrno;
+  int i;
+
+  if(argc < 2) {
+    printf("Please specify a blank disk image to work on.\n");
+    exit(-2);
+  }
+
+  block_pc_set_image_name(argv[1]);
+  if(block_init()) {
+    printf("Couldn't load the image.\n");
+    exit(-2);
+  }
+  if(fat_mount(0, block_get_volume_size(), PART_TYPE_FAT32)) {
+    printf("Mount failed\n");
+    exit(-2);
+  }
+
+  for(i=0;i<STRESS_THREADS;i++) {
+    sprintf(name, "/R%d.BIN", i);
+    errors += stress_write_file(name, STRESS_FILE_SIZE, i);
+  }
+  for(i=1;i<=STRESS_THREADS;i*=2) {
+    errors += stress_read_scaling(i);
+  }
+  errors += stress_mixed(0);
+  errors += stress_mixed(STRESS_RESERVE);
+
+  fat_umount(&rerrno);
+  block_halt();
+  if(errors) {
+    printf("%d error(s)\n", errors);
+    exit(-1);
+  }
+  printf("No errors\n");
+  exit(0);
+}
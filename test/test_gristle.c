@@ -262,6 +262,27 @@ int main(int argc, char *argv[]) {
     printf("Error closing directory, (%d) %s\n", rerrno, strerror(rerrno));
   }
   
+  printf("List directory with sizes\n");
+  if((fd = fat_open("/foo/bar", O_RDONLY, 0777, &rerrno)) < 0) {
+    printf("Failed to open directory (%d) %s\n", rerrno, strerror(rerrno));
+    exit(-1);
+  }
+  direntplusS dp[4];
+  int n;
+  
+  while((n = fat_getdents_plus(fd, dp, 4, &rerrno)) > 0) {
+    for(i=0;i<n;i++) {
+      printf("%-12s %02x %8u\n", dp[i].name, dp[i].attributes, (unsigned int)dp[i].size);
+    }
+  }
+  if(n < 0) {
+    printf("Directory listing failed. (%d) %s\n", rerrno, strerror(rerrno));
+  }
+  
+  if(fat_close(fd, &rerrno)) {
+    printf("Error closing directory, (%d) %s\n", rerrno, strerror(rerrno));
+  }
+  
   if(fat_open("/web/version.txt", O_RDONLY, 0777, &rerrno) < 0) {
     printf("Error opening missing file (%d) %s\n", rerrno, strerror(rerrno));
   } else {
@@ -281,12 +302,303 @@ int main(int argc, char *argv[]) {
   }
   fat_close(fd, &rerrno);
   
+  printf("Seeking around the big file.\n");
+  
+  if((fd = fat_open("big_file.bin", O_RDONLY, 0777, &rerrno)) < 0) {
+      printf("Error opening the big file for reading.\n");
+  }
+  
+  // jump to the end then back to the start so the second seek is answered from the extent map
+  for(i=0;i<4;i++) {
+      const int offsets[] = {1024 * 1024 * 40 - 4, 4, 1024 * 1024 * 20, 1024 * 1024 * 40 - 8};
+      temp_uint = 0;
+      if(fat_lseek(fd, offsets[i], SEEK_SET, &rerrno) != offsets[i]) {
+          printf("Seek to %d failed (%d) %s\n", offsets[i], rerrno, strerror(rerrno));
+      } else if((fat_read(fd, &temp_uint, 4, &rerrno) != 4) || (temp_uint != 0xDEADBEEF)) {
+          printf("Bad data after seek to %d: 0x%08X\n", offsets[i], temp_uint);
+      }
+  }
+  printf("File used %d extents.\n", file_num[fd].num_extents);
+  fat_close(fd, &rerrno);
+  
+  struct stat st;
+  
+  if(fat_stat("/big_file.bin", &st, &rerrno)) {
+      printf("Error getting the size of the big file (%d) %s\n", rerrno, strerror(rerrno));
+  } else if(st.st_size != 1024 * 1024 * 40) {
+      printf("Big file is %d bytes, expected %d\n", (int)st.st_size, 1024 * 1024 * 40);
+  }
+  if(fat_stat("/web/version.txt", &st, &rerrno) == 0) {
+      printf("success! got details of a non existent file.\n");
+  }
+
+  if(fat_rename("/foo/bar/file.html", "/web/index.htm", &rerrno)) {
+      printf("Error moving file.html (%d) %s\n", rerrno, strerror(rerrno));
+  } else if(fat_stat("/web/index.htm", &st, &rerrno) || (st.st_size != 20 * 1024)) {
+      printf("Moved file is missing or the wrong size\n");
+  } else if(fat_stat("/foo/bar/file.html", &st, &rerrno) == 0) {
+      printf("success! file.html is still there after moving it.\n");
+  }
+
+  // a directory moved to another parent has its .. entry pointed at the new one
+  if(fat_rename("/foo/bar", "/web/bar", &rerrno)) {
+      printf("Error moving /foo/bar (%d) %s\n", rerrno, strerror(rerrno));
+  } else if((fd = fat_open("/web/bar", O_RDONLY, 0777, &rerrno)) < 0) {
+      printf("Moved directory is missing (%d) %s\n", rerrno, strerror(rerrno));
+  } else {
+      direntS dots[2];
+
+      if(fat_read(fd, dots, sizeof(dots), &rerrno) != sizeof(dots)) {
+          printf("Error reading the moved directory (%d) %s\n", rerrno, strerror(rerrno));
+      }
+      fat_close(fd, &rerrno);
+      if((fd = fat_open("/web", O_RDONLY, 0777, &rerrno)) < 0) {
+          printf("Error opening /web (%d) %s\n", rerrno, strerror(rerrno));
+      } else {
+          if(((uint32_t)dots[1].high_first_cluster << 16 | dots[1].first_cluster) !=
+             file_num[fd].full_first_cluster) {
+              printf(".. in the moved directory doesn't point at /web\n");
+          }
+          fat_close(fd, &rerrno);
+      }
+  }
+  if((fat_rename("/web", "/web/bar/web", &rerrno) == 0) || (rerrno != EINVAL)) {
+      printf("Moving /web into its own subdirectory gave (%d) %s\n", rerrno, strerror(rerrno));
+  }
+
+  // renaming over an existing file replaces it
+  if((fd = fat_open("/web/new.htm", O_WRONLY | O_CREAT, 0777, &rerrno)) < 0) {
+      printf("Error creating /web/new.htm (%d) %s\n", rerrno, strerror(rerrno));
+  } else {
+      fat_write(fd, block_o_data, 100, &rerrno);
+      fat_close(fd, &rerrno);
+      if(fat_rename("/web/new.htm", "/web/index.htm", &rerrno)) {
+          printf("Error replacing index.htm (%d) %s\n", rerrno, strerror(rerrno));
+      } else if(fat_stat("/web/index.htm", &st, &rerrno) || (st.st_size != 100)) {
+          printf("Replaced index.htm is missing or the wrong size\n");
+      } else if(fat_stat("/web/new.htm", &st, &rerrno) == 0) {
+          printf("success! new.htm is still there after replacing index.htm with it.\n");
+      }
+  }
+
+  if((fd = fat_open("/big_file.bin", O_RDONLY, 0777, &rerrno)) < 0) {
+      printf("Error opening the big file to copy it.\n");
+  } else if((i = fat_open("/copy.bin", O_WRONLY | O_CREAT, 0777, &rerrno)) < 0) {
+      printf("Error creating the copy (%d) %s\n", rerrno, strerror(rerrno));
+      fat_close(fd, &rerrno);
+  } else {
+      if(fat_copy_file_range(fd, 4, i, 0, 1024 * 1024, &rerrno) != 1024 * 1024) {
+          printf("Error copying the big file (%d) %s\n", rerrno, strerror(rerrno));
+      }
+      if(fat_copy_file_range(fd, 0, i, 0, 0, &rerrno) != 0) {
+          printf("Zero length copy failed (%d) %s\n", rerrno, strerror(rerrno));
+      }
+      fat_close(i, &rerrno);
+      fat_close(fd, &rerrno);
+      if(fat_stat("/copy.bin", &st, &rerrno) || (st.st_size != 1024 * 1024)) {
+          printf("Copy of the big file is missing or the wrong size\n");
+      }
+  }
+
+  // positional writes past the end and reads either side of them mustn't move the file position
+  if((fd = fat_open("/copy.bin", O_RDWR, 0777, &rerrno)) < 0) {
+      printf("Error opening the copy for positional I/O (%d) %s\n", rerrno, strerror(rerrno));
+  } else {
+      temp_uint = 0xDEADBEEF;
+      if(fat_pwrite(fd, &temp_uint, 4, 1024 * 1024 + 4096, &rerrno) != 4) {
+          printf("Error writing past the end of the copy (%d) %s\n", rerrno, strerror(rerrno));
+      }
+      for(i=0;i<3;i++) {
+          const int offsets[] = {1024 * 1024 + 4096, 1024 * 1024 - 4, 8};
+          temp_uint = 0;
+          if((fat_pread(fd, &temp_uint, 4, offsets[i], &rerrno) != 4) || (temp_uint != 0xDEADBEEF)) {
+              printf("Bad data from positional read at %d: 0x%08X\n", offsets[i], temp_uint);
+          }
+      }
+      if((fat_pread(fd, &temp_uint, 4, 1024 * 1024, &rerrno) != 4) || (temp_uint != 0)) {
+          printf("Gap before a positional write isn't zeros: 0x%08X\n", temp_uint);
+      }
+      if(fat_lseek(fd, 0, SEEK_CUR, &rerrno) != 0) {
+          printf("Positional I/O moved the file position\n");
+      }
+      fat_close(fd, &rerrno);
+  }
+
+  // records of a small header and a payload, written and read back in one call each
+  if((fd = fat_open("/records.bin", O_RDWR | O_CREAT, 0777, &rerrno)) < 0) {
+      printf("Error creating the records file (%d) %s\n", rerrno, strerror(rerrno));
+  } else {
+      char payload[700];
+      char check[700];
+      struct iovec iov[2];
+
+      memset(payload, 'r', sizeof(payload));
+      for(i=0;i<100;i++) {
+          temp_uint = i;
+          iov[0].iov_base = &temp_uint;
+          iov[0].iov_len = 4;
+          iov[1].iov_base = payload;
+          iov[1].iov_len = 1 + (i * 7) % sizeof(payload);
+          if(fat_writev(fd, iov, 2, &rerrno) != (int)(4 + iov[1].iov_len)) {
+              printf("Error writing record %d (%d) %s\n", i, rerrno, strerror(rerrno));
+          }
+      }
+      fat_lseek(fd, 0, SEEK_SET, &rerrno);
+      for(i=0;i<100;i++) {
+          iov[0].iov_base = &temp_uint;
+          iov[0].iov_len = 4;
+          iov[1].iov_base = check;
+          iov[1].iov_len = 1 + (i * 7) % sizeof(check);
+          if((fat_readv(fd, iov, 2, &rerrno) != (int)(4 + iov[1].iov_len)) || (temp_uint != (uint32_t)i) ||
+             (memcmp(check, payload, iov[1].iov_len))) {
+              printf("Bad record %d read back\n", i);
+          }
+      }
+      fat_close(fd, &rerrno);
+  }
+
+  // preallocation that grows the file reads back as zeros, with KEEP_SIZE the size stays put and
+  // whatever the file doesn't reach by close is given back
+  if((fd = fat_open("/prealloc.bin", O_RDWR | O_CREAT, 0777, &rerrno)) < 0) {
+      printf("Error creating the preallocated file (%d) %s\n", rerrno, strerror(rerrno));
+  } else {
+      fatstatS fs_before;
+      fatstatS fs_after;
+
+      fat_statfs(&fs_before, &rerrno);
+      if(fat_fallocate(fd, 0, 0, 10000, &rerrno)) {
+          printf("Error preallocating the file (%d) %s\n", rerrno, strerror(rerrno));
+      }
+      if(fat_lseek(fd, 0, SEEK_END, &rerrno) != 10000) {
+          printf("Preallocated file is the wrong size\n");
+      }
+      fat_lseek(fd, 0, SEEK_SET, &rerrno);
+      for(i=0;i<10000;i+=4) {
+          temp_uint = 0xFFFFFFFF;
+          if((fat_read(fd, &temp_uint, 4, &rerrno) != 4) || (temp_uint != 0)) {
+              printf("Preallocated space at %d isn't zeros: 0x%08X\n", i, temp_uint);
+              break;
+          }
+      }
+      if(fat_fallocate(fd, FAT_FALLOC_KEEP_SIZE, 0, 100000, &rerrno)) {
+          printf("Error preallocating past the end (%d) %s\n", rerrno, strerror(rerrno));
+      }
+      if(fat_lseek(fd, 0, SEEK_END, &rerrno) != 10000) {
+          printf("KEEP_SIZE preallocation changed the size\n");
+      }
+      if((fat_fallocate(fd, 7, 0, 10, &rerrno) != -1) || (rerrno != EINVAL)) {
+          printf("Preallocation with unknown mode bits wasn't refused\n");
+      }
+      fat_close(fd, &rerrno);
+      fat_statfs(&fs_after, &rerrno);
+      if(fs_before.free_clusters - fs_after.free_clusters !=
+         (10000 + fs_after.cluster_size - 1) / fs_after.cluster_size) {
+          printf("Preallocation past the end wasn't freed at close\n");
+      }
+  }
+
+  // the end of a read only file that exactly fills its clusters is still somewhere to seek to
+  if((fd = fat_open("/aligned.bin", O_WRONLY | O_CREAT, 0777, &rerrno)) < 0) {
+      printf("Error creating /aligned.bin (%d) %s\n", rerrno, strerror(rerrno));
+  } else {
+      for(i=0;i<3 * fatfs.sectors_per_cluster;i++) {
+          fat_write(fd, block_o_data, 512, &rerrno);
+      }
+      fat_close(fd, &rerrno);
+  }
+  if((fd = fat_open("/aligned.bin", O_RDONLY, 0777, &rerrno)) < 0) {
+      printf("Error opening /aligned.bin (%d) %s\n", rerrno, strerror(rerrno));
+  } else {
+      temp_uint = 3 * fatfs.sectors_per_cluster * 512;
+      if(fat_lseek(fd, 0, SEEK_END, &rerrno) != (int)temp_uint) {
+          printf("SEEK_END on a cluster aligned file failed (%d) %s\n", rerrno, strerror(rerrno));
+      }
+      fat_lseek(fd, 0, SEEK_SET, &rerrno);
+      if(fat_lseek(fd, temp_uint, SEEK_SET, &rerrno) != (int)temp_uint) {
+          printf("Seeking to the end of a cluster aligned file failed (%d) %s\n", rerrno, strerror(rerrno));
+      }
+      if(fat_read(fd, block_o_data, 1, &rerrno) != 0) {
+          printf("Read at the end of a cluster aligned file returned data\n");
+      }
+      if((fat_lseek(fd, -1, SEEK_END, &rerrno) != (int)temp_uint - 1) ||
+         (fat_read(fd, block_o_data, 2, &rerrno) != 1) || (block_o_data[0] != 0x42)) {
+          printf("Bad read of the last byte of a cluster aligned file\n");
+      }
+      fat_close(fd, &rerrno);
+  }
+  memset(block_o_data, 0x42, 1024);
+
+  // writes ending on a cluster boundary leave the cursor rolled off the last sector, a seek from
+  // there counts from the end of that sector, it mustn't step into a cluster the file hasn't got
+  // and a seek back into the sector has to reload it as the data went straight to the disc
+  if((fd = fat_open("/rolled.bin", O_RDWR | O_CREAT, 0777, &rerrno)) < 0) {
+      printf("Error creating /rolled.bin (%d) %s\n", rerrno, strerror(rerrno));
+  } else {
+      fatstatS fs_before;
+      fatstatS fs_after;
+
+      fat_statfs(&fs_before, &rerrno);
+      block_o_data[1023] = 0x17;
+      for(i=0;i<fatfs.sectors_per_cluster;i++) {
+          fat_write(fd, block_o_data, 1024, &rerrno);
+      }
+      temp_uint = 2 * fatfs.sectors_per_cluster * 512;
+      if(fat_lseek(fd, 0, SEEK_CUR, &rerrno) != (int)temp_uint) {
+          printf("SEEK_CUR after a cluster aligned write failed (%d) %s\n", rerrno, strerror(rerrno));
+      }
+      block_o_data[0] = 0;
+      if((fat_lseek(fd, -1, SEEK_CUR, &rerrno) != (int)temp_uint - 1) ||
+         (fat_read(fd, block_o_data, 1, &rerrno) != 1) || (block_o_data[0] != 0x17)) {
+          printf("Bad read of the last byte after seeking back from a rolled off cursor\n");
+      }
+      fat_close(fd, &rerrno);
+      fat_statfs(&fs_after, &rerrno);
+      if(fs_before.free_clusters - fs_after.free_clusters != 2) {
+          printf("Seeking from a rolled off cursor allocated a cluster\n");
+      }
+  }
+  memset(block_o_data, 0x42, 1024);
+
+  // enough files that the directory has to grow past its first cluster, each one found again
+  if(fat_mkdir("/many", 0777, &rerrno)) {
+      printf("Error making /many (%d) %s\n", rerrno, strerror(rerrno));
+  }
+  for(i=0;i<150;i++) {
+      char name[20];
+      sprintf(name, "/many/f%03d.txt", i);
+      if((fd = fat_open(name, O_WRONLY | O_CREAT, 0777, &rerrno)) < 0) {
+          printf("Error creating %s (%d) %s\n", name, rerrno, strerror(rerrno));
+          continue;
+      }
+      temp_uint = i;
+      fat_write(fd, &temp_uint, 4, &rerrno);
+      if(fat_close(fd, &rerrno)) {
+          printf("Error closing %s (%d) %s\n", name, rerrno, strerror(rerrno));
+      }
+  }
+  for(i=0;i<150;i++) {
+      char name[20];
+      sprintf(name, "/many/f%03d.txt", i);
+      if((fd = fat_open(name, O_RDONLY, 0777, &rerrno)) < 0) {
+          printf("Lost %s (%d) %s\n", name, rerrno, strerror(rerrno));
+          continue;
+      }
+      if((fat_read(fd, &temp_uint, 4, &rerrno) != 4) || (temp_uint != (uint32_t)i)) {
+          printf("Bad contents in %s\n", name);
+      }
+      fat_close(fd, &rerrno);
+  }
+
 //   result = fat_rmdir("/foo/bar", &rerrno);
 //   printf("rmdir /foo/bar: %d (%d) %s\n", result, rerrno, strerror(rerrno));
 //   
 //   result = fat_rmdir("/foo", &rerrno);
 //   printf("rmdir /foo: %d (%d) %s\n", result, rerrno, strerror(rerrno));
   
+  if(fat_umount(&rerrno)) {
+    printf("Error unmounting (%d) %s\n", rerrno, strerror(rerrno));
+  }
+  
   block_pc_snapshot_all("writenfs.img");
   exit(0);
 }